@@ -26,152 +26,649 @@
 #define _XOPEN_SOURCE 700
 #define _FILE_OFFSET_BITS 64
 
+#include <errno.h>
 #include <fcntl.h>
-#include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "btrfs.h"
+#include "dedup.h"
+#include "io.h"
 #include "match.h"
 #include "action.h"
 
-static int copy_attributes(const char*,const char*,int);
-static int perform_link(link_func,const char*,const char*,const char*,int);
+enum {
+	DIR_CACHE = 16,
+	LINK_QUEUE = 64 /* groups waiting for a linking thread at most */
+};
 
-/* attempt to transfer file attributes from old to new */
-static int copy_attributes(const char *old, const char *new, int preserve) {
-	struct stat oldstat;
-	struct timespec timespecs[2];
+/* The directories links were made in recently, kept open so the links and
+ * their attributes can be made relative to them instead of walking each
+ * path from the start again. The least recently used one is closed first;
+ * the one the source of the group is in stays open. */
+struct dir_cache {
+	struct {
+		char *path;
+		size_t len, size;
+		int fd; /* -1 if the entry is unused */
+		unsigned long used;
+	} dirs[DIR_CACHE];
+	unsigned long clock;
+	int pinned; /* not to be closed */
+};
 
-	if (stat(old,&oldstat) == -1) {
-		fprintf(stderr,"Cannot call stat on %s: ",old);
-		perror(NULL);
-		return -1;
+/* the file the other files of a group are linked to */
+struct link_source {
+	const char *path;
+	int dir;
+	const char *name; /* relative to dir */
+	char *target; /* what symbolic links point to, NULL until needed */
+	int fd; /* opened when first needed, -1 before */
+};
+
+/* a group of files copied from the matcher, the source first */
+struct link_group {
+	char *paths; /* one after another */
+	size_t len, size;
+	int count;
+};
+
+/* what the linking threads share */
+struct link_queue {
+	struct link_group groups[LINK_QUEUE];
+	int head, count;
+	bool done; /* no more groups are coming */
+	bool failed; /* a link failed, stop */
+	link_flags flags;
+	link_func *lf;
+	const char *lf_name;
+	int link_count, group_count;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* what each linking thread keeps between groups */
+struct link_worker {
+	struct link_queue *queue;
+	struct dir_cache dirs;
+	char tmp[32]; /* temporary name of this thread */
+	pthread_t thread;
+};
+
+/* what print_group needs */
+struct print_state {
+	int printed; /* a group was printed before */
+	const char *const *changed; /* sorted, NULL to print all groups */
+	int changed_count;
+};
+
+static int copy_attributes(const struct stat*,int,const char*,const char*,int,bool);
+static int cmp_path(const void*,const void*);
+static int copy_group(struct matcher*,struct link_group*);
+static int dedupe_batch(int,off_t,int*,char**,int);
+static void free_dirs(struct dir_cache*);
+static void init_worker(struct link_worker*,struct link_queue*,int);
+static int link_group(struct link_worker*,const struct link_group*);
+static void *link_worker(void*);
+static int open_dir(struct dir_cache*,const char*,const char**);
+static int print_group(void*,const char*const*,int);
+static int perform_link(struct link_source*,link_func,const char*,struct dir_cache*,
+    const char*,const char*,bool);
+
+/* Returns the directory of path with the name of the file in it in *name,
+ * or -1 with errno set if the directory can't be opened. */
+static int open_dir(struct dir_cache *c, const char *path, const char **name) {
+	const char *slash = strrchr(path,'/');
+	size_t len;
+	char *buf;
+	int i, victim = -1;
+
+	if (slash == NULL) {
+		*name = path;
+		return AT_FDCWD;
 	}
 
+	/* keep the slash if the file is in the root directory */
+	len = slash - path + (slash == path);
+
+	for (i = 0; i < DIR_CACHE; i++) {
+		if (c->dirs[i].fd != -1 && c->dirs[i].len == len
+		    && memcmp(c->dirs[i].path,path,len) == 0) {
+			c->dirs[i].used = ++c->clock;
+			*name = slash + 1;
+			return c->dirs[i].fd;
+		}
+
+		if (c->dirs[i].fd == c->pinned && c->dirs[i].fd != -1) continue;
+		if (victim == -1 || c->dirs[i].used < c->dirs[victim].used) victim = i;
+	}
+
+	if (c->dirs[victim].size < len + 1) {
+		buf = realloc(c->dirs[victim].path,len + 1);
+		if (buf == NULL) return -1;
+
+		c->dirs[victim].path = buf;
+		c->dirs[victim].size = len + 1;
+	}
+
+	if (c->dirs[victim].fd != -1) close(c->dirs[victim].fd);
+
+	memcpy(c->dirs[victim].path,path,len);
+	c->dirs[victim].path[len] = '\0';
+	c->dirs[victim].len = len;
+	c->dirs[victim].used = ++c->clock;
+	c->dirs[victim].fd = open(c->dirs[victim].path,O_RDONLY|O_DIRECTORY|O_NOCTTY);
+	if (c->dirs[victim].fd == -1) return -1;
+
+	*name = slash + 1;
+	return c->dirs[victim].fd;
+}
+
+static void free_dirs(struct dir_cache *c) {
+	int i;
+
+	for (i = 0; i < DIR_CACHE; i++) {
+		if (c->dirs[i].fd != -1) close(c->dirs[i].fd);
+		free(c->dirs[i].path);
+	}
+}
+
+int hard_link(struct link_source *src, int dir, const char *name, int *fd) {
+	*fd = -1;
+	return linkat(src->dir,src->name,dir,name,0);
+}
+
+/* the link is in another directory, so it can't point to a relative path */
+int soft_link(struct link_source *src, int dir, const char *name, int *fd) {
+	*fd = -1;
+
+	if (src->target == NULL) src->target = realpath(src->path,NULL);
+	if (src->target == NULL) return -1;
+
+	return symlinkat(src->target,dir,name);
+}
+
+int clone_link(struct link_source *src, int dir, const char *name, int *fd) {
+	if (src->fd == -1) src->fd = openat(src->dir,src->name,O_RDONLY|O_NOCTTY);
+	if (src->fd == -1) return -1;
+
+	*fd = btrfs_clone(src->fd,dir,name);
+	return *fd == -1 ? -1 : 0;
+}
+
+/* Attempt to transfer the attributes st of dup to the new file tmp that is
+ * to replace it, open as fd. Without a descriptor, the new file is a
+ * symbolic link and only gets the times of dup. */
+static int copy_attributes(const struct stat *st, int dir, const char *tmp,
+    const char *dup, int fd, bool strict) {
+	struct timespec timespecs[2];
+	int retval;
+
 	/* call utimes first as chmod and chown may disallow this */
-	timespecs[0].tv_sec = oldstat.st_atime;
-	timespecs[0].tv_nsec = 0;
-	timespecs[1].tv_sec = oldstat.st_mtime;
-	timespecs[1].tv_nsec = 0;
+	timespecs[0] = st->st_atim;
+	timespecs[1] = st->st_mtim;
 
-	if (utimensat(AT_FDCWD,new,timespecs,AT_SYMLINK_NOFOLLOW) == -1) {
+	if (fd != -1) retval = futimens(fd,timespecs);
+	else retval = utimensat(dir,tmp,timespecs,AT_SYMLINK_NOFOLLOW);
+
+	if (retval == -1) {
 		fprintf(stderr,
 			"Cannot set modification and access times of file %s.\n"
-			"Times on file %s will be clobbered: ",new,old);
+			"Times on file %s will be clobbered: ",tmp,dup);
 		perror(NULL);
-		if (preserve&1) return -1;
+		if (strict) return -1;
 	}
 
-	/* skip rest in case of symlink */
-	if (preserve&2) return 0;
+	if (fd == -1) return 0;
 
-	if (chmod(new,oldstat.st_mode) == -1) {
+	if (fchmod(fd,st->st_mode) == -1) {
 		fprintf(stderr,
 			"Cannot set permission of file %s.\n"
-			"Permission of file %s will be clobbered: ",new,old);
+			"Permission of file %s will be clobbered: ",tmp,dup);
 		perror(NULL);
-		if (preserve&1) return -1;
+		if (strict) return -1;
 	}
 
-	if (chown(new,oldstat.st_uid,oldstat.st_gid) == -1) {
+	if (fchown(fd,st->st_uid,st->st_gid) == -1) {
 		fprintf(stderr,
 			"Cannot set ownership of file %s.\n"
-			"Ownership of file %s will be clobbered: ",new,old);
+			"Ownership of file %s will be clobbered: ",tmp,dup);
 		perror(NULL);
-		if (preserve&1) return -1;
+		if (strict) return -1;
 	}
 
 	return 0;
 }
 
-static int perform_link(
-	link_func do_link,
-	const char *lf_name,
-	const char *old,
-	const char *new,
-	int preserve) {
-
-	char *tmp, *new_dup;
-	int len;
+/* Make the link under a temporary name in the directory of dup, then move it
+ * over dup. */
+static int perform_link(struct link_source *src, link_func do_link, const char *lf_name,
+    struct dir_cache *dirs, const char *dup, const char *tmp, bool strict) {
+	struct stat st;
+	const char *name;
+	int dir = open_dir(dirs,dup,&name), fd = -1, retval = -1;
 
-	new_dup = strdup(new);
-	if (new_dup == NULL) {
-		perror("malloc failed");
-		return 1;
+	if (dir == -1) {
+		fprintf(stderr,"Cannot open directory of %s: ",dup);
+		perror(NULL);
+		return -1;
 	}
 
-	/* /fdup.##########.tmp where ########## refers to the pid */
-	len = strlen(new_dup) + 21;
+	/* the new file keeps the attributes of the one it replaces */
+	if (do_link != hard_link && fstatat(dir,name,&st,AT_SYMLINK_NOFOLLOW) == -1) {
+		fprintf(stderr,"Cannot call stat on %s: ",dup);
+		perror(NULL);
+		return -1;
+	}
 
-	tmp = malloc(len);
-	if (tmp == NULL) {
-		perror("malloc failed");
-		return 1;
+	if (do_link(src,dir,tmp,&fd) == -1) {
+		fprintf(stderr,"Cannot %s %s to %s: ",lf_name,src->path,dup);
+		perror(NULL);
+		return -1;
 	}
 
-	snprintf(tmp,len,"%s/fdup.%010d.tmp",dirname(new_dup),getpid());
-	free(new_dup);
+	/* hardlinks share the attributes of their source already */
+	if (do_link != hard_link && copy_attributes(&st,dir,tmp,dup,fd,strict) == -1)
+		goto fail;
 
-	if (do_link(old,tmp) == -1) {
-		fprintf(stderr,"Cannot %s %s to %s: ",lf_name,old,tmp);
+	if (renameat(dir,tmp,dir,name) == -1) {
+		fprintf(stderr,"Cannot rename temporary file to %s: ",dup);
 		perror(NULL);
-		free(tmp);
-		return -1;
+		goto fail;
 	}
 
-	/* In case of hardlinks, preservation is pointless, as both files point
-	 * to the same inode. Only do this in other modes. For symbolic links,
-	 * set bit 02 in preserve to only preserve access times */
-	preserve = (!!preserve) & (do_link == symlink) << 1;
+	retval = 0;
 
-	if (do_link != link && copy_attributes(new,tmp,preserve) == -1) {
-		free(tmp);
-		return -1;
+	fail:
+	if (retval != 0) unlinkat(dir,tmp,0);
+	if (fd != -1) close(fd);
+
+	return retval;
+}
+
+/* Copy the next group from the matcher into g. Returns 0 if there is no
+ * group left, -1 if out of memory and 1 otherwise. */
+static int copy_group(struct matcher *m, struct link_group *g) {
+	const char *path = next_group(m);
+	size_t len;
+	char *paths;
+
+	g->len = 0;
+	g->count = 0;
+
+	for (; path != NULL; path = next_file(m)) {
+		len = strlen(path) + 1;
+		if (g->len + len > g->size) {
+			paths = realloc(g->paths,2 * g->size + len);
+			if (paths == NULL) return -1;
+
+			g->paths = paths;
+			g->size = 2 * g->size + len;
+		}
+
+		memcpy(g->paths + g->len,path,len);
+		g->len += len;
+		g->count++;
 	}
 
-	if (rename(tmp,new) == -1) {
-		fprintf(stderr,"Cannot rename %s to %s: ",tmp,new);
+	return g->count > 0;
+}
+
+/* Link the files of a group to its first file in order. Returns 0 on
+ * success and 1 if a link failed. */
+static int link_group(struct link_worker *w, const struct link_group *g) {
+	struct link_queue *q = w->queue;
+	struct link_source src;
+	struct stat st;
+	const char *dup = g->paths;
+	int i, retval = 0;
+	bool stop = false;
+
+	src.path = g->paths;
+	src.dir = open_dir(&w->dirs,src.path,&src.name);
+	src.fd = -1;
+	src.target = NULL;
+	w->dirs.pinned = src.dir;
+
+	if (src.dir == -1 || fstatat(src.dir,src.name,&st,0) == -1) {
+		fprintf(stderr,"Cannot call stat on %s: ",src.path);
 		perror(NULL);
-		free(tmp);
-		return -1;
+		return 1;
 	}
 
-	free(tmp);
-	return 0;
+	for (i = 1; i < g->count && !stop; i++) {
+		dup += strlen(dup) + 1;
+
+		/* don't trust the hash if asked not to */
+		if (q->flags & LINKS_VERIFY) switch (compare_files(src.path,dup)) {
+		case 0: break;
+		case 1:
+			fprintf(stderr,"Not linking %s to %s: contents differ\n",src.path,dup);
+			/* fallthrough */
+		default: continue;
+		}
+
+		if (perform_link(&src,q->lf,q->lf_name,&w->dirs,dup,w->tmp,q->flags & LINKS_PRESERVE)) {
+			retval = 1;
+			break;
+		}
+
+		pthread_mutex_lock(&q->lock);
+		q->link_count++;
+		if (q->flags & LINKS_VERBOSE) fprintf(stderr,
+			"\rMade %9d links for %9d groups",q->link_count,q->group_count);
+		stop = q->failed;
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	if (src.fd != -1) close(src.fd);
+	free(src.target);
+
+	return retval;
+}
+
+/* take groups from the queue until there are none left or a link failed */
+static void *link_worker(void *arg) {
+	struct link_worker *w = arg;
+	struct link_queue *q = w->queue;
+	struct link_group g = { NULL, 0, 0, 0 }, slot;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		while (q->count == 0 && !q->done && !q->failed)
+			pthread_cond_wait(&q->cond,&q->lock);
+
+		if (q->failed || q->count == 0) {
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+
+		/* swap buffers with the queue so nothing is copied */
+		slot = q->groups[q->head];
+		q->groups[q->head] = g;
+		g = slot;
+		q->head = (q->head + 1) % LINK_QUEUE;
+		q->count--;
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+
+		if (link_group(w,&g)) {
+			pthread_mutex_lock(&q->lock);
+			q->failed = true;
+			pthread_cond_broadcast(&q->cond);
+			pthread_mutex_unlock(&q->lock);
+		}
+	}
+
+	free(g.paths);
+
+	return NULL;
+}
+
+static void init_worker(struct link_worker *w, struct link_queue *q, int index) {
+	int i;
+
+	w->queue = q;
+
+	for (i = 0; i < DIR_CACHE; i++) {
+		w->dirs.dirs[i].path = NULL;
+		w->dirs.dirs[i].size = 0;
+		w->dirs.dirs[i].fd = -1;
+		w->dirs.dirs[i].used = 0;
+	}
+
+	w->dirs.clock = 0;
+	w->dirs.pinned = -1;
+
+	/* fdup.##########.####.tmp where ########## refers to the pid and
+	 * #### to the thread, so threads linking into one directory don't
+	 * clash */
+	snprintf(w->tmp,sizeof w->tmp,"fdup.%010d.%04d.tmp",(int)getpid(),index);
+}
+
+/* The groups are independent of each other, so with more than one thread
+ * each group goes to the next thread that is free. The files of a group are
+ * linked in order by one thread. Once a link fails, no further links are
+ * made. */
+int make_links(struct matcher *m, link_flags f, link_func lf, const char *lf_name,
+    int threads) {
+	struct link_queue q;
+	struct link_worker *workers;
+	struct link_group g = { NULL, 0, 0, 0 }, slot;
+	int i, n = 0, err, found;
+	bool stop = false;
+
+	if (threads < 1) threads = 1;
+	workers = malloc(threads * sizeof *workers);
+	if (workers == NULL) {
+		perror("Cannot allocate memory");
+		return 1;
+	}
+
+	q.head = 0;
+	q.count = 0;
+	q.done = false;
+	q.failed = false;
+	q.flags = f;
+	q.lf = lf;
+	q.lf_name = lf_name;
+	q.link_count = 0;
+	q.group_count = 0;
+	memset(q.groups,0,sizeof q.groups);
+	pthread_mutex_init(&q.lock,NULL);
+	pthread_cond_init(&q.cond,NULL);
+
+	for (i = 0; i < threads; i++) init_worker(workers + i,&q,i);
+
+	if (threads > 1) for (n = 0; n < threads; n++) {
+		err = pthread_create(&workers[n].thread,NULL,link_worker,workers + n);
+		if (err != 0) {
+			fprintf(stderr,"Cannot create linking thread: %s\n",strerror(err));
+			break;
+		}
+	}
+
+	while (!stop && (found = copy_group(m,&g)) != 0) {
+		pthread_mutex_lock(&q.lock);
+
+		if (found == -1) {
+			perror("Cannot allocate memory");
+			q.failed = true;
+			pthread_mutex_unlock(&q.lock);
+			break;
+		}
+
+		q.group_count++;
+
+		/* if no thread could be created, do the work ourselves */
+		if (n == 0) {
+			pthread_mutex_unlock(&q.lock);
+			stop = q.failed = link_group(workers,&g);
+			continue;
+		}
+
+		while (q.count == LINK_QUEUE && !q.failed)
+			pthread_cond_wait(&q.cond,&q.lock);
+
+		if (!q.failed) {
+			i = (q.head + q.count++) % LINK_QUEUE;
+			slot = q.groups[i];
+			q.groups[i] = g;
+			g = slot;
+			pthread_cond_broadcast(&q.cond);
+		}
+
+		stop = q.failed;
+		pthread_mutex_unlock(&q.lock);
+	}
+
+	pthread_mutex_lock(&q.lock);
+	q.done = true;
+	pthread_cond_broadcast(&q.cond);
+	pthread_mutex_unlock(&q.lock);
+
+	for (i = 0; i < n; i++) pthread_join(workers[i].thread,NULL);
+
+	if (f & LINKS_VERBOSE && q.link_count > 0) fputc('\n',stderr);
+
+	for (i = 0; i < threads; i++) free_dirs(&workers[i].dirs);
+	for (i = 0; i < LINK_QUEUE; i++) free(q.groups[i].paths);
+	free(g.paths);
+	free(workers);
+	pthread_mutex_destroy(&q.lock);
+	pthread_cond_destroy(&q.cond);
+
+	return q.failed;
 }
 
-int make_links(struct matcher *m, link_flags f, link_func lf, const char *lf_name) {
+/* Share the extents of the first file of each group with the other files of
+ * the group. The files stay where they are and keep their attributes. The
+ * kernel compares the contents itself, so this is safe against concurrent
+ * writes. A group that fails is reported and the next one is tried. */
+int dedupe_dups(struct matcher *m, link_flags f) {
 	const char *orig, *dup;
-	int link_count = 0, pair_count = 0, preserve = f & LINKS_PRESERVE;
+	char *names[DEDUPE_MAX];
+	int fds[DEDUPE_MAX], src, fd, count = 0, dedupe_count = 0, group_count = 0;
+	int failed = 0;
+	struct stat src_stat, st;
 
 	while ((orig = next_group(m))) {
-		pair_count++;
-		while ((dup = next_file(m))) {
-			link_count++;
-			if (perform_link(lf,lf_name,orig,dup,preserve)) return 1;
-			if (f & LINKS_PRESERVE) fprintf(stderr,
-				"\rMade %9d links for %9d groups",link_count,pair_count);
+		group_count++;
+
+		src = open(orig,O_RDONLY|O_NOCTTY);
+		if (src == -1 || fstat(src,&src_stat) == -1) {
+			fprintf(stderr,"Cannot open %s: ",orig);
+			perror(NULL);
+			if (src != -1) close(src);
+			while (next_file(m));
+			failed = 1;
+			continue;
 		}
+
+		do {
+			dup = next_file(m);
+			if (dup != NULL) {
+				fd = dedupe_open(dup);
+				if (fd == -1 || fstat(fd,&st) == -1) {
+					fprintf(stderr,"Cannot open %s: ",dup);
+					perror(NULL);
+					if (fd != -1) close(fd);
+					failed = 1;
+					continue;
+				}
+
+				/* hardlinks share their extents already */
+				if (st.st_dev == src_stat.st_dev && st.st_ino == src_stat.st_ino) {
+					close(fd);
+					continue;
+				}
+
+				names[count] = strdup(dup);
+				if (names[count] == NULL) {
+					perror("Cannot allocate memory");
+					close(fd);
+					failed = 1;
+					continue;
+				}
+
+				fds[count++] = fd;
+			}
+
+			if (count == DEDUPE_MAX || (dup == NULL && count > 0)) {
+				if (dedupe_batch(src,src_stat.st_size,fds,names,count) == -1) {
+					fprintf(stderr,"Cannot deduplicate %s: ",orig);
+					perror(NULL);
+					failed = 1;
+					count = 0;
+
+					/* skip the rest of the group */
+					if (dup != NULL) while (next_file(m));
+					break;
+				}
+
+				dedupe_count += count;
+				count = 0;
+
+				if (f & LINKS_VERBOSE) fprintf(stderr,
+				    "\rDeduplicated %9d files in %9d groups",dedupe_count,group_count);
+			}
+		} while (dup != NULL);
+
+		close(src);
 	}
 
-	return 0;
+	if (f & LINKS_VERBOSE) fputc('\n',stderr);
+
+	return failed;
 }
 
-int print_dups(struct matcher *m) {
-	int first = 1;
-	const char *file;
+/* deduplicate, report the files that failed and close the destinations.
+ * Returns -1 with errno set if the source can't be deduplicated at all. */
+static int dedupe_batch(int src, off_t size, int *fds, char **names, int count) {
+	int results[DEDUPE_MAX], i, retval, err = 0;
 
-	while ((file = next_group(m))) {
-		if (first) first = 0;
-		else printf("\n");
+	retval = dedupe_files(src,size,fds,count,results);
+	if (retval == -1) err = errno;
 
-		puts(file);
+	for (i = 0; i < count; i++) {
+		if (retval == 0 && results[i] == DEDUPE_DIFFERS)
+			fprintf(stderr,"Not deduplicating %s: contents differ\n",names[i]);
+		else if (retval == 0 && results[i] != 0)
+			fprintf(stderr,"Cannot deduplicate %s: %s\n",names[i],strerror(results[i]));
 
-		while ((file = next_file(m))) puts(file);
+		close(fds[i]);
+		free(names[i]);
 	}
 
+	errno = err;
+	return retval;
+}
+
+/* Print a group, separated by a blank line from the one before. If there
+ * are changed files, only groups with one of them are printed. */
+static int print_group(void *arg, const char *const *paths, int count) {
+	struct print_state *p = arg;
+	int i;
+
+	if (p->changed != NULL) {
+		for (i = 0; i < count; i++)
+			if (bsearch(paths + i,p->changed,p->changed_count,sizeof *p->changed,cmp_path) != NULL)
+				break;
+
+		if (i == count) return 0;
+	}
+
+	if (p->printed) printf("\n");
+	p->printed = 1;
+
+	for (i = 0; i < count; i++) puts(paths[i]);
+
 	return 0;
 }
+
+static int cmp_path(const void *a, const void *b) {
+	return strcmp(*(const char *const*)a,*(const char *const*)b);
+}
+
+int print_dups(struct matcher *m) {
+	int printed = 0;
+
+	return print_changed_dups(m,NULL,0,&printed);
+}
+
+int print_changed_dups(struct matcher *m, const char *const *changed, int count,
+    int *printed) {
+	struct print_state p = { *printed, changed, count };
+	int retval;
+
+	/* a blank line separates the groups from those printed before */
+	retval = for_each_group(m,print_group,&p) != 0;
+	*printed = p.printed;
+
+	return retval;
+}
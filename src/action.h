@@ -25,13 +25,35 @@
 #ifndef ACTION_H
 #define ACTION_H
 
-typedef int link_func(const char*,const char*);
+struct link_source;
+
+/* Make a link to the source under the given name in the open directory.
+ * Stores a descriptor of the new file or -1 if there is none in the last
+ * argument. Returns 0 on success and -1 with errno set on failure. */
+typedef int link_func(struct link_source*,int,const char*,int*);
 typedef enum {
 	LINKS_PRESERVE = 0x1,
-	LINKS_VERBOSE  = 0x2
+	LINKS_VERBOSE  = 0x2,
+	LINKS_VERIFY   = 0x4 /* compare files byte by byte before linking */
 } link_flags;
 
-int make_links(struct matcher*,link_flags,link_func,const char*);
+/* the link functions make_links takes */
+int hard_link(struct link_source*,int,const char*,int*);
+int soft_link(struct link_source*,int,const char*,int*);
+int clone_link(struct link_source*,int,const char*,int*);
+
+/* link the files of each group to its first file with up to the given
+ * number of threads */
+int make_links(struct matcher*,link_flags,link_func,const char*,int);
+int dedupe_dups(struct matcher*,link_flags);
+/* Deduplicate the blocks files have in common, using up to the given number
+ * of threads and the enum io_method from io.h to read them. Needs a matcher
+ * that does not group the files. */
+int dedupe_blocks(struct matcher*,link_flags,int,int);
 int print_dups(struct matcher*);
+/* Print only the groups with one of the given files, sorted by path, or all
+ * groups if none are given. The last argument tells if groups were printed
+ * before and is set once one is. */
+int print_changed_dups(struct matcher*,const char*const*,int,int*);
 
 #endif /* ACTION_H */
@@ -0,0 +1,548 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "extent.h"
+#include "hash.h"
+#include "io.h"
+#include "match.h"
+#include "action.h"
+
+/* Files that are not equal as a whole, like images of virtual machines or
+ * snapshots of databases, often still have most of their blocks in common.
+ * Each file is cut into blocks at aligned offsets and the blocks are hashed.
+ * Every block whose hash equals that of an earlier block on the same device
+ * is then deduplicated against it, with runs of consecutive blocks merged
+ * into one range. The kernel compares the ranges before sharing them, so a
+ * hash collision can't damage a file. */
+
+enum {
+	BLOCK_SIZE = 128*1024, /* a multiple of the block size of file systems */
+	BLOCK_HASH = 16 /* length of the fast hash */
+};
+
+/* the files to index, one per inode */
+struct inode {
+	dev_t dev;
+	ino_t ino;
+	int file; /* for get_file */
+};
+
+struct block {
+	unsigned char hash[BLOCK_HASH];
+	dev_t dev;
+	int inode;
+	off_t offset;
+};
+
+/* a range of one file with the same contents as a range of another one */
+struct block_range {
+	int dst, src; /* indices into the inodes */
+	off_t dst_offset, src_offset, length;
+};
+
+/* what the indexing threads share */
+struct block_index {
+	struct matcher *m;
+	struct inode *inodes;
+	int inode_count;
+	int next;
+	int done;
+	struct block *blocks;
+	size_t block_count, block_size;
+	enum io_method method;
+	bool verbose;
+	bool failed;
+	pthread_mutex_t lock;
+};
+
+/* the file being indexed by one thread */
+struct block_reader {
+	struct hasher hasher;
+	int inode;
+	dev_t dev;
+	off_t offset; /* where the current block starts */
+	size_t filled; /* bytes of the current block read so far */
+	bool zero; /* the current block is all zeros so far */
+	struct block *blocks; /* the blocks found so far */
+	size_t count, size;
+	bool failed;
+};
+
+static bool all_zero(const unsigned char*,size_t);
+static void block_sink(void*,const unsigned char*,size_t);
+static int cmp_block(const void*,const void*);
+static int cmp_inode(const void*,const void*);
+static int cmp_range(const void*,const void*);
+static int collect_inodes(struct matcher*,struct inode**,int*);
+static int dedupe_ranges(struct matcher*,const struct inode*,const struct block_range*,size_t,link_flags);
+static int index_blocks(struct block_index*,int);
+static void index_file(struct block_index*,struct block_reader*,struct io_buffer*,int);
+static void *index_worker(void*);
+static size_t make_ranges(struct block*,size_t,struct block_range*);
+
+int dedupe_blocks(struct matcher *m, link_flags f, int threads, int method) {
+	struct block_index ix;
+	struct block_range *ranges;
+	size_t range_count;
+	int retval;
+
+	ix.m = m;
+	ix.next = 0;
+	ix.done = 0;
+	ix.blocks = NULL;
+	ix.block_count = 0;
+	ix.block_size = 0;
+	ix.method = method;
+	ix.verbose = f & LINKS_VERBOSE;
+	ix.failed = false;
+
+	if (collect_inodes(m,&ix.inodes,&ix.inode_count)) return 1;
+
+	if (index_blocks(&ix,threads)) {
+		free(ix.inodes);
+		free(ix.blocks);
+		return 1;
+	}
+
+	/* each block is the destination of at most one range */
+	ranges = malloc((ix.block_count + 1) * sizeof *ranges);
+	if (ranges == NULL) {
+		perror("Cannot allocate memory");
+		free(ix.inodes);
+		free(ix.blocks);
+		return 1;
+	}
+
+	range_count = make_ranges(ix.blocks,ix.block_count,ranges);
+	free(ix.blocks);
+
+	retval = dedupe_ranges(m,ix.inodes,ranges,range_count,f);
+
+	free(ranges);
+	free(ix.inodes);
+
+	return retval;
+}
+
+/* Only files of at least one block are indexed, and hardlinks to the same
+ * file only once. */
+static int collect_inodes(struct matcher *m, struct inode **inodes, int *count) {
+	struct stat st;
+	int i, n, file_count = get_file_count(m);
+
+	*inodes = malloc((file_count + 1) * sizeof **inodes);
+	if (*inodes == NULL) {
+		perror("Cannot allocate memory");
+		return 1;
+	}
+
+	for (i = n = 0; i < file_count; i++) {
+		if (get_file(m,i,&st) == NULL) {
+			perror("Cannot allocate memory");
+			free(*inodes);
+			return 1;
+		}
+
+		if (st.st_size < BLOCK_SIZE) continue;
+
+		(*inodes)[n].dev = st.st_dev;
+		(*inodes)[n].ino = st.st_ino;
+		(*inodes)[n].file = i;
+		n++;
+	}
+
+	qsort(*inodes,n,sizeof **inodes,cmp_inode);
+
+	for (i = *count = 0; i < n; i++)
+		if (i == 0 || (*inodes)[i].dev != (*inodes)[i-1].dev || (*inodes)[i].ino != (*inodes)[i-1].ino)
+			(*inodes)[(*count)++] = (*inodes)[i];
+
+	return 0;
+}
+
+static int cmp_inode(const void *a_void, const void *b_void) {
+	const struct inode *a = a_void, *b = b_void;
+
+	if (a->dev != b->dev) return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino) return a->ino < b->ino ? -1 : 1;
+	if (a->file != b->file) return a->file < b->file ? -1 : 1;
+
+	return 0;
+}
+
+/* hash the blocks of all files with up to the given number of threads */
+static int index_blocks(struct block_index *ix, int threads) {
+	pthread_t *workers = NULL;
+	int i = 0, err;
+
+	if (threads > ix->inode_count) threads = ix->inode_count;
+
+	pthread_mutex_init(&ix->lock,NULL);
+
+	if (threads > 1) workers = malloc(threads * sizeof *workers);
+
+	if (workers != NULL) for (i = 0; i < threads; i++) {
+		err = pthread_create(workers+i,NULL,index_worker,ix);
+		if (err != 0) {
+			fprintf(stderr,"Cannot create indexing thread: %s\n",strerror(err));
+			break;
+		}
+	}
+
+	/* if no thread could be created, do the work ourselves */
+	if (i == 0) index_worker(ix);
+
+	while (i-- > 0) pthread_join(workers[i],NULL);
+
+	pthread_mutex_destroy(&ix->lock);
+	free(workers);
+
+	if (ix->verbose && ix->inode_count > 0) fputc('\n',stderr);
+
+	return ix->failed;
+}
+
+static void *index_worker(void *arg) {
+	struct block_index *ix = arg;
+	struct block_reader r;
+	struct io_buffer buf = { NULL, 0 };
+	int i;
+
+	r.blocks = NULL;
+	r.size = 0;
+	r.hasher.evp = NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&ix->lock);
+		i = ix->failed ? ix->inode_count : ix->next++;
+		pthread_mutex_unlock(&ix->lock);
+
+		if (i >= ix->inode_count) break;
+
+		index_file(ix,&r,&buf,i);
+	}
+
+	hasher_free(&r.hasher);
+	free_io_buffer(&buf);
+	free(r.blocks);
+
+	return NULL;
+}
+
+/* Hash the blocks of the file of inode i and add them to the index. Files
+ * that can't be read are left out. */
+static void index_file(struct block_index *ix, struct block_reader *r,
+    struct io_buffer *buf, int i) {
+	struct block *blocks;
+	struct stat st;
+	const char *file;
+	char *path = NULL;
+	size_t size;
+
+	/* get_file returns the same buffer each time */
+	pthread_mutex_lock(&ix->lock);
+	file = get_file(ix->m,ix->inodes[i].file,&st);
+	if (file != NULL) path = strdup(file);
+	pthread_mutex_unlock(&ix->lock);
+
+	if (path == NULL) {
+		perror("Cannot allocate memory");
+		goto fail;
+	}
+
+	r->inode = i;
+	r->dev = st.st_dev;
+	r->offset = 0;
+	r->filled = 0;
+	r->zero = true;
+	r->count = 0;
+	r->failed = false;
+	hasher_init(&r->hasher,HASH_FAST);
+
+	/* the partial block at the end is left alone */
+	read_range(path,0,st.st_size,ix->method,buf,block_sink,r);
+	free(path);
+
+	if (r->failed) {
+		perror("Cannot allocate memory");
+		goto fail;
+	}
+
+	pthread_mutex_lock(&ix->lock);
+
+	if (ix->block_count + r->count > ix->block_size) {
+		size = 2 * ix->block_size + r->count;
+		blocks = realloc(ix->blocks,size * sizeof *blocks);
+		if (blocks == NULL) {
+			pthread_mutex_unlock(&ix->lock);
+			perror("Cannot allocate memory");
+			goto fail;
+		}
+
+		ix->blocks = blocks;
+		ix->block_size = size;
+	}
+
+	memcpy(ix->blocks + ix->block_count,r->blocks,r->count * sizeof *r->blocks);
+	ix->block_count += r->count;
+	ix->done++;
+
+	if (ix->verbose) fprintf(stderr,"\rIndexed %9d of %9d files, %12zu blocks",
+	    ix->done,ix->inode_count,ix->block_count);
+
+	pthread_mutex_unlock(&ix->lock);
+
+	return;
+
+	fail:
+	pthread_mutex_lock(&ix->lock);
+	ix->failed = true;
+	pthread_mutex_unlock(&ix->lock);
+}
+
+/* Blocks of zeros are left out; they are better turned into holes. */
+static void block_sink(void *arg, const unsigned char *data, size_t len) {
+	struct block_reader *r = arg;
+	struct block *blocks;
+	size_t n, size;
+
+	while (len > 0) {
+		n = BLOCK_SIZE - r->filled;
+		if (n > len) n = len;
+
+		hasher_update(&r->hasher,data,n);
+		r->zero = r->zero && all_zero(data,n);
+		r->filled += n;
+		data += n;
+		len -= n;
+
+		if (r->filled < BLOCK_SIZE) break;
+
+		if (!r->zero && r->count == r->size) {
+			size = 2 * r->size + 64;
+			blocks = realloc(r->blocks,size * sizeof *blocks);
+			if (blocks == NULL) r->failed = true;
+			else {
+				r->blocks = blocks;
+				r->size = size;
+			}
+		}
+
+		if (!r->zero && !r->failed) {
+			hasher_final(&r->hasher,r->blocks[r->count].hash);
+			r->blocks[r->count].dev = r->dev;
+			r->blocks[r->count].inode = r->inode;
+			r->blocks[r->count].offset = r->offset;
+			r->count++;
+		}
+
+		hasher_init(&r->hasher,HASH_FAST);
+		r->offset += BLOCK_SIZE;
+		r->filled = 0;
+		r->zero = true;
+	}
+}
+
+static bool all_zero(const unsigned char *data, size_t len) {
+	static const unsigned char zeros[4096];
+	size_t n;
+
+	while (len > 0) {
+		n = len < sizeof zeros ? len : sizeof zeros;
+		if (memcmp(data,zeros,n) != 0) return false;
+
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* Sort the blocks so equal ones on the same device are next to each other,
+ * the first of them coming from the earliest file and offset. That block is
+ * the source for all others equal to it, so no block is both source and
+ * destination. A file can still be the source of one range and the
+ * destination of another. */
+static size_t make_ranges(struct block *blocks, size_t count, struct block_range *ranges) {
+	struct block_range *last;
+	size_t i, first = 0, n = 0;
+
+	qsort(blocks,count,sizeof *blocks,cmp_block);
+
+	for (i = 1; i < count; i++) {
+		if (blocks[i].dev != blocks[first].dev
+		    || memcmp(blocks[i].hash,blocks[first].hash,BLOCK_HASH) != 0) {
+			first = i;
+			continue;
+		}
+
+		ranges[n].dst = blocks[i].inode;
+		ranges[n].dst_offset = blocks[i].offset;
+		ranges[n].src = blocks[first].inode;
+		ranges[n].src_offset = blocks[first].offset;
+		ranges[n].length = BLOCK_SIZE;
+		n++;
+	}
+
+	/* merge runs of blocks that follow each other in both files */
+	qsort(ranges,n,sizeof *ranges,cmp_range);
+
+	for (i = 0, count = 0; i < n; i++) {
+		last = ranges + count - 1;
+		if (count > 0 && last->dst == ranges[i].dst && last->src == ranges[i].src
+		    && last->dst_offset + last->length == ranges[i].dst_offset
+		    && last->src_offset + last->length == ranges[i].src_offset)
+			last->length += ranges[i].length;
+		else ranges[count++] = ranges[i];
+	}
+
+	return count;
+}
+
+static int cmp_block(const void *a_void, const void *b_void) {
+	const struct block *a = a_void, *b = b_void;
+	int cmp;
+
+	if (a->dev != b->dev) return a->dev < b->dev ? -1 : 1;
+
+	cmp = memcmp(a->hash,b->hash,BLOCK_HASH);
+	if (cmp != 0) return cmp;
+
+	if (a->inode != b->inode) return a->inode < b->inode ? -1 : 1;
+	if (a->offset != b->offset) return a->offset < b->offset ? -1 : 1;
+
+	return 0;
+}
+
+static int cmp_range(const void *a_void, const void *b_void) {
+	const struct block_range *a = a_void, *b = b_void;
+
+	if (a->dst != b->dst) return a->dst < b->dst ? -1 : 1;
+	if (a->dst_offset != b->dst_offset) return a->dst_offset < b->dst_offset ? -1 : 1;
+
+	return 0;
+}
+
+/* Deduplicate the ranges, which are ordered by their destination, and
+ * report the bytes the kernel deduplicated. That is an upper bound of the
+ * space freed, as other copies may still hold on to the old blocks. Ranges
+ * whose storage is shared already are skipped. */
+static int dedupe_ranges(struct matcher *m, const struct inode *inodes,
+    const struct block_range *ranges, size_t count, link_flags f) {
+	struct stat st;
+	const char *path;
+	char *dst_path = NULL;
+	off_t deduped = 0;
+	size_t i;
+	int src = -1, dst = -1, src_inode = -1, dst_inode = -1, result, retval = 0;
+	int file_count = 0, range_count = 0;
+	bool skip = false;
+
+	for (i = 0; i < count; i++) {
+		if (ranges[i].dst != dst_inode) {
+			if (dst != -1) close(dst);
+			free(dst_path);
+			dst_path = NULL;
+
+			dst_inode = ranges[i].dst;
+			path = get_file(m,inodes[dst_inode].file,&st);
+			dst = path != NULL ? dedupe_open(path) : -1;
+			if (dst == -1) {
+				fprintf(stderr,"Cannot open %s: ",path != NULL ? path : "file");
+				perror(NULL);
+				skip = true;
+				continue;
+			}
+
+			dst_path = strdup(path);
+			skip = dst_path == NULL;
+			if (skip) perror("Cannot allocate memory");
+			else file_count++;
+		}
+
+		if (skip) continue;
+
+		if (ranges[i].src != src_inode) {
+			if (src != -1) close(src);
+
+			src_inode = ranges[i].src;
+			path = get_file(m,inodes[src_inode].file,&st);
+			src = path != NULL ? open(path,O_RDONLY|O_NOCTTY) : -1;
+			if (src == -1) {
+				fprintf(stderr,"Cannot open %s: ",path != NULL ? path : "file");
+				perror(NULL);
+				src_inode = -1;
+				continue;
+			}
+		}
+
+		if (same_storage(src,ranges[i].src_offset,dst,ranges[i].dst_offset,ranges[i].length))
+			continue;
+
+		result = dedupe_range(src,ranges[i].src_offset,dst,ranges[i].dst_offset,
+		    ranges[i].length,&deduped);
+		if (result == -1) {
+			fprintf(stderr,"Cannot deduplicate %s: ",dst_path);
+			perror(NULL);
+			retval = 1;
+			break;
+		} else if (result == DEDUPE_DIFFERS)
+			fprintf(stderr,"Not deduplicating %s at %lld: contents differ\n",
+			    dst_path,(long long)ranges[i].dst_offset);
+		else if (result != 0) {
+			fprintf(stderr,"Cannot deduplicate %s: %s\n",dst_path,strerror(result));
+			skip = true;
+		} else range_count++;
+
+		if (f & LINKS_VERBOSE) fprintf(stderr,
+		    "\rDeduplicated %9d ranges in %9d files",range_count,file_count);
+	}
+
+	if (f & LINKS_VERBOSE && range_count > 0) fputc('\n',stderr);
+
+	if (src != -1) close(src);
+	if (dst != -1) close(dst);
+	free(dst_path);
+
+	printf("Deduplicated %lld bytes in %d ranges\n",(long long)deduped,range_count);
+
+	return retval;
+}
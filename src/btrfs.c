@@ -41,57 +41,51 @@
 # include <sys/types.h>
 # include <unistd.h>
 
-int btrfs_clone(const char *old, const char *new) {
+/* The new file is removed again if it can't be made a copy. */
+int btrfs_clone(int old_fd, int dir, const char *name) {
 	struct stat old_stat, new_stat;
 	struct statfs fs_stat;
-	int old_fd = -1, new_fd = -1;
-	int retval = 0;
+	int new_fd, err;
 
 	/* figure out whether both files are on the same file system and whether
 	 * the file system is actually a btrfs */
-	if (statfs(old,&fs_stat) == -1) return -1;
+	if (fstatfs(old_fd,&fs_stat) == -1) return -1;
 	if (fs_stat.f_type != BTRFS_SUPER_MAGIC) {
 		errno = EPERM;
 		return -1;
 	}
 
-	if (stat(old,&old_stat) == -1) return -1;
+	if (fstat(old_fd,&old_stat) == -1) return -1;
 
-	new_fd = open(new,O_WRONLY|O_CREAT|O_EXCL,0664);
+	new_fd = openat(dir,name,O_WRONLY|O_CREAT|O_EXCL|O_NOCTTY,0664);
 	if (new_fd == -1) return -1;
 
-	if (stat(new,&new_stat) == -1) {
-		retval = -1;
-		goto cleanup;
-	}
+	if (fstat(new_fd,&new_stat) == -1) goto fail;
 
 	if (old_stat.st_dev != new_stat.st_dev) {
 		errno = EXDEV;
-		retval = -1;
-		goto cleanup;
-	}
-
-	old_fd = open(old,O_RDONLY);
-	if (old_fd == -1) {
-		retval = -1;
-		goto cleanup;
+		goto fail;
 	}
 
-	retval = ioctl(new_fd,BTRFS_IOC_CLONE,old_fd);
+	if (ioctl(new_fd,BTRFS_IOC_CLONE,old_fd) == -1) goto fail;
 
-	cleanup:
+	return new_fd;
 
-	if (old_fd != -1) close(old_fd);
-	if (new_fd != -1) close(new_fd);
+	fail:
+	err = errno;
+	close(new_fd);
+	unlinkat(dir,name,0);
+	errno = err;
 
-	return retval;
+	return -1;
 }
 
 #else
 
-int btrfs_clone(const char *old, const char *new) {
-	(void)old;
-	(void)new;
+int btrfs_clone(int old_fd, int dir, const char *name) {
+	(void)old_fd;
+	(void)dir;
+	(void)name;
 	errno = ENOTSUP;
 	return -1;
 }
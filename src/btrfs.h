@@ -25,10 +25,12 @@
 #ifndef BTRFS_H
 #define BTRFS_H
 
-/* perform a btrfs lightweight copy. If this is not supported by the operating
- * system fdup runs on (i.e. fdup does not run on Linux), the return value is
- * -1 and errno is set to ENOTSUP. btrfs_clone refuses to clone into an
- * existing file */
-int btrfs_clone(const char*,const char*);
+/* perform a btrfs lightweight copy of the open file into a new file of the
+ * given name in the open directory and return a descriptor of the copy,
+ * open for writing. If this is not supported by the operating system fdup
+ * runs on (i.e. fdup does not run on Linux), the return value is -1 and
+ * errno is set to ENOTSUP. btrfs_clone refuses to clone into an existing
+ * file */
+int btrfs_clone(int,int,const char*);
 
 #endif
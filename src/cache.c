@@ -0,0 +1,444 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "match.h"
+
+/* all fields are in native byte order. The version field doubles as a byte
+ * order mark. */
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t algorithm; /* an enum hash_algorithm */
+	uint32_t hash_length;
+	uint32_t stage_count;
+	uint64_t count;
+	struct {
+		uint32_t type; /* a stage_type */
+		uint32_t pad;
+		int64_t length;
+	} stages[MAX_STAGES]; /* the unused ones are zero */
+};
+
+/* Each entry is followed by stage_count + 1 hashes of hash_length bytes:
+ * the short hash after each stage, then the full hash. Entries are padded
+ * to a multiple of 8 bytes. */
+struct cache_entry {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime; /* in nanoseconds */
+	int64_t ctime;
+	uint32_t known; /* bit i is set if hash i is known */
+	uint32_t pad;
+};
+
+struct hash_cache {
+	char *path;
+	struct cache_header header; /* what the cache is written with */
+	size_t entry_size;
+	void *map; /* the mapped cache file or NULL */
+	size_t map_size;
+	const char *entries;
+	size_t count;
+	size_t old_size; /* size of the entries in the file */
+	int old_stage_count; /* the full hash is hash old_stage_count there */
+	int same_stages; /* the short hashes in the file can be used */
+	unsigned char *seen; /* one for each entry in the file */
+	char *pending; /* entries inserted in this run */
+	size_t pending_count;
+	size_t pending_size;
+};
+
+static const char cache_magic[8] = "FDUPHASH";
+enum { CACHE_VERSION = 0x01020303 };
+
+#define ENTRY(base,size,i) ((struct cache_entry*)((char*)(base) + (i) * (size)))
+#define ENTRY_HASH(e,i,len) ((unsigned char*)((e) + 1) + (size_t)(i) * (len))
+
+static int cmp_entry(const void*,const void*);
+static size_t entry_size(int,int);
+static const struct cache_entry *find_entry(struct hash_cache*,const struct stat*);
+static void make_entry(struct cache_entry*,const struct stat*);
+static void merge_old(struct hash_cache*,struct cache_entry*,const struct cache_entry*);
+static int same_file(const struct cache_entry*,const struct cache_entry*);
+
+struct hash_cache *open_cache(const char *path, int algorithm, int hash_length,
+    const struct stage *stages, int stage_count) {
+	struct hash_cache *c = calloc(1,sizeof *c);
+	const struct cache_header *header;
+	struct stat st;
+	int fd, i;
+
+	if (c == NULL) {
+		perror("Cannot allocate memory");
+		return NULL;
+	}
+
+	c->path = strdup(path);
+	if (c->path == NULL) {
+		perror("Cannot allocate memory");
+		free(c);
+		return NULL;
+	}
+
+	memcpy(c->header.magic,cache_magic,sizeof cache_magic);
+	c->header.version = CACHE_VERSION;
+	c->header.algorithm = algorithm;
+	c->header.hash_length = hash_length;
+	c->header.stage_count = stage_count;
+	for (i = 0; i < stage_count; i++) {
+		c->header.stages[i].type = stages[i].type;
+		c->header.stages[i].length = stages[i].length;
+	}
+
+	c->entry_size = entry_size(stage_count,hash_length);
+
+	fd = open(path,O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) return c;
+		fprintf(stderr,"Cannot open hash cache %s: ",path);
+		perror(NULL);
+		close_cache(c);
+		return NULL;
+	}
+
+	if (fstat(fd,&st) == -1) {
+		fprintf(stderr,"Cannot call stat on hash cache %s: ",path);
+		perror(NULL);
+		close(fd);
+		close_cache(c);
+		return NULL;
+	}
+
+	if ((size_t)st.st_size < sizeof *header) goto invalid;
+
+	c->map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (c->map == MAP_FAILED) {
+		fprintf(stderr,"Cannot map hash cache %s: ",path);
+		perror(NULL);
+		c->map = NULL;
+		close_cache(c);
+		return NULL;
+	}
+
+	c->map_size = st.st_size;
+	header = c->map;
+
+	if (memcmp(header->magic,cache_magic,sizeof cache_magic) != 0
+	    || header->version != CACHE_VERSION
+	    || header->stage_count > MAX_STAGES)
+		goto invalid;
+
+	/* the cache is rewritten with the new algorithm on write_cache */
+	if (header->algorithm != (uint32_t)algorithm
+	    || header->hash_length != (uint32_t)hash_length) {
+		fprintf(stderr,"Ignoring hash cache %s made with another hash algorithm\n",path);
+		return c;
+	}
+
+	c->old_size = entry_size(header->stage_count,hash_length);
+	if (header->count != (c->map_size - sizeof *header) / c->old_size
+	    || (c->map_size - sizeof *header) % c->old_size != 0)
+		goto invalid;
+
+	c->seen = calloc(header->count,1);
+	if (c->seen == NULL && header->count > 0) {
+		perror("Cannot allocate memory");
+		close_cache(c);
+		return NULL;
+	}
+
+	c->entries = (const char*)(header + 1);
+	c->count = header->count;
+	c->old_stage_count = header->stage_count;
+	c->same_stages = memcmp(header->stages,c->header.stages,sizeof header->stages) == 0
+	    && header->stage_count == (uint32_t)stage_count;
+
+	return c;
+
+	invalid:
+	fprintf(stderr,"Ignoring invalid hash cache %s\n",path);
+	if (c->map == NULL) close(fd);
+	c->entries = NULL;
+	c->count = 0;
+	return c;
+}
+
+static size_t entry_size(int stage_count, int hash_length) {
+	size_t size = sizeof(struct cache_entry) + (size_t)(stage_count + 1) * hash_length;
+
+	return size + -size % 8;
+}
+
+static int cmp_entry(const void *aa, const void *bb) {
+	const struct cache_entry *a = aa, *b = bb;
+
+	if (a->dev != b->dev) return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino) return a->ino < b->ino ? -1 : 1;
+	return 0;
+}
+
+static void make_entry(struct cache_entry *e, const struct stat *st) {
+	memset(e,0,sizeof *e);
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim.tv_sec * INT64_C(1000000000) + st->st_mtim.tv_nsec;
+	e->ctime = st->st_ctim.tv_sec * INT64_C(1000000000) + st->st_ctim.tv_nsec;
+}
+
+/* do the two entries describe the same, unmodified file? */
+static int same_file(const struct cache_entry *a, const struct cache_entry *b) {
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+	    && a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+/* the entry of the file in the cache file if it is unmodified, else NULL */
+static const struct cache_entry *find_entry(struct hash_cache *c, const struct stat *st) {
+	struct cache_entry key;
+	const struct cache_entry *e;
+
+	if (c->count == 0) return NULL;
+
+	make_entry(&key,st);
+	e = bsearch(&key,c->entries,c->count,c->old_size,cmp_entry);
+
+	return e != NULL && same_file(e,&key) ? e : NULL;
+}
+
+void cache_seen(struct hash_cache *c, const struct stat *st) {
+	const struct cache_entry *e = find_entry(c,st);
+
+	if (e != NULL) c->seen[((const char*)e - c->entries) / c->old_size] = 1;
+}
+
+int cache_lookup(struct hash_cache *c, const struct stat *st, int stage, unsigned char *hash) {
+	const struct cache_entry *e = find_entry(c,st);
+	int stage_count = c->header.stage_count, hash_length = c->header.hash_length;
+
+	if (e == NULL) return 0;
+
+	/* short hashes only match if they were taken the same way */
+	if (stage == stage_count) stage = c->old_stage_count;
+	else if (!c->same_stages) return 0;
+
+	if (!(e->known & 1u << stage)) return 0;
+
+	memcpy(hash,ENTRY_HASH(e,stage,hash_length),hash_length);
+	return 1;
+}
+
+int cache_insert(struct hash_cache *c, const struct stat *st, int stage,
+    const unsigned char *hash) {
+	struct cache_entry *e;
+	char *new_pending;
+	size_t new_size;
+
+	if (c->pending_count == c->pending_size) {
+		new_size = c->pending_size == 0 ? 1024 : 2 * c->pending_size;
+		new_pending = realloc(c->pending,new_size * c->entry_size);
+		if (new_pending == NULL) {
+			perror("Cannot allocate memory");
+			return 1;
+		}
+
+		c->pending = new_pending;
+		c->pending_size = new_size;
+	}
+
+	e = ENTRY(c->pending,c->entry_size,c->pending_count++);
+	memset(e,0,c->entry_size);
+	make_entry(e,st);
+	e->known = 1u << stage;
+	memcpy(ENTRY_HASH(e,stage,c->header.hash_length),hash,c->header.hash_length);
+
+	return 0;
+}
+
+/* add the hashes of an old entry that still apply to the entry e */
+static void merge_old(struct hash_cache *c, struct cache_entry *e, const struct cache_entry *old) {
+	int i, stage_count = c->header.stage_count, hash_length = c->header.hash_length;
+
+	if (old->known & 1u << c->old_stage_count && !(e->known & 1u << stage_count)) {
+		memcpy(ENTRY_HASH(e,stage_count,hash_length),
+		    ENTRY_HASH(old,c->old_stage_count,hash_length),hash_length);
+		e->known |= 1u << stage_count;
+	}
+
+	if (c->same_stages) for (i = 0; i < stage_count; i++)
+		if (old->known & 1u << i && !(e->known & 1u << i)) {
+			memcpy(ENTRY_HASH(e,i,hash_length),ENTRY_HASH(old,i,hash_length),hash_length);
+			e->known |= 1u << i;
+		}
+}
+
+/* Merge the old entries with the pending ones into a temporary file next to
+ * the cache and move it over the cache. The pending entries for a file are
+ * combined with each other and with its old entry if the file is unmodified;
+ * they replace the old entry otherwise. */
+int write_cache(struct hash_cache *c, int prune) {
+	struct cache_entry *out, *p, *q;
+	const struct cache_entry *old;
+	size_t i = 0, j = 0, k, len, size = c->entry_size;
+	int hash_length = c->header.hash_length, stage_count = c->header.stage_count;
+	int fd, cmp, stage;
+	char *tmp;
+	FILE *f;
+
+	qsort(c->pending,c->pending_count,size,cmp_entry);
+
+	out = malloc(size);
+	len = strlen(c->path) + 8;
+	tmp = malloc(len);
+	if (out == NULL || tmp == NULL) {
+		perror("Cannot allocate memory");
+		free(out);
+		free(tmp);
+		return 1;
+	}
+
+	snprintf(tmp,len,"%s.XXXXXX",c->path);
+	fd = mkstemp(tmp);
+	if (fd == -1 || (f = fdopen(fd,"wb")) == NULL) {
+		fprintf(stderr,"Cannot create temporary file for hash cache %s: ",c->path);
+		perror(NULL);
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(out);
+		free(tmp);
+		return 1;
+	}
+
+	/* the header is written again once the number of entries is known */
+	c->header.count = 0;
+	if (fwrite(&c->header,sizeof c->header,1,f) != 1) goto fail;
+
+	while (i < c->count || j < c->pending_count) {
+		old = i < c->count ? ENTRY(c->entries,c->old_size,i) : NULL;
+		p = j < c->pending_count ? ENTRY(c->pending,size,j) : NULL;
+
+		if (old == NULL) cmp = 1;
+		else if (p == NULL) cmp = -1;
+		else cmp = cmp_entry(old,p);
+
+		memset(out,0,size);
+
+		if (cmp < 0) {
+			/* files not seen in this run are likely gone */
+			if (prune && !c->seen[i]) {
+				i++;
+				continue;
+			}
+
+			*out = *old;
+			out->known = 0;
+			merge_old(c,out,old);
+			i++;
+		} else {
+			/* hardlinks may have been inserted more than once */
+			*out = *p;
+			out->known = 0;
+			for (k = j; k < c->pending_count; k++) {
+				q = ENTRY(c->pending,size,k);
+				if (cmp_entry(p,q) != 0) break;
+
+				/* the file changed while it was hashed */
+				if (!same_file(out,q)) {
+					*out = *q;
+					out->known = 0;
+				}
+
+				for (stage = 0; stage <= stage_count; stage++) if (q->known & 1u << stage)
+					memcpy(ENTRY_HASH(out,stage,hash_length),ENTRY_HASH(q,stage,hash_length),hash_length);
+
+				out->known |= q->known;
+			}
+
+			j = k;
+			if (cmp == 0) {
+				if (same_file(out,old)) merge_old(c,out,old);
+				i++;
+			}
+		}
+
+		if (out->known == 0) continue;
+		if (fwrite(out,size,1,f) != 1) goto fail;
+		c->header.count++;
+	}
+
+	if (fseeko(f,0,SEEK_SET) == -1) goto fail;
+	if (fwrite(&c->header,sizeof c->header,1,f) != 1) goto fail;
+	if (fflush(f) == EOF || fsync(fd) == -1) goto fail;
+
+	if (fclose(f) == EOF) {
+		f = NULL;
+		goto fail;
+	}
+
+	if (rename(tmp,c->path) == -1) {
+		f = NULL;
+		goto fail;
+	}
+
+	free(out);
+	free(tmp);
+	return 0;
+
+	fail:
+	fprintf(stderr,"Cannot write hash cache %s: ",c->path);
+	perror(NULL);
+	if (f != NULL) fclose(f);
+	unlink(tmp);
+	free(out);
+	free(tmp);
+	return 1;
+}
+
+void close_cache(struct hash_cache *c) {
+	if (c->map != NULL) munmap(c->map,c->map_size);
+	free(c->seen);
+	free(c->pending);
+	free(c->path);
+	free(c);
+}
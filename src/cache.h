@@ -0,0 +1,59 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+/* A hash cache remembers the hashes of files between runs: the short hash
+ * after each sampling stage and the full hash. Entries are keyed by device,
+ * inode number, size, modification and change time; a file whose key
+ * changed is considered unknown to the cache. The cache file is a header
+ * followed by an array of entries sorted by device and inode number, so it
+ * can be mapped into memory and searched without parsing it. */
+
+struct stage;
+
+enum { CACHE_HASH_LENGTH = 32 };
+
+/* Open the cache for hashes of hash_length bytes made with the given enum
+ * hash_algorithm from hash.h and the given sampling stages. Returns NULL on
+ * error. A nonexistent file or one made with another algorithm yields an
+ * empty cache; of one made with other stages, only the full hashes are used. */
+struct hash_cache *open_cache(const char*,int,int,const struct stage*,int);
+/* Note that a file still exists, so write_cache keeps its entry. Not safe
+ * to call from multiple threads at once. */
+void cache_seen(struct hash_cache*,const struct stat*);
+/* Returns 1 and fills in the hash of the file after the given stage, the
+ * full hash for the number of stages, if it is in the cache, 0 if not. */
+int cache_lookup(struct hash_cache*,const struct stat*,int,unsigned char*);
+/* remember the hash of a file after the given stage for the next
+ * write_cache; returns 0 on success */
+int cache_insert(struct hash_cache*,const struct stat*,int,const unsigned char*);
+/* Atomically replace the cache file with the old entries and all entries
+ * inserted since open_cache. If prune is nonzero, old entries not passed to
+ * cache_seen or cache_insert are dropped. Returns 0 on success. */
+int write_cache(struct hash_cache*,int);
+void close_cache(struct hash_cache*);
+
+#endif /* CACHE_H */
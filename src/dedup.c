@@ -0,0 +1,168 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include "dedup.h"
+
+#ifdef __linux__
+# include <linux/fs.h>
+#endif
+
+#ifdef FIDEDUPERANGE
+
+# include <stdlib.h>
+# include <string.h>
+# include <sys/ioctl.h>
+
+enum {
+	/* btrfs does not dedupe more than this at once */
+	DEDUPE_CHUNK = 16*1024*1024
+};
+
+/* The range is passed to the kernel in chunks. A destination whose contents
+ * turn out to differ or that fails is left out of the remaining chunks. */
+int dedupe_files(int src, off_t size, const int *dsts, int count, int *results) {
+	struct file_dedupe_range *range;
+	struct file_dedupe_range_info *info;
+	int index[DEDUPE_MAX], i, n;
+	off_t offset = 0;
+
+	if (count > DEDUPE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	range = malloc(sizeof *range + count * sizeof *range->info);
+	if (range == NULL) return -1;
+
+	for (i = 0; i < count; i++) results[i] = 0;
+
+	while (offset < size) {
+		memset(range,0,sizeof *range);
+		range->src_offset = offset;
+		range->src_length = size - offset < DEDUPE_CHUNK ? size - offset : DEDUPE_CHUNK;
+
+		for (i = n = 0; i < count; i++) {
+			if (results[i] != 0) continue;
+
+			info = range->info + n;
+			memset(info,0,sizeof *info);
+			info->dest_fd = dsts[i];
+			info->dest_offset = offset;
+			index[n++] = i;
+		}
+
+		if (n == 0) break;
+		range->dest_count = n;
+
+		if (ioctl(src,FIDEDUPERANGE,range) == -1) {
+			free(range);
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			info = range->info + i;
+			if (info->status == FILE_DEDUPE_RANGE_DIFFERS) results[index[i]] = DEDUPE_DIFFERS;
+			else if (info->status < 0) results[index[i]] = -info->status;
+		}
+
+		offset += range->src_length;
+	}
+
+	free(range);
+
+	return 0;
+}
+
+/* the ranges are passed in chunks as well */
+int dedupe_range(int src, off_t src_offset, int dst, off_t dst_offset, off_t length,
+    off_t *deduped) {
+	/* struct file_dedupe_range ends in a flexible array */
+	union {
+		struct file_dedupe_range range;
+		char bytes[sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info)];
+	} arg;
+	struct file_dedupe_range_info *info = arg.range.info;
+	off_t offset = 0;
+
+	while (offset < length) {
+		memset(&arg,0,sizeof arg);
+		arg.range.src_offset = src_offset + offset;
+		arg.range.src_length = length - offset < DEDUPE_CHUNK ? length - offset : DEDUPE_CHUNK;
+		arg.range.dest_count = 1;
+		info->dest_fd = dst;
+		info->dest_offset = dst_offset + offset;
+
+		if (ioctl(src,FIDEDUPERANGE,&arg.range) == -1) return -1;
+
+		if (info->status == FILE_DEDUPE_RANGE_DIFFERS) return DEDUPE_DIFFERS;
+		if (info->status < 0) return -info->status;
+
+		*deduped += info->bytes_deduped;
+		offset += arg.range.src_length;
+	}
+
+	return 0;
+}
+
+#else
+
+int dedupe_files(int src, off_t size, const int *dsts, int count, int *results) {
+	(void)src;
+	(void)size;
+	(void)dsts;
+	(void)count;
+	(void)results;
+	errno = ENOTSUP;
+	return -1;
+}
+
+int dedupe_range(int src, off_t src_offset, int dst, off_t dst_offset, off_t length,
+    off_t *deduped) {
+	(void)src;
+	(void)src_offset;
+	(void)dst;
+	(void)dst_offset;
+	(void)length;
+	(void)deduped;
+	errno = ENOTSUP;
+	return -1;
+}
+
+#endif
+
+int dedupe_open(const char *path) {
+	int fd = open(path,O_RDWR|O_NOCTTY);
+
+	if (fd == -1 && (errno == EACCES || errno == EROFS || errno == ETXTBSY))
+		fd = open(path,O_RDONLY|O_NOCTTY);
+
+	return fd;
+}
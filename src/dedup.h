@@ -0,0 +1,58 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <sys/types.h>
+
+enum {
+	DEDUPE_MAX = 64, /* the most destinations dedupe_files takes at once */
+	DEDUPE_DIFFERS = -1
+};
+
+/* Let the kernel share the extents of the first size bytes of the file open
+ * as the first argument with each of the count files open as dsts, after it
+ * made sure their contents are the same. The result of each destination is
+ * 0 if it now shares extents with the source, DEDUPE_DIFFERS if its
+ * contents differ or an errno value if it could not be deduplicated.
+ * Returns 0 on success and -1 with errno set if the source can't be
+ * deduplicated at all, which is ENOTSUP on systems and EOPNOTSUPP or EINVAL
+ * on file systems without FIDEDUPERANGE. */
+int dedupe_files(int,off_t,const int*,int,int*);
+
+/* Let the kernel share the extents of the given number of bytes of the
+ * file open as the first argument at the given offset with those of the
+ * file open as the third argument at the fourth argument. The bytes the
+ * kernel shared are added to the last argument. Returns 0 if the ranges now
+ * share their extents, DEDUPE_DIFFERS if their contents differ, an errno
+ * value if the destination can't be deduplicated and -1 with errno set as
+ * for dedupe_files if the source can't be. */
+int dedupe_range(int,off_t,int,off_t,off_t,off_t*);
+
+/* Open a file to deduplicate into. Files the user may not write to can
+ * still be deduplicated if the user owns them. */
+int dedupe_open(const char*);
+
+#endif
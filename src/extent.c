@@ -0,0 +1,219 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/types.h>
+
+#include <errno.h>
+
+#include "extent.h"
+
+enum {
+	EXTENT_BATCH = 32 /* extents fetched at once by shared_extents */
+};
+
+#ifdef __linux__
+
+# include <fcntl.h>
+# include <stdbool.h>
+# include <linux/fiemap.h>
+# include <linux/fs.h>
+# include <string.h>
+# include <sys/ioctl.h>
+# include <unistd.h>
+
+static int extent_at(int,off_t,struct fiemap_extent*);
+
+int first_extent(const char *path, unsigned long long *physical) {
+	/* struct fiemap ends in a flexible array of extents */
+	union {
+		struct fiemap map;
+		char bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} buf;
+	struct fiemap_extent *extent = buf.map.fm_extents;
+	int fd, retval = 0;
+
+	fd = open(path,O_RDONLY|O_NOCTTY|O_NONBLOCK);
+	if (fd == -1) return -1;
+
+	memset(&buf,0,sizeof buf);
+	buf.map.fm_start = 0;
+	buf.map.fm_length = FIEMAP_MAX_OFFSET;
+	buf.map.fm_extent_count = 1;
+
+	if (ioctl(fd,FS_IOC_FIEMAP,&buf.map) == -1) retval = -1;
+	else if (buf.map.fm_mapped_extents == 0
+	    || extent->fe_flags & FIEMAP_EXTENT_UNKNOWN) {
+		/* empty, inline or not allocated yet */
+		errno = ENODATA;
+		retval = -1;
+	} else *physical = extent->fe_physical;
+
+	close(fd);
+
+	return retval;
+}
+
+/* fold the placement of each extent into the key */
+int shared_extents(const char *path, unsigned long long *key) {
+	union {
+		struct fiemap map;
+		char bytes[sizeof(struct fiemap) + EXTENT_BATCH * sizeof(struct fiemap_extent)];
+	} buf;
+	const struct fiemap_extent *extent;
+	const unsigned unsure = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC
+	    | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL;
+	unsigned long long start = 0, h = 0;
+	unsigned i;
+	int fd, retval = -1;
+	bool last = false;
+
+	fd = open(path,O_RDONLY|O_NOCTTY|O_NONBLOCK);
+	if (fd == -1) return -1;
+
+	do {
+		memset(&buf,0,sizeof buf);
+		buf.map.fm_start = start;
+		buf.map.fm_length = FIEMAP_MAX_OFFSET - start;
+		buf.map.fm_extent_count = EXTENT_BATCH;
+
+		if (ioctl(fd,FS_IOC_FIEMAP,&buf.map) == -1) goto done;
+
+		/* empty files share nothing */
+		if (buf.map.fm_mapped_extents == 0) {
+			if (start == 0) errno = ENODATA;
+			else retval = 0;
+			goto done;
+		}
+
+		for (i = 0; i < buf.map.fm_mapped_extents; i++) {
+			extent = buf.map.fm_extents + i;
+			if (!(extent->fe_flags & FIEMAP_EXTENT_SHARED) || extent->fe_flags & unsure) {
+				errno = ENODATA;
+				goto done;
+			}
+
+			h = (h ^ extent->fe_logical) * 0x9e3779b97f4a7c15ULL;
+			h = (h ^ extent->fe_physical) * 0x9e3779b97f4a7c15ULL;
+			h = (h ^ extent->fe_length) * 0x9e3779b97f4a7c15ULL;
+			h ^= h >> 29;
+
+			start = extent->fe_logical + extent->fe_length;
+			last = extent->fe_flags & FIEMAP_EXTENT_LAST;
+		}
+	} while (!last);
+
+	retval = 0;
+
+	done:
+	if (retval == 0) *key = h | 1;
+	close(fd);
+
+	return retval;
+}
+
+/* Walk both ranges an extent at a time. Within an extent, storage follows
+ * the offset in the file, so each piece is at the same place in both files
+ * if it starts there. */
+int same_storage(int fd_a, off_t a, int fd_b, off_t b, off_t length) {
+	struct fiemap_extent ext_a, ext_b;
+	off_t done = 0, step, left;
+
+	while (done < length) {
+		if (extent_at(fd_a,a + done,&ext_a) == -1) return 0;
+		if (extent_at(fd_b,b + done,&ext_b) == -1) return 0;
+
+		if (ext_a.fe_physical + (a + done - ext_a.fe_logical)
+		    != ext_b.fe_physical + (b + done - ext_b.fe_logical))
+			return 0;
+
+		step = length - done;
+		left = ext_a.fe_logical + ext_a.fe_length - (a + done);
+		if (left < step) step = left;
+		left = ext_b.fe_logical + ext_b.fe_length - (b + done);
+		if (left < step) step = left;
+
+		done += step;
+	}
+
+	return 1;
+}
+
+/* find the extent the given offset is in; fails for holes and extents
+ * whose place isn't known exactly */
+static int extent_at(int fd, off_t offset, struct fiemap_extent *extent) {
+	union {
+		struct fiemap map;
+		char bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} buf;
+	const unsigned unsure = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC
+	    | FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL;
+
+	memset(&buf,0,sizeof buf);
+	buf.map.fm_start = offset;
+	buf.map.fm_length = 1;
+	buf.map.fm_extent_count = 1;
+
+	if (ioctl(fd,FS_IOC_FIEMAP,&buf.map) == -1) return -1;
+
+	*extent = buf.map.fm_extents[0];
+	if (buf.map.fm_mapped_extents == 0 || extent->fe_flags & unsure
+	    || (off_t)extent->fe_logical > offset
+	    || (off_t)(extent->fe_logical + extent->fe_length) <= offset) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+
+int first_extent(const char *path, unsigned long long *physical) {
+	(void)path;
+	(void)physical;
+	errno = ENOTSUP;
+	return -1;
+}
+
+int shared_extents(const char *path, unsigned long long *key) {
+	(void)path;
+	(void)key;
+	errno = ENOTSUP;
+	return -1;
+}
+
+int same_storage(int fd_a, off_t a, int fd_b, off_t b, off_t length) {
+	(void)fd_a;
+	(void)a;
+	(void)fd_b;
+	(void)b;
+	(void)length;
+	return 0;
+}
+
+#endif
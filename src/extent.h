@@ -0,0 +1,47 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <sys/types.h>
+
+/* Find where the first extent of a file is stored on its device. This is
+ * only a hint for ordering reads. Returns 0 on success, -1 on failure with
+ * errno set; fails with ENOTSUP on systems without FIEMAP. */
+int first_extent(const char*,unsigned long long*);
+
+/* Compute a key from where all extents of a file are stored if all of them
+ * are shared with other files. Files with the same key on the same device
+ * share all of their storage and thus have the same contents. Returns 0 on
+ * success, -1 on failure with errno set; fails with ENODATA if the file
+ * has extents that aren't shared. The key is never 0. */
+int shared_extents(const char*,unsigned long long*);
+
+/* Do the given number of bytes of the first file open at the first offset
+ * take up the same storage as those of the second file at the second
+ * offset? Returns 1 if so and 0 if not or if the file system can't tell. */
+int same_storage(int,off_t,int,off_t,off_t);
+
+#endif
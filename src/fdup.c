@@ -26,8 +26,6 @@
 #define _XOPEN_SOURCE 700
 #define _FILE_OFFSET_BITS 64
 
-#include <ftw.h>
-#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
@@ -37,7 +35,38 @@
 
 #include "match.h"
 #include "action.h"
-#include "btrfs.h"
+#include "cache.h"
+#include "hash.h"
+#include "index.h"
+#include "io.h"
+#include "walk.h"
+#include "watch.h"
+
+/* what fdup was asked to do, kept for each matcher it sets up */
+struct run {
+	enum {
+		LIST_DUPS_MODE,
+		HARD_LINK_MODE,
+		SOFT_LINK_MODE,
+		BTRFS_COPY_MODE,
+		DEDUPE_MODE,
+		BLOCK_DEDUPE_MODE,
+		CHECK_INDEX_MODE,
+		WRITE_INDEX_MODE
+	} mode;
+	matcher_flags flags;
+	link_flags lf;
+	int threads, verbose, streaming, algorithm;
+	enum io_method io_method;
+	long long memory;
+	struct stage stages[MAX_STAGES];
+	int stage_count;
+	const char *cache_path, *index_path;
+	struct hash_cache *cache;
+	const char *const *changed; /* when watching, sorted */
+	int changed_count;
+	int printed; /* a group was listed before, when watching */
+};
 
 struct bounds {
 	off_t lower;
@@ -45,36 +74,29 @@ struct bounds {
 	int has_upper;
 };
 
-/* these variables have to be global as it is not possible to supply an extra
- * argument to the function passed to nftw. The only way to supply extra data
- * to walker are in fact global variables. */
-static struct matcher *matcher;
-static struct bounds bounds = { 0, 0, 0 };
-static int verbose = 0;
-
+static int act(struct matcher*,struct run*);
+static int act_changed(struct matcher*,const char*const*,int,void*);
 static off_t adjust_suffix(off_t,char);
 static void help(const char *);
+static int in_bounds(const struct stat*,void*);
+static int load_list(struct matcher*,const char*,int,const struct walk_options*);
 static int parse_bounds(struct bounds*,const char*);
-static int walker(const char*,const struct stat*,int,struct FTW*);
+static int parse_stages(struct stage*,int*,const char*);
+static int save_cache(struct matcher*,struct run*);
+static struct matcher *setup_matcher(void*);
 
-static int walker(const char *fpath,const struct stat *sb,int tf,struct FTW *ftwbuf) {
-	/* silence warnings */
-	(void)tf;
-	(void)ftwbuf;
+/* filter for walk_trees */
+static int in_bounds(const struct stat *sb, void *arg) {
+	const struct bounds *bounds = arg;
 
-	if (!S_ISREG(sb->st_mode)) return 0;
-	if (sb->st_size < bounds.lower) return 0;
-	if (bounds.has_upper && sb->st_size > bounds.upper) return 0;
+	if (sb->st_size < bounds->lower) return 0;
+	if (bounds->has_upper && sb->st_size > bounds->upper) return 0;
 
-	if (register_file(matcher,fpath,sb)) return 1;
-
-	if (verbose) fprintf(stderr,"\r%9d files",get_file_count(matcher));
-
-	return 0;
+	return 1;
 }
 
 static void help(const char *program) {
-	printf("Usage: %s [-B | -H | -L | -S] [-hpvx] [-b cdglmpu] [-s n[,m]] directory...\n",program);
+	printf("Usage: %s [-B | -D | -H | -L | -P | -R index | -S | -W index] [-hipVvwx] [-a algorithm] [-b cdglmpu] [-C cache] [-c stages] [-F list] [-f list] [-j n] [-M size] [-r method] [-s n[,m]] [directory...]\n",program);
 }
 
 /* apply kilo, mega, giga etc. suffix */
@@ -121,51 +143,281 @@ static int parse_bounds(struct bounds *b, const char *input) {
 	return 0;
 }
 
-int main(int argc, char *argv[]) {
-	int ok = 1, i, opt, xdev = 0;
-	rlim_t maxfiles;
-	struct rlimit limit;
-	matcher_flags flags = 0;
-	link_flags lf = 0;
-	enum {
-		LIST_DUPS_MODE,
-		HARD_LINK_MODE,
-		SOFT_LINK_MODE,
-		BTRFS_COPY_MODE
-	} mode = LIST_DUPS_MODE;
+/* parse a comma separated list of stages like h16K,t16K,m1M */
+static int parse_stages(struct stage *stages, int *count, const char *input) {
+	char *rest;
+
+	*count = 0;
+
+	while (*input != '\0') {
+		if (*count == MAX_STAGES) {
+			fprintf(stderr,"Too many stages to -c, at most %d are allowed\n",MAX_STAGES);
+			return 1;
+		}
+
+		switch (*input++) {
+		case 'h': stages[*count].type = S_HEAD; break;
+		case 'm': stages[*count].type = S_MIDDLE; break;
+		case 't': stages[*count].type = S_TAIL; break;
+		default:
+			fprintf(stderr,"Unknown stage %c to -c\n",input[-1]);
+			return 1;
+		}
+
+		stages[*count].length = strtoll(input,&rest,10);
+		if (rest == input || strchr(",KMGTPE",*rest) == NULL) {
+			fprintf(stderr,"Invalid sample size in string to -c\n");
+			return 1;
+		}
+
+		if (*rest != '\0' && *rest != ',')
+			stages[*count].length = adjust_suffix(stages[*count].length,*rest++);
+
+		if (stages[*count].length <= 0) {
+			fprintf(stderr,"Sample sizes to -c must be positive\n");
+			return 1;
+		}
+
+		if (*rest == ',') rest++;
+		input = rest;
+		++*count;
+	}
+
+	return 0;
+}
+
+/* register the files from a list given to -F or -f, - for stdin */
+static int load_list(struct matcher *m, const char *path, int records,
+    const struct walk_options *opts) {
+	FILE *list = strcmp(path,"-") == 0 ? stdin : fopen(path,"r");
+	int retval;
+
+	if (list == NULL) {
+		fprintf(stderr,"Cannot open %s: ",path);
+		perror(NULL);
+		return 1;
+	}
+
+	retval = read_list(m,list,list == stdin ? "standard input" : path,records,opts);
+	if (list != stdin) fclose(list);
+
+	return retval;
+}
+
+/* a new matcher set up as requested on the command line, NULL on error */
+static struct matcher *setup_matcher(void *arg) {
+	struct run *r = arg;
+	struct matcher *m = new_matcher(r->flags);
+	struct stage stages[MAX_STAGES];
+	int stage_count;
+
+	if (m == NULL) return NULL;
+	set_thread_count(m,r->threads);
+	set_verbose(m,r->verbose);
+	set_io_method(m,r->io_method);
+	set_hash_algorithm(m,r->algorithm);
+	set_streaming(m,r->streaming);
+	set_grouping(m,r->mode != BLOCK_DEDUPE_MODE && r->mode != CHECK_INDEX_MODE
+	    && r->mode != WRITE_INDEX_MODE);
+	set_memory_limit(m,r->memory);
+	if (r->stage_count >= 0) set_stages(m,r->stages,r->stage_count);
+
+	if (r->cache_path != NULL) {
+		/* left over from a round of watching with nothing to act on */
+		if (r->cache != NULL) close_cache(r->cache);
+
+		stage_count = get_stages(m,stages);
+		r->cache = open_cache(r->cache_path,r->algorithm,hash_length(r->algorithm),
+		    stages,stage_count);
+		if (r->cache == NULL) {
+			free_matcher(m);
+			return NULL;
+		}
+
+		set_cache(m,r->cache);
+	}
+
+	return m;
+}
+
+/* act on the groups of a finalized matcher in the selected mode; returns 0
+ * on success */
+static int act(struct matcher *m, struct run *r) {
+	int failed = 0;
+
+	/* while streaming, hashes go into the cache until the last group is found */
+	if (!r->streaming && save_cache(m,r)) return 1;
+
+	switch (r->mode) {
+	case LIST_DUPS_MODE:
+		failed = print_changed_dups(m,r->changed,r->changed_count,&r->printed);
+		break;
+	case HARD_LINK_MODE:  failed = make_links(m,r->lf,hard_link,"hardlink",r->threads); break;
+	case SOFT_LINK_MODE:  failed = make_links(m,r->lf,soft_link,"symlink",r->threads); break;
+	case BTRFS_COPY_MODE: failed = make_links(m,r->lf,clone_link,"clone",r->threads); break;
+	case DEDUPE_MODE:     failed = dedupe_dups(m,r->lf); break;
+	case BLOCK_DEDUPE_MODE: failed = dedupe_blocks(m,r->lf,r->threads,r->io_method); break;
+	case CHECK_INDEX_MODE: failed = check_index(m,r->index_path,r->io_method,r->threads,r->verbose); break;
+	case WRITE_INDEX_MODE: failed = write_index(m,r->index_path,r->algorithm,r->io_method,r->threads,r->verbose); break;
+	}
+
+	if (wait_matcher(m)) return 1;
+	if (r->streaming && save_cache(m,r)) return 1;
 
-	while ((opt = getopt(argc,argv,"BHLSb:hps:vx")) != -1) {
+	return failed;
+}
+
+/* act on the files changed since the last round of watching */
+static int act_changed(struct matcher *m, const char *const *changed, int count, void *arg) {
+	struct run *r = arg;
+	int failed;
+
+	r->changed = changed;
+	r->changed_count = count;
+	failed = act(m,r);
+	r->changed = NULL;
+	fflush(stdout);
+
+	return failed;
+}
+
+/* Write the new hashes to the cache once the matcher is done with it. A
+ * round of watching only sees the changed files, so the entries of the
+ * others are kept. */
+static int save_cache(struct matcher *m, struct run *r) {
+	if (r->cache == NULL) return 0;
+	if (write_cache(r->cache,r->changed == NULL)) return 1;
+
+	close_cache(r->cache);
+	r->cache = NULL;
+	set_cache(m,NULL);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int i, opt, xdev = 0, records = 0, watch = 0;
+	long n;
+	char *rest, *path;
+	const char *list_path = NULL;
+	struct run run;
+	struct matcher *matcher;
+	struct bounds bounds = { 0, 0, 0 };
+	struct walk_options walk_opts;
+	struct watch *watcher = NULL;
+
+	memset(&run,0,sizeof run);
+	run.mode = LIST_DUPS_MODE;
+	run.threads = 1;
+	run.stage_count = -1;
+	run.algorithm = HASH_SHA1;
+	run.io_method = IO_READ;
+
+	while ((opt = getopt(argc,argv,"BDF:HLM:PR:SVW:a:b:C:c:f:hij:pr:s:vwx")) != -1) {
 		switch(opt) {
 		case 'B':
-			mode = BTRFS_COPY_MODE;
+			run.mode = BTRFS_COPY_MODE;
+			run.flags |= M_SHARED; /* nothing left to do for these */
+			break;
+		case 'D':
+			run.mode = DEDUPE_MODE;
+			run.flags |= M_DEV|M_SHARED; /* extents can't be shared across devices */
+			break;
+		case 'F':
+			list_path = optarg;
+			records = 1;
 			break;
 		case 'H':
-			mode = HARD_LINK_MODE;
-			flags |= M_DEV|M_LINK; /* avoid a quirk in rename */
+			run.mode = HARD_LINK_MODE;
+			run.flags |= M_DEV|M_LINK; /* avoid a quirk in rename */
 			break;
 		case 'L':
-			mode = LIST_DUPS_MODE;
+			run.mode = LIST_DUPS_MODE;
+			break;
+		case 'M':
+			run.memory = strtoll(optarg,&rest,10);
+			if (rest != optarg && *rest != '\0' && strchr("KMGTPE",*rest) != NULL)
+				run.memory = adjust_suffix(run.memory,*rest++);
+			if (rest == optarg || *rest != '\0' || run.memory <= 0) {
+				fprintf(stderr,"Invalid memory size %s to -M\n",optarg);
+				return 2;
+			}
+			break;
+		case 'P':
+			run.mode = BLOCK_DEDUPE_MODE;
+			break;
+		case 'R':
+			run.mode = CHECK_INDEX_MODE;
+			run.index_path = optarg;
 			break;
 		case 'S':
-			mode = SOFT_LINK_MODE;
+			run.mode = SOFT_LINK_MODE;
+			break;
+		case 'V':
+			run.lf |= LINKS_VERIFY;
+			break;
+		case 'W':
+			run.mode = WRITE_INDEX_MODE;
+			run.index_path = optarg;
+			break;
+		case 'a':
+			run.algorithm = hash_by_name(optarg);
+			if (run.algorithm == -1) {
+				fprintf(stderr,"Unknown algorithm %s to -a\n",optarg);
+				return 2;
+			}
 			break;
 		case 'b':
 			optarg--;
 			while (*++optarg != '\0') switch (*optarg) {
-			case 'c': flags |= M_CTIME; break;
-			case 'd': flags |= M_DEV; break;
-			case 'g': flags |= M_GID; break;
-			case 'l': flags |= M_LINK; break;
-			case 'm': flags |= M_MTIME; break;
-			case 'p': flags |= M_MODE; break;
-			case 'u': flags |= M_UID; break;
+			case 'c': run.flags |= M_CTIME; break;
+			case 'd': run.flags |= M_DEV; break;
+			case 'g': run.flags |= M_GID; break;
+			case 'l': run.flags |= M_LINK; break;
+			case 'm': run.flags |= M_MTIME; break;
+			case 'p': run.flags |= M_MODE; break;
+			case 'u': run.flags |= M_UID; break;
 			default:
 				fprintf(stderr,"Unknown specifier %c to -b\n",*optarg);
 				return 2;
 			}
 			break;
+		case 'C':
+			run.cache_path = optarg;
+			break;
+		case 'c':
+			if (parse_stages(run.stages,&run.stage_count,optarg)) {
+				help(argv[0]);
+				return 2;
+			}
+			break;
+		case 'f':
+			list_path = optarg;
+			records = 0;
+			break;
+		case 'i':
+			run.streaming = 1;
+			break;
+		case 'j':
+			n = strtol(optarg,&rest,10);
+			if (*optarg == '\0' || *rest != '\0' || n < 1 || n > 1024) {
+				fprintf(stderr,"Invalid thread count %s to -j\n",optarg);
+				return 2;
+			}
+			run.threads = n;
+			break;
 		case 'p':
-			lf &= LINKS_PRESERVE;
+			run.lf |= LINKS_PRESERVE;
+			break;
+		case 'r':
+			if (strcmp(optarg,"read") == 0) run.io_method = IO_READ;
+			else if (strcmp(optarg,"direct") == 0) run.io_method = IO_DIRECT;
+			else if (strcmp(optarg,"mmap") == 0) run.io_method = IO_MMAP;
+			else if (strcmp(optarg,"uring") == 0) run.io_method = IO_URING;
+			else {
+				fprintf(stderr,"Unknown method %s to -r\n",optarg);
+				return 2;
+			}
 			break;
 		case 's':
 			if (parse_bounds(&bounds,optarg)) {
@@ -174,8 +426,11 @@ int main(int argc, char *argv[]) {
 			}
 			break;
 		case 'v':
-			verbose = 1;
-			lf &= LINKS_VERBOSE;
+			run.verbose = 1;
+			run.lf |= LINKS_VERBOSE;
+			break;
+		case 'w':
+			watch = 1;
 			break;
 		case 'x':
 			xdev = 1;
@@ -187,38 +442,55 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	if (optind >= argc) {
+	if (optind >= argc && list_path == NULL) {
 		help(argv[0]);
 		return 2;
 	}
 
-	matcher = new_matcher(flags);
+	if (watch && (run.mode == BLOCK_DEDUPE_MODE || run.mode == CHECK_INDEX_MODE
+	    || run.mode == WRITE_INDEX_MODE)) {
+		fprintf(stderr,"Cannot watch for changes with -P, -R or -W\n");
+		return 2;
+	}
 
-	/* attempt to use as many files as possible */
-	getrlimit(RLIMIT_NOFILE,&limit);
-	maxfiles = limit.rlim_cur - 8; /* spare some file descriptors */
+	matcher = setup_matcher(&run);
+	if (matcher == NULL) return 1;
 
-	if (verbose) fputs("Scanning file system...\n",stderr);
+	walk_opts.threads = run.threads;
+	walk_opts.xdev = xdev;
+	walk_opts.verbose = run.verbose;
+	walk_opts.filter = in_bounds;
+	walk_opts.filter_arg = &bounds;
 
-	for (i = optind; i < argc; i++) {
-		ok = nftw(argv[i],walker,maxfiles,FTW_PHYS|(xdev?FTW_MOUNT:0));
-		if (ok == -1) {
-			fprintf(stderr,"\nError processing argument %s: ",argv[i]);
-			perror(NULL);
-		}
+	/* the index has to be usable from any directory */
+	if (run.mode == WRITE_INDEX_MODE) for (i = optind; i < argc; i++) {
+		path = realpath(argv[i],NULL);
+		if (path != NULL) argv[i] = path;
 	}
 
-	if (verbose) fputs("\nLooking for duplicates...\n",stderr);
+	/* changes made while searching are caught by the first round */
+	if (watch) {
+		watcher = new_watch(argv+optind,argc-optind,&walk_opts);
+		if (watcher == NULL) return 1;
+	}
+
+	if (run.verbose) fputs("Scanning file system...\n",stderr);
+	if (list_path != NULL && load_list(matcher,list_path,records,&walk_opts)) return 1;
+	if (walk_trees(matcher,argv+optind,argc-optind,&walk_opts)) return 1;
+
+	if (run.verbose) fputs("\nLooking for duplicates...\n",stderr);
 	if (finalize_matcher(matcher)) return 1;
 
-	switch (mode) {
-	case LIST_DUPS_MODE:  ok = print_dups(matcher); break;
-	case HARD_LINK_MODE:  ok = make_links(matcher,lf,link,"hardlink"); break;
-	case SOFT_LINK_MODE:  ok = make_links(matcher,lf,symlink,"symlink"); break;
-	case BTRFS_COPY_MODE: ok = make_links(matcher,lf,btrfs_clone,"clone"); break;
-	}
+	/* let each group appear as soon as it is found */
+	if (run.streaming) setvbuf(stdout,NULL,_IOLBF,BUFSIZ);
 
-	if (!ok) return 1;
+	if (act(matcher,&run)) return 1;
+
+	if (watch) {
+		fflush(stdout);
+		if (watch_trees(watcher,matcher,setup_matcher,act_changed,&run)) return 1;
+		free_watch(watcher);
+	}
 
 	free_matcher(matcher);
 
@@ -0,0 +1,445 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include "hash.h"
+
+/* SHA-1 over many messages at once in vector registers, selected at runtime
+ * for processors with wide vector units */
+#if defined(__GNUC__) && defined(__x86_64__)
+# define HAVE_SHA1_LANES
+typedef uint32_t lanes __attribute__((vector_size(4 * HASH_LANES)));
+#endif
+
+enum {
+	BLOCK_STRIPES = 16, /* stripes between two scrambles */
+	SHA1_BLOCK = 64
+};
+
+/* random numbers; eight per stripe, sliding by one each stripe, and eight
+ * for scrambling the accumulators */
+static const uint64_t secret[32] = {
+	UINT64_C(0xa998aa8223974d1d), UINT64_C(0x8623ea125e061e99), UINT64_C(0xac237604cfde6b21), UINT64_C(0x9e95bfa2b27e999d),
+	UINT64_C(0xbc07aba31a94efef), UINT64_C(0x332a41ee93404e21), UINT64_C(0x3982843a7625a057), UINT64_C(0xb58e4e8b820bd441),
+	UINT64_C(0x2a040a0eb4244b31), UINT64_C(0xec2a4aa032731083), UINT64_C(0x2138ce0c433a70ed), UINT64_C(0xc236694ccc22c891),
+	UINT64_C(0xd7ea955786a3e94d), UINT64_C(0xa0b8db2e07f68cb5), UINT64_C(0x6176c200234dc383), UINT64_C(0xf0e4110753001f93),
+	UINT64_C(0xeb9373475db8bc01), UINT64_C(0xa0982c2b8dfc6fed), UINT64_C(0x8f66d029febf34c7), UINT64_C(0xc54170aa3b91606d),
+	UINT64_C(0xd6d698a33cd85bcf), UINT64_C(0xd6d12bb905c90da9), UINT64_C(0x628a54f65bc52b33), UINT64_C(0x40ec5d422a35094b),
+	UINT64_C(0xf1c5a74d0b3dd615), UINT64_C(0xd2ec3311330f08bb), UINT64_C(0xac610bdaeb66f4db), UINT64_C(0xc167356c544f60cd),
+	UINT64_C(0x6a7869354c840ecb), UINT64_C(0xd98ed283e255a1b9), UINT64_C(0xbadbdfd0ab909aa7), UINT64_C(0x7f9b99db0ef08ffb),
+};
+
+#define PRIME32_1 UINT64_C(0x9e3779b1)
+#define PRIME64_1 UINT64_C(0x9e3779b185ebca87)
+#define PRIME64_2 UINT64_C(0xc2b2ae3d27d4eb4f)
+
+static const struct {
+	const char *name;
+	int length;
+} algorithms[HASH_ALGORITHMS] = {
+	[HASH_SHA1]   = { "sha1",   20 },
+	[HASH_SHA256] = { "sha256", 32 },
+	[HASH_FAST]   = { "fast",   16 }
+};
+
+static uint64_t avalanche(uint64_t);
+static void fast_final(struct fast_state*,unsigned char*);
+static void fast_init(struct fast_state*);
+static void fast_stripes(struct fast_state*,const unsigned char*,size_t);
+static void fast_update(struct fast_state*,const unsigned char*,size_t);
+static uint64_t mul_fold(uint64_t,uint64_t);
+#ifdef HAVE_SHA1_LANES
+static void sha1_blocks(uint32_t[5][HASH_LANES],lanes*,uint32_t);
+static void sha1_many(int,const unsigned char*const*,const size_t*,unsigned char*const*,
+    void (*)(uint32_t[5][HASH_LANES],lanes*,uint32_t));
+static void sha1_blocks_avx2(uint32_t[5][HASH_LANES],lanes*,uint32_t);
+static void sha1_blocks_avx512(uint32_t[5][HASH_LANES],lanes*,uint32_t);
+#endif
+
+int hash_by_name(const char *name) {
+	size_t i;
+
+	for (i = 0; i < sizeof algorithms / sizeof *algorithms; i++)
+		if (strcmp(name,algorithms[i].name) == 0) return i;
+
+	return -1;
+}
+
+int hash_length(enum hash_algorithm algorithm) {
+	return algorithms[algorithm].length;
+}
+
+int hasher_init(struct hasher *h, enum hash_algorithm algorithm) {
+	const EVP_MD *md;
+
+	h->algorithm = algorithm;
+	if (algorithm == HASH_FAST) {
+		fast_init(&h->fast);
+		return 0;
+	}
+
+	md = algorithm == HASH_SHA256 ? EVP_sha256() : EVP_sha1();
+
+	if (h->evp == NULL) {
+		h->evp = EVP_MD_CTX_new();
+		if (h->evp == NULL) {
+			fputs("Cannot allocate hash context\n",stderr);
+			return 1;
+		}
+	}
+
+	if (EVP_DigestInit_ex(h->evp,md,NULL) != 1) {
+		fputs("Cannot initialize hash context\n",stderr);
+		return 1;
+	}
+
+	return 0;
+}
+
+void hasher_update(struct hasher *h, const void *data, size_t len) {
+	if (h->algorithm == HASH_FAST) fast_update(&h->fast,data,len);
+	else EVP_DigestUpdate(h->evp,data,len);
+}
+
+void hasher_final(struct hasher *h, unsigned char *hash) {
+	if (h->algorithm == HASH_FAST) fast_final(&h->fast,hash);
+	else EVP_DigestFinal_ex(h->evp,hash,NULL);
+}
+
+void hasher_free(struct hasher *h) {
+	EVP_MD_CTX_free(h->evp);
+	h->evp = NULL;
+}
+
+/* SHA-NI hashes one message faster than AVX2 hashes many, but AVX-512 is
+ * faster still */
+int hash_batches(enum hash_algorithm algorithm) {
+#ifdef HAVE_SHA1_LANES
+	if (algorithm != HASH_SHA1) return 0;
+
+	return __builtin_cpu_supports("avx512f")
+	    || (__builtin_cpu_supports("avx2") && !__builtin_cpu_supports("sha"));
+#else
+	(void)algorithm;
+	return 0;
+#endif
+}
+
+void hash_many(enum hash_algorithm algorithm, int count, const unsigned char *const *data,
+    const size_t *lengths, unsigned char *const *hashes) {
+	struct hasher h;
+	int i;
+
+#ifdef HAVE_SHA1_LANES
+	if (algorithm == HASH_SHA1 && hash_batches(algorithm)) {
+		sha1_many(count,data,lengths,hashes,__builtin_cpu_supports("avx512f")
+		    ? sha1_blocks_avx512 : sha1_blocks_avx2);
+		return;
+	}
+#endif
+
+	h.evp = NULL;
+	for (i = 0; i < count; i++) {
+		if (hasher_init(&h,algorithm) != 0) {
+			/* can't happen once the first hash has been made */
+			memset(hashes[i],0,hash_length(algorithm));
+			continue;
+		}
+
+		hasher_update(&h,data[i],lengths[i]);
+		hasher_final(&h,hashes[i]);
+	}
+
+	hasher_free(&h);
+}
+
+static void fast_init(struct fast_state *s) {
+	s->acc[0] = UINT64_C(0x00000000c2b2ae3d);
+	s->acc[1] = PRIME64_1;
+	s->acc[2] = PRIME64_2;
+	s->acc[3] = UINT64_C(0x165667b19e3779f9);
+	s->acc[4] = UINT64_C(0x85ebca77c2b2ae63);
+	s->acc[5] = UINT64_C(0x0000000085ebca77);
+	s->acc[6] = UINT64_C(0x27d4eb2f165667c5);
+	s->acc[7] = PRIME32_1;
+	s->total = 0;
+	s->stripes = 0;
+	s->buffered = 0;
+}
+
+static void fast_update(struct fast_state *s, const unsigned char *data, size_t len) {
+	size_t n;
+
+	s->total += len;
+
+	if (s->buffered > 0) {
+		n = sizeof s->buf - s->buffered;
+		if (n > len) n = len;
+		memcpy(s->buf + s->buffered,data,n);
+		s->buffered += n;
+		data += n;
+		len -= n;
+
+		if (s->buffered < sizeof s->buf) return;
+
+		fast_stripes(s,s->buf,1);
+		s->buffered = 0;
+	}
+
+	n = len / sizeof s->buf;
+	fast_stripes(s,data,n);
+	data += n * sizeof s->buf;
+	len -= n * sizeof s->buf;
+
+	memcpy(s->buf,data,len);
+	s->buffered = len;
+}
+
+/* Take in count stripes of 64 bytes. Each lane adds the data word of its
+ * neighbour and the product of the halves of its own data word mixed with
+ * the secret. Every BLOCK_STRIPES stripes, the lanes are scrambled. */
+static void fast_stripes(struct fast_state *s, const unsigned char *data, size_t count) {
+	const uint64_t *key;
+	uint64_t acc[8], words[8], swapped[8], k;
+	int i;
+
+	memcpy(acc,s->acc,sizeof acc);
+
+	for (; count > 0; count--, data += sizeof words) {
+		key = secret + s->stripes;
+		memcpy(words,data,sizeof words);
+
+		for (i = 0; i < 8; i++) swapped[i] = words[i ^ 1];
+
+		for (i = 0; i < 8; i++) {
+			k = words[i] ^ key[i];
+			acc[i] += swapped[i] + (k & 0xffffffff) * (k >> 32);
+		}
+
+		if (++s->stripes < BLOCK_STRIPES) continue;
+
+		for (i = 0; i < 8; i++) {
+			acc[i] ^= acc[i] >> 47;
+			acc[i] ^= secret[24 + i];
+			acc[i] *= PRIME32_1;
+		}
+
+		s->stripes = 0;
+	}
+
+	memcpy(s->acc,acc,sizeof acc);
+}
+
+/* The last partial stripe is padded with zeroes; the total length tells
+ * the padding apart from data. Each half of the result folds all lanes. */
+static void fast_final(struct fast_state *s, unsigned char *hash) {
+	uint64_t lo = s->total * PRIME64_1, hi = ~s->total * PRIME64_2;
+	int i;
+
+	if (s->buffered > 0) {
+		memset(s->buf + s->buffered,0,sizeof s->buf - s->buffered);
+		fast_stripes(s,s->buf,1);
+	}
+
+	for (i = 0; i < 8; i += 2) {
+		lo += mul_fold(s->acc[i] ^ secret[8 + i],s->acc[i+1] ^ secret[9 + i]);
+		hi += mul_fold(s->acc[i] ^ secret[17 + i],s->acc[i+1] ^ secret[16 + i]);
+	}
+
+	lo = avalanche(lo);
+	hi = avalanche(hi ^ lo);
+
+	memcpy(hash,&lo,sizeof lo);
+	memcpy(hash + sizeof lo,&hi,sizeof hi);
+}
+
+/* the full 128 bit product of a and b, its halves xored together */
+static uint64_t mul_fold(uint64_t a, uint64_t b) {
+	uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+	uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+	uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi, hl = a_hi * b_lo, hh = a_hi * b_hi;
+	uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+	uint64_t lo = (mid << 32) | (ll & 0xffffffff);
+	uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+
+	return lo ^ hi;
+}
+
+static uint64_t avalanche(uint64_t h) {
+	h ^= h >> 37;
+	h *= UINT64_C(0x165667919e3779f9);
+	h ^= h >> 32;
+
+	return h;
+}
+
+#ifdef HAVE_SHA1_LANES
+static uint32_t load_be32(const unsigned char *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(unsigned char *p, uint32_t x) {
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+/* Hash each message in its own lane. Messages of different lengths take a
+ * different number of blocks; lanes whose message is done are masked off. */
+static void sha1_many(int count, const unsigned char *const *data, const size_t *lengths,
+    unsigned char *const *hashes, void (*blocks)(uint32_t[5][HASH_LANES],lanes*,uint32_t)) {
+	static const uint32_t init[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+	uint32_t state[5][HASH_LANES], mask;
+	lanes w[16];
+	unsigned char tails[HASH_LANES][2 * SHA1_BLOCK];
+	size_t block_counts[HASH_LANES], tail_start[HASH_LANES], most = 0, n, off;
+	const unsigned char *p;
+	uint64_t bits;
+	int i, l;
+
+	for (l = 0; l < HASH_LANES; l++)
+		for (i = 0; i < 5; i++) state[i][l] = init[i];
+
+	/* the padding and length go into one or two blocks at the end */
+	for (l = 0; l < count; l++) {
+		tail_start[l] = lengths[l] - lengths[l] % SHA1_BLOCK;
+		block_counts[l] = (lengths[l] + 8) / SHA1_BLOCK + 1;
+		if (block_counts[l] > most) most = block_counts[l];
+
+		memset(tails[l],0,sizeof tails[l]);
+		memcpy(tails[l],data[l] + tail_start[l],lengths[l] % SHA1_BLOCK);
+		tails[l][lengths[l] % SHA1_BLOCK] = 0x80;
+
+		off = (block_counts[l] - 1) * SHA1_BLOCK - tail_start[l] + SHA1_BLOCK;
+		bits = (uint64_t)lengths[l] * 8;
+		for (i = 1; i <= 8; i++, bits >>= 8) tails[l][off - i] = bits;
+	}
+
+	for (n = 0; n < most; n++) {
+		mask = 0;
+		for (l = 0; l < HASH_LANES; l++) {
+			if (l >= count || n >= block_counts[l]) {
+				for (i = 0; i < 16; i++) w[i][l] = 0;
+				continue;
+			}
+
+			mask |= UINT32_C(1) << l;
+			off = n * SHA1_BLOCK;
+			p = off < tail_start[l] ? data[l] + off : tails[l] + (off - tail_start[l]);
+			for (i = 0; i < 16; i++) w[i][l] = load_be32(p + 4 * i);
+		}
+
+		blocks(state,w,mask);
+	}
+
+	for (l = 0; l < count; l++)
+		for (i = 0; i < 5; i++) store_be32(hashes[l] + 4 * i,state[i][l]);
+}
+
+#define ROL(x,n) ((x) << (n) | (x) >> (32 - (n)))
+#define W(i) (w[(i) & 15] = ROL(w[((i) - 3) & 15] ^ w[((i) - 8) & 15] \
+    ^ w[((i) - 14) & 15] ^ w[(i) & 15],1))
+#define W0(i) w[i]
+#define F1(b,c,d) ((d) ^ ((b) & ((c) ^ (d))))
+#define F2(b,c,d) ((b) ^ (c) ^ (d))
+#define F3(b,c,d) (((b) & (c)) | ((d) & ((b) | (c))))
+#define ROUND(a,b,c,d,e,f,k,x) e += ROL(a,5) + f(b,c,d) + (k) + (x); b = ROL(b,30);
+#define ROUNDS(i,f,k,x) \
+	ROUND(a,b,c,d,e,f,k,x(i)) \
+	ROUND(e,a,b,c,d,f,k,x(i + 1)) \
+	ROUND(d,e,a,b,c,f,k,x(i + 2)) \
+	ROUND(c,d,e,a,b,f,k,x(i + 3)) \
+	ROUND(b,c,d,e,a,f,k,x(i + 4))
+
+/* one block of each lane; the state of lanes not in mask is left alone.
+ * Always inlined so each caller gets code for its instruction set. */
+static inline __attribute__((always_inline))
+void sha1_blocks(uint32_t state[5][HASH_LANES], lanes *w, uint32_t mask) {
+	lanes a, b, c, d, e, keep;
+	int l;
+
+	memcpy(&a,state[0],sizeof a);
+	memcpy(&b,state[1],sizeof b);
+	memcpy(&c,state[2],sizeof c);
+	memcpy(&d,state[3],sizeof d);
+	memcpy(&e,state[4],sizeof e);
+
+	ROUNDS(0,F1,0x5a827999,W0)
+	ROUNDS(5,F1,0x5a827999,W0)
+	ROUNDS(10,F1,0x5a827999,W0)
+	ROUND(a,b,c,d,e,F1,0x5a827999,w[15])
+	ROUND(e,a,b,c,d,F1,0x5a827999,W(16))
+	ROUND(d,e,a,b,c,F1,0x5a827999,W(17))
+	ROUND(c,d,e,a,b,F1,0x5a827999,W(18))
+	ROUND(b,c,d,e,a,F1,0x5a827999,W(19))
+	ROUNDS(20,F2,0x6ed9eba1,W) ROUNDS(25,F2,0x6ed9eba1,W)
+	ROUNDS(30,F2,0x6ed9eba1,W) ROUNDS(35,F2,0x6ed9eba1,W)
+	ROUNDS(40,F3,0x8f1bbcdc,W) ROUNDS(45,F3,0x8f1bbcdc,W)
+	ROUNDS(50,F3,0x8f1bbcdc,W) ROUNDS(55,F3,0x8f1bbcdc,W)
+	ROUNDS(60,F2,0xca62c1d6,W) ROUNDS(65,F2,0xca62c1d6,W)
+	ROUNDS(70,F2,0xca62c1d6,W) ROUNDS(75,F2,0xca62c1d6,W)
+
+	for (l = 0; l < HASH_LANES; l++) keep[l] = -(mask >> l & 1);
+
+#define ADD(i,x) do { lanes old; \
+	memcpy(&old,state[i],sizeof old); \
+	old += x & keep; \
+	memcpy(state[i],&old,sizeof old); } while (0)
+
+	ADD(0,a); ADD(1,b); ADD(2,c); ADD(3,d); ADD(4,e);
+
+#undef ADD
+}
+
+__attribute__((target("avx2")))
+static void sha1_blocks_avx2(uint32_t state[5][HASH_LANES], lanes *w, uint32_t mask) {
+	sha1_blocks(state,w,mask);
+}
+
+__attribute__((target("avx512f")))
+static void sha1_blocks_avx512(uint32_t state[5][HASH_LANES], lanes *w, uint32_t mask) {
+	sha1_blocks(state,w,mask);
+}
+
+#undef ROL
+#undef W
+#undef W0
+#undef F1
+#undef F2
+#undef F3
+#undef ROUND
+#undef ROUNDS
+#endif
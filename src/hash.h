@@ -0,0 +1,84 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The hash algorithms files can be compared with. The values are stored in
+ * hash caches, so don't renumber them. */
+enum hash_algorithm {
+	HASH_SHA1   = 0,
+	HASH_SHA256 = 1,
+	HASH_FAST   = 2 /* 128 bit, not cryptographic, but very fast */
+};
+
+enum {
+	HASH_ALGORITHMS = 3, /* number of algorithms above */
+	HASH_MAX_LENGTH = 32,
+	HASH_LANES = 16 /* messages hash_many takes at once */
+};
+
+/* state of the fast hash, a hash in the spirit of XXH3: eight lanes of
+ * 64 bit each take in 64 bytes per step, which compilers turn into a few
+ * vector instructions */
+struct fast_state {
+	uint64_t acc[8];
+	uint64_t total; /* bytes taken in so far */
+	unsigned stripes; /* full stripes since the last scramble */
+	unsigned buffered;
+	unsigned char buf[64]; /* a partial stripe */
+};
+
+/* a hash being computed. Start with evp set to NULL; hasher_free releases
+ * what hasher_init may have allocated. */
+struct hasher {
+	enum hash_algorithm algorithm;
+	void *evp; /* EVP_MD_CTX for the OpenSSL algorithms */
+	struct fast_state fast;
+};
+
+/* returns the algorithm with the given name or -1 if there is none */
+int hash_by_name(const char*);
+/* the number of bytes in a hash made by the given algorithm */
+int hash_length(enum hash_algorithm);
+
+/* returns 0 on success */
+int hasher_init(struct hasher*,enum hash_algorithm);
+void hasher_update(struct hasher*,const void*,size_t);
+/* store hash_length bytes of hash */
+void hasher_final(struct hasher*,unsigned char*);
+void hasher_free(struct hasher*);
+
+/* is hash_many faster on this machine than hashing one message after
+ * another? */
+int hash_batches(enum hash_algorithm);
+/* hash up to HASH_LANES messages given by their start and length at once,
+ * storing the hashes at the given places */
+void hash_many(enum hash_algorithm,int,const unsigned char*const*,const size_t*,
+    unsigned char*const*);
+
+#endif
@@ -0,0 +1,569 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "index.h"
+#include "io.h"
+#include "match.h"
+
+/* All fields are in native byte order. The version field doubles as a byte
+ * order mark. The entries follow the header, the paths they point to, each
+ * terminated by a NUL byte, follow the entries. */
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t algorithm; /* an enum hash_algorithm */
+	uint32_t hash_length;
+	uint32_t pad;
+	uint64_t count;
+};
+
+struct index_entry {
+	int64_t size;
+	uint64_t name; /* offset of the path from the start of the paths */
+	uint64_t dev, ino; /* to tell the indexed files from checked ones */
+	unsigned char hash[HASH_MAX_LENGTH]; /* the first hash_length bytes are used */
+};
+
+/* a mapped index */
+struct index {
+	void *map;
+	size_t map_size;
+	const struct index_entry *entries;
+	size_t count;
+	const char *names;
+	size_t names_size;
+	int algorithm, hash_length;
+};
+
+/* a file registered with the matcher */
+struct ref {
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	int file; /* for get_file */
+	bool hashed;
+	unsigned char hash[HASH_MAX_LENGTH];
+};
+
+/* what the hashing threads share */
+struct ref_hashing {
+	struct matcher *m;
+	struct ref *refs;
+	int count, next, done;
+	int algorithm;
+	enum io_method method;
+	bool verbose;
+	bool failed;
+	pthread_mutex_t lock;
+};
+
+static const char index_magic[8] = "FDUPINDX";
+enum { INDEX_VERSION = 0x01020305 };
+
+static int cmp_inode(const void*,const void*);
+static int cmp_ref(const void*,const void*);
+static int collect_refs(struct matcher*,const struct index*,struct ref**,int*);
+static void hash_file(struct ref_hashing*,struct hasher*,struct io_buffer*,int);
+static int hash_refs(struct ref_hashing*,int);
+static void hash_sink(void*,const unsigned char*,size_t);
+static void *hash_worker(void*);
+static bool indexed(const struct index*,size_t,size_t,const struct ref*);
+static size_t lower_bound(const struct index*,off_t,const unsigned char*);
+static int open_index(struct index*,const char*);
+static int store_index(struct matcher*,const char*,const struct ref*,int,int);
+
+int write_index(struct matcher *m, const char *path, int algorithm, int method,
+    int threads, int verbose) {
+	struct ref_hashing h;
+	int retval;
+
+	h.m = m;
+	h.next = 0;
+	h.done = 0;
+	h.algorithm = algorithm;
+	h.method = method;
+	h.verbose = verbose;
+	h.failed = false;
+
+	if (collect_refs(m,NULL,&h.refs,&h.count)) return 1;
+
+	if (hash_refs(&h,threads)) {
+		free(h.refs);
+		return 1;
+	}
+
+	qsort(h.refs,h.count,sizeof *h.refs,cmp_ref);
+	retval = store_index(m,path,h.refs,h.count,algorithm);
+	free(h.refs);
+
+	return retval;
+}
+
+int check_index(struct matcher *m, const char *path, int method, int threads,
+    int verbose) {
+	struct index ix;
+	struct ref_hashing h;
+	const struct index_entry *e;
+	const struct ref *r;
+	const char *file;
+	struct stat st;
+	size_t first, last, j;
+	int i, k, l, n, found = 0, retval = 1;
+
+	if (open_index(&ix,path)) return 1;
+
+	h.m = m;
+	h.refs = NULL;
+	h.next = 0;
+	h.done = 0;
+	h.algorithm = ix.algorithm;
+	h.method = method;
+	h.verbose = verbose;
+	h.failed = false;
+
+	/* only the files with the size of an indexed file are hashed */
+	if (collect_refs(m,&ix,&h.refs,&h.count) || hash_refs(&h,threads)) goto done;
+
+	qsort(h.refs,h.count,sizeof *h.refs,cmp_ref);
+
+	/* the new files with the same hash make up one group */
+	for (i = 0; i < h.count; i = k) {
+		r = h.refs + i;
+		for (k = i + 1; k < h.count; k++)
+			if (h.refs[k].size != r->size || h.refs[k].hashed != r->hashed
+			    || memcmp(h.refs[k].hash,r->hash,ix.hash_length) != 0)
+				break;
+
+		if (!r->hashed) continue;
+
+		first = lower_bound(&ix,r->size,r->hash);
+		for (last = first; last < ix.count; last++) {
+			e = ix.entries + last;
+			if (e->size != r->size || memcmp(e->hash,r->hash,ix.hash_length) != 0)
+				break;
+
+			if (e->name >= ix.names_size) {
+				fprintf(stderr,"Invalid index %s\n",path);
+				goto done;
+			}
+		}
+
+		if (last == first) continue;
+
+		/* an indexed file is no duplicate of itself */
+		for (l = n = i; l < k; l++)
+			if (!indexed(&ix,first,last,h.refs + l)) h.refs[n++] = h.refs[l];
+
+		if (n == i) continue;
+
+		if (found++ > 0) putchar('\n');
+		for (j = first; j < last; j++) puts(ix.names + ix.entries[j].name);
+
+		for (; r < h.refs + n; r++) {
+			file = get_file(m,r->file,&st);
+			if (file == NULL) goto done;
+
+			puts(file);
+		}
+	}
+
+	retval = 0;
+
+	done:
+	munmap(ix.map,ix.map_size);
+	free(h.refs);
+
+	return retval;
+}
+
+/* Map the index at path and check its header. Returns 0 on success. */
+static int open_index(struct index *ix, const char *path) {
+	const struct index_header *header;
+	struct stat st;
+	size_t entries_size;
+	int fd;
+
+	fd = open(path,O_RDONLY);
+	if (fd == -1 || fstat(fd,&st) == -1) {
+		fprintf(stderr,"Cannot open index %s: ",path);
+		perror(NULL);
+		if (fd != -1) close(fd);
+		return 1;
+	}
+
+	if ((size_t)st.st_size < sizeof *header) {
+		close(fd);
+		goto invalid;
+	}
+
+	ix->map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (ix->map == MAP_FAILED) {
+		fprintf(stderr,"Cannot map index %s: ",path);
+		perror(NULL);
+		return 1;
+	}
+
+	ix->map_size = st.st_size;
+	header = ix->map;
+	entries_size = (ix->map_size - sizeof *header) / sizeof *ix->entries;
+
+	if (memcmp(header->magic,index_magic,sizeof index_magic) != 0
+	    || header->version != INDEX_VERSION
+	    || header->count > entries_size
+	    || header->algorithm >= HASH_ALGORITHMS
+	    || header->hash_length != (uint32_t)hash_length(header->algorithm)) {
+		munmap(ix->map,ix->map_size);
+		goto invalid;
+	}
+
+	ix->entries = (const struct index_entry*)(header + 1);
+	ix->count = header->count;
+	ix->names = (const char*)(ix->entries + ix->count);
+	ix->names_size = ix->map_size - ((const char*)ix->names - (const char*)ix->map);
+	ix->algorithm = header->algorithm;
+	ix->hash_length = header->hash_length;
+
+	/* each path has to end within the file */
+	if (ix->names_size > 0 && ix->names[ix->names_size - 1] != '\0') {
+		munmap(ix->map,ix->map_size);
+		goto invalid;
+	}
+
+	return 0;
+
+	invalid:
+	fprintf(stderr,"Invalid index %s\n",path);
+	return 1;
+}
+
+/* Collect the nonempty files of the matcher. If an index is given, only
+ * the files with the size of an entry are collected. */
+static int collect_refs(struct matcher *m, const struct index *ix,
+    struct ref **refs, int *count) {
+	struct stat st;
+	struct ref *r;
+	size_t j;
+	int i, file_count = get_file_count(m);
+
+	*refs = calloc(file_count + 1,sizeof **refs);
+	if (*refs == NULL) {
+		perror("Cannot allocate memory");
+		return 1;
+	}
+
+	for (i = *count = 0; i < file_count; i++) {
+		if (get_file(m,i,&st) == NULL) {
+			free(*refs);
+			*refs = NULL;
+			return 1;
+		}
+
+		if (st.st_size == 0) continue;
+
+		if (ix != NULL) {
+			j = lower_bound(ix,st.st_size,NULL);
+			if (j == ix->count || ix->entries[j].size != st.st_size) continue;
+		}
+
+		r = *refs + (*count)++;
+		r->size = st.st_size;
+		r->dev = st.st_dev;
+		r->ino = st.st_ino;
+		r->file = i;
+	}
+
+	/* hardlinks are hashed once */
+	qsort(*refs,*count,sizeof **refs,cmp_inode);
+
+	return 0;
+}
+
+/* Is the file one of the entries from first to last, or a hardlink to it? */
+static bool indexed(const struct index *ix, size_t first, size_t last,
+    const struct ref *r) {
+	size_t j;
+
+	for (j = first; j < last; j++)
+		if (ix->entries[j].dev == (uint64_t)r->dev && ix->entries[j].ino == (uint64_t)r->ino)
+			return true;
+
+	return false;
+}
+
+/* The index of the first entry not below the given size and hash, or the
+ * first entry of that size if hash is NULL. */
+static size_t lower_bound(const struct index *ix, off_t size, const unsigned char *hash) {
+	const struct index_entry *e;
+	size_t low = 0, high = ix->count, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		e = ix->entries + mid;
+
+		if (e->size < size || (e->size == size && hash != NULL
+		    && memcmp(e->hash,hash,ix->hash_length) < 0))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static int cmp_inode(const void *a_void, const void *b_void) {
+	const struct ref *a = a_void, *b = b_void;
+
+	if (a->dev != b->dev) return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino) return a->ino < b->ino ? -1 : 1;
+	if (a->file != b->file) return a->file < b->file ? -1 : 1;
+
+	return 0;
+}
+
+/* order by size and hash, like the index, with files that could not be read
+ * after those of their size that could */
+static int cmp_ref(const void *a_void, const void *b_void) {
+	const struct ref *a = a_void, *b = b_void;
+	int cmp;
+
+	if (a->size != b->size) return a->size < b->size ? -1 : 1;
+	if (a->hashed != b->hashed) return a->hashed ? -1 : 1;
+	cmp = memcmp(a->hash,b->hash,sizeof a->hash);
+	if (cmp != 0) return cmp;
+	if (a->file != b->file) return a->file < b->file ? -1 : 1;
+
+	return 0;
+}
+
+/* hash the files with up to the given number of threads */
+static int hash_refs(struct ref_hashing *h, int threads) {
+	pthread_t *workers = NULL;
+	int i = 0, err;
+
+	if (threads > h->count) threads = h->count;
+
+	pthread_mutex_init(&h->lock,NULL);
+
+	if (threads > 1) workers = malloc(threads * sizeof *workers);
+
+	if (workers != NULL) for (i = 0; i < threads; i++) {
+		err = pthread_create(workers+i,NULL,hash_worker,h);
+		if (err != 0) {
+			fprintf(stderr,"Cannot create hashing thread: %s\n",strerror(err));
+			break;
+		}
+	}
+
+	/* if no thread could be created, do the work ourselves */
+	if (i == 0) hash_worker(h);
+
+	while (i-- > 0) pthread_join(workers[i],NULL);
+
+	pthread_mutex_destroy(&h->lock);
+	free(workers);
+
+	if (h->verbose && h->count > 0) fputc('\n',stderr);
+
+	/* hand the hash of each file to its hardlinks */
+	for (i = 1; i < h->count; i++)
+		if (h->refs[i].dev == h->refs[i-1].dev && h->refs[i].ino == h->refs[i-1].ino) {
+			h->refs[i].hashed = h->refs[i-1].hashed;
+			memcpy(h->refs[i].hash,h->refs[i-1].hash,sizeof h->refs[i].hash);
+		}
+
+	return h->failed;
+}
+
+static void *hash_worker(void *arg) {
+	struct ref_hashing *h = arg;
+	struct hasher hasher;
+	struct io_buffer buf = { NULL, 0 };
+	int i;
+
+	hasher.evp = NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&h->lock);
+		i = h->failed ? h->count : h->next++;
+		pthread_mutex_unlock(&h->lock);
+
+		if (i >= h->count) break;
+
+		/* hardlinks to a file hashed before get its hash afterwards */
+		if (i == 0 || h->refs[i].dev != h->refs[i-1].dev || h->refs[i].ino != h->refs[i-1].ino)
+			hash_file(h,&hasher,&buf,i);
+
+		pthread_mutex_lock(&h->lock);
+		h->done++;
+		if (h->verbose) fprintf(stderr,"\rHashed %9d of %9d files",h->done,h->count);
+		pthread_mutex_unlock(&h->lock);
+	}
+
+	hasher_free(&hasher);
+	free_io_buffer(&buf);
+
+	return NULL;
+}
+
+/* Hash the i-th file. Files that can't be read are left unhashed. */
+static void hash_file(struct ref_hashing *h, struct hasher *hasher,
+    struct io_buffer *buf, int i) {
+	struct ref *r = h->refs + i;
+	struct stat st;
+	const char *file;
+	char *path = NULL;
+
+	/* get_file returns the same buffer each time */
+	pthread_mutex_lock(&h->lock);
+	file = get_file(h->m,r->file,&st);
+	if (file != NULL) path = strdup(file);
+	pthread_mutex_unlock(&h->lock);
+
+	if (path == NULL || hasher_init(hasher,h->algorithm)) {
+		perror("Cannot allocate memory");
+		free(path);
+		pthread_mutex_lock(&h->lock);
+		h->failed = true;
+		pthread_mutex_unlock(&h->lock);
+		return;
+	}
+
+	if (read_range(path,0,r->size,h->method,buf,hash_sink,hasher) == 0) {
+		hasher_final(hasher,r->hash);
+		r->hashed = true;
+	}
+
+	free(path);
+}
+
+static void hash_sink(void *hasher, const unsigned char *data, size_t len) {
+	hasher_update(hasher,data,len);
+}
+
+/* Write the hashed files to a temporary file next to the index and move it
+ * over the index. The files are sorted by size and hash already. */
+static int store_index(struct matcher *m, const char *path, const struct ref *refs,
+    int count, int algorithm) {
+	struct index_header header;
+	struct index_entry e;
+	struct stat st;
+	const char *file;
+	char *tmp;
+	uint64_t name = 0;
+	size_t len;
+	FILE *f;
+	int fd, i, pass;
+
+	len = strlen(path) + 8;
+	tmp = malloc(len);
+	if (tmp == NULL) {
+		perror("Cannot allocate memory");
+		return 1;
+	}
+
+	snprintf(tmp,len,"%s.XXXXXX",path);
+	fd = mkstemp(tmp);
+	if (fd == -1 || (f = fdopen(fd,"wb")) == NULL) {
+		fprintf(stderr,"Cannot create temporary file for index %s: ",path);
+		perror(NULL);
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return 1;
+	}
+
+	memset(&header,0,sizeof header);
+	memcpy(header.magic,index_magic,sizeof index_magic);
+	header.version = INDEX_VERSION;
+	header.algorithm = algorithm;
+	header.hash_length = hash_length(algorithm);
+	for (i = 0; i < count; i++) header.count += refs[i].hashed;
+
+	if (fwrite(&header,sizeof header,1,f) != 1) goto fail;
+
+	/* the entries first, then the paths they point to */
+	for (pass = 0; pass < 2; pass++) for (i = 0; i < count; i++) {
+		if (!refs[i].hashed) continue;
+
+		file = get_file(m,refs[i].file,&st);
+		if (file == NULL) goto fail;
+		len = strlen(file) + 1;
+
+		if (pass == 0) {
+			memset(&e,0,sizeof e);
+			e.size = refs[i].size;
+			e.name = name;
+			e.dev = refs[i].dev;
+			e.ino = refs[i].ino;
+			memcpy(e.hash,refs[i].hash,header.hash_length);
+			name += len;
+
+			if (fwrite(&e,sizeof e,1,f) != 1) goto fail;
+		} else if (fwrite(file,1,len,f) != len) goto fail;
+	}
+
+	if (fflush(f) == EOF || fsync(fd) == -1) goto fail;
+
+	if (fclose(f) == EOF) {
+		f = NULL;
+		goto fail;
+	}
+
+	if (rename(tmp,path) == -1) {
+		f = NULL;
+		goto fail;
+	}
+
+	free(tmp);
+	return 0;
+
+	fail:
+	fprintf(stderr,"Cannot write index %s: ",path);
+	perror(NULL);
+	if (f != NULL) fclose(f);
+	unlink(tmp);
+	free(tmp);
+	return 1;
+}
@@ -0,0 +1,46 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef INDEX_H
+#define INDEX_H
+
+/* An index of a reference tree holds the size, hash and path of each
+ * nonempty file in the tree, sorted by size and hash. New files can be
+ * checked against the tree with it, reading only the new files that have
+ * the size of a file in the index. The index is mapped into memory and
+ * searched without parsing it. */
+
+struct matcher;
+
+/* Hash all nonempty files registered with the ungrouped matcher with the
+ * given enum hash_algorithm from hash.h and enum io_method from io.h using
+ * the given number of threads and atomically replace the index file with
+ * them. Files that cannot be read are left out. Returns 0 on success. */
+int write_index(struct matcher*,const char*,int,int,int,int);
+/* Print each group of files registered with the ungrouped matcher that
+ * have equal contents to files in the index, preceded by those files, with
+ * the given enum io_method and number of threads. Returns 0 on success. */
+int check_index(struct matcher*,const char*,int,int,int);
+
+#endif /* INDEX_H */
@@ -0,0 +1,768 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+/* for O_DIRECT, mincore and syscall */
+#ifdef __linux__
+# define _GNU_SOURCE
+# define HAVE_MINCORE
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* io_uring is used through the raw system calls, no library needed */
+#ifdef __linux__
+# include <sys/syscall.h>
+# ifdef __NR_io_uring_setup
+#  include <linux/io_uring.h>
+#  define HAVE_IO_URING
+# endif
+#endif
+
+#include "io.h"
+
+enum {
+	MIN_BUFFER = 64*1024,
+	MAX_BUFFER = 4*1024*1024,
+	DIRECT_ALIGN = 4096, /* for the buffer, offsets and lengths */
+	ADVISE_MIN = 1024*1024, /* shorter reads are not worth the hints */
+	MAP_WINDOW = 64*1024*1024, /* how much of a file is mapped at once */
+	RING_BUFFER = 1024*1024, /* largest buffer of each range read by io_uring */
+	COMPARE_CHUNK = 1024*1024, /* largest chunk read by compare_group */
+	RESIDENT_WINDOW = 4096 /* pages mincore looks at at once */
+};
+
+/* The pages of a range that were in the page cache before it was read, one
+ * bit each. Only the other pages are dropped afterwards, so reading a file
+ * that is in use does not evict it. */
+struct resident_pages {
+	unsigned char *bits; /* NULL if not known, then nothing is dropped */
+	off_t start; /* the range rounded out to pages */
+	size_t count;
+};
+
+#ifdef HAVE_IO_URING
+/* the parts of the rings shared with the kernel */
+struct ring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_size, cq_map_size, sqes_size;
+	unsigned queued; /* entries not yet submitted */
+};
+
+/* a range being read through the ring; fd is -1 for unused slots */
+struct ring_slot {
+	int fd;
+	char *path;
+	off_t offset, length;
+	bool advise;
+	struct resident_pages resident;
+	void *arg;
+	struct iovec iov;
+	struct io_buffer buf;
+};
+
+static void close_ring(struct ring*);
+static void finish_slot(struct ring_slot*,int,int,io_done*,void*);
+static int open_ring(struct ring*,unsigned);
+static void queue_read(struct ring*,struct ring_slot*,int);
+static bool read_ring(int,io_next*,io_sink*,io_done*,void*);
+static bool start_slot(struct ring*,struct ring_slot*,int,io_next*,io_done*,void*);
+#endif
+
+static void drop_pages(struct resident_pages*,int);
+static int grow_buffer(struct io_buffer*,off_t,size_t);
+static void note_resident(struct resident_pages*,int,off_t,off_t);
+static ssize_t read_full(int,unsigned char*,size_t);
+static int read_direct(int,off_t,off_t,struct io_buffer*,io_sink*,void*);
+static int read_mapped(int,off_t,off_t,io_sink*,void*);
+static int read_plain(int,off_t,off_t,struct io_buffer*,io_sink*,void*);
+
+int read_range(const char *path, off_t offset, off_t length, enum io_method method,
+    struct io_buffer *buf, io_sink *sink, void *arg) {
+	struct resident_pages resident;
+	int fd = -1, retval;
+	bool advise;
+
+#ifdef O_DIRECT
+	if (method == IO_DIRECT) {
+		fd = open(path,O_RDONLY|O_NOCTTY|O_DIRECT);
+
+		/* the file system does not do direct I/O */
+		if (fd == -1 && errno == EINVAL) method = IO_READ;
+	}
+#else
+	if (method == IO_DIRECT) method = IO_READ;
+#endif
+
+	if (fd == -1 && method != IO_DIRECT) fd = open(path,O_RDONLY|O_NOCTTY);
+
+	/* we probably don't have the right permissions */
+	if (fd == -1) return 1;
+
+	if (method != IO_MMAP && grow_buffer(buf,length,MAX_BUFFER)) {
+		close(fd);
+		return 1;
+	}
+
+	advise = method != IO_DIRECT && length >= ADVISE_MIN;
+	if (advise) {
+		note_resident(&resident,fd,offset,length);
+		posix_fadvise(fd,offset,length,POSIX_FADV_SEQUENTIAL);
+#ifdef POSIX_FADV_NOREUSE
+		posix_fadvise(fd,offset,length,POSIX_FADV_NOREUSE);
+#endif
+	}
+
+	switch (method) {
+	case IO_URING: /* only read_ranges makes use of it */
+	case IO_READ: retval = read_plain(fd,offset,length,buf,sink,arg); break;
+	case IO_DIRECT: retval = read_direct(fd,offset,length,buf,sink,arg); break;
+	case IO_MMAP:
+	default: retval = read_mapped(fd,offset,length,sink,arg); break;
+	}
+
+	if (retval != 0) {
+		fprintf(stderr,"Error reading file %s: ",path);
+		perror(NULL);
+	}
+
+	/* we won't need these pages again, so don't crowd out others */
+	if (advise) drop_pages(&resident,fd);
+
+	close(fd);
+
+	return retval;
+}
+
+/* Each file's class is the index of the first file found to be equal to it.
+ * Files alone in their class are not read any further. The chunks start
+ * small so files differing at the beginning are told apart quickly. */
+void compare_group(const char *const *paths, int count, off_t length,
+    struct io_buffer *buf, int *classes) {
+	struct resident_pages resident[COMPARE_MAX];
+	int fds[COMPARE_MAX], next[COMPARE_MAX], i, j, live;
+	ssize_t counts[COMPARE_MAX];
+	size_t chunk = MIN_BUFFER;
+	off_t offset = 0;
+	bool advise = length >= ADVISE_MIN;
+
+	for (i = 0; i < count; i++) {
+		fds[i] = open(paths[i],O_RDONLY|O_NOCTTY);
+		classes[i] = fds[i] == -1 ? -1 : 0;
+		if (advise && fds[i] != -1) {
+			note_resident(resident + i,fds[i],0,length);
+			posix_fadvise(fds[i],0,length,POSIX_FADV_SEQUENTIAL);
+		}
+	}
+
+	if (grow_buffer(buf,count * length,count * COMPARE_CHUNK))
+		for (i = 0; i < count; i++) classes[i] = -1;
+
+	while (offset < length) {
+		if (chunk > buf->size / count) chunk = buf->size / count;
+
+		live = 0;
+		for (i = 0; i < count; i++) {
+			next[i] = classes[i];
+			if (classes[i] == -1) continue;
+
+			/* is there another file in the same class? */
+			for (j = 0; j < count; j++)
+				if (j != i && classes[j] == classes[i]) break;
+
+			if (j == count) continue;
+
+			counts[i] = read_full(fds[i],buf->data + i * chunk,chunk);
+			if (counts[i] == -1) {
+				fprintf(stderr,"Error reading %s: ",paths[i]);
+				perror(NULL);
+				classes[i] = next[i] = -1;
+				continue;
+			}
+
+			live++;
+			next[i] = i;
+			for (j = 0; j < i; j++)
+				if (next[j] != -1 && classes[j] == classes[i] && counts[j] == counts[i]
+				    && memcmp(buf->data + j * chunk,buf->data + i * chunk,counts[i]) == 0) {
+					next[i] = next[j];
+					break;
+				}
+		}
+
+		memcpy(classes,next,count * sizeof *classes);
+		if (live < 2) break;
+
+		offset += chunk;
+		if (chunk < COMPARE_CHUNK) chunk *= 2;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (fds[i] == -1) continue;
+		if (advise) drop_pages(resident + i,fds[i]);
+		close(fds[i]);
+	}
+}
+
+int compare_files(const char *a, const char *b) {
+	unsigned char *buf;
+	ssize_t count_a, count_b;
+	int fd_a, fd_b = -1, retval = -1;
+	struct stat st_a, st_b;
+
+	buf = malloc(2 * MIN_BUFFER);
+	if (buf == NULL) {
+		perror("Cannot allocate memory");
+		return -1;
+	}
+
+	fd_a = open(a,O_RDONLY|O_NOCTTY);
+	if (fd_a == -1) {
+		fprintf(stderr,"Cannot open %s: ",a);
+		perror(NULL);
+		goto done;
+	}
+
+	fd_b = open(b,O_RDONLY|O_NOCTTY);
+	if (fd_b == -1) {
+		fprintf(stderr,"Cannot open %s: ",b);
+		perror(NULL);
+		goto done;
+	}
+
+	if (fstat(fd_a,&st_a) == -1 || fstat(fd_b,&st_b) == -1) {
+		perror("Cannot call stat");
+		goto done;
+	}
+
+	retval = 1;
+	if (st_a.st_size != st_b.st_size) goto done;
+
+	/* hardlinks are trivially equal */
+	retval = 0;
+	if (st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino) goto done;
+
+	posix_fadvise(fd_a,0,0,POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd_b,0,0,POSIX_FADV_SEQUENTIAL);
+
+	do {
+		count_a = read_full(fd_a,buf,MIN_BUFFER);
+		count_b = read_full(fd_b,buf + MIN_BUFFER,MIN_BUFFER);
+		if (count_a == -1 || count_b == -1) {
+			fprintf(stderr,"Error reading %s: ",count_a == -1 ? a : b);
+			perror(NULL);
+			retval = -1;
+			break;
+		}
+
+		if (count_a != count_b || memcmp(buf,buf + MIN_BUFFER,count_a) != 0) {
+			retval = 1;
+			break;
+		}
+	} while (count_a > 0);
+
+	done:
+	if (fd_a != -1) close(fd_a);
+	if (fd_b != -1) close(fd_b);
+	free(buf);
+	return retval;
+}
+
+void free_io_buffer(struct io_buffer *buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
+
+void read_ranges(int depth, enum io_method method, io_next *next, io_sink *sink,
+    io_done *done, void *state) {
+	struct io_buffer buf = { NULL, 0 };
+	struct io_range range;
+
+#ifdef HAVE_IO_URING
+	/* falls back to IO_READ for what is left if io_uring fails */
+	if (method == IO_URING && read_ring(depth,next,sink,done,state)) return;
+#else
+	(void)depth;
+#endif
+
+	if (method == IO_URING) method = IO_READ;
+
+	while (next(state,0,&range) == 0)
+		done(state,0,read_range(range.path,range.offset,range.length,
+		    method,&buf,sink,range.arg) == 0);
+
+	free_io_buffer(&buf);
+}
+
+/* make sure buf can hold a read of length bytes or at least max bytes. The
+ * buffer is suitably aligned for O_DIRECT. Returns 0 on success. */
+/* Find out which pages of the range are in the page cache. */
+static void note_resident(struct resident_pages *r, int fd, off_t offset, off_t length) {
+#ifdef HAVE_MINCORE
+	unsigned char vec[RESIDENT_WINDOW];
+	long page = sysconf(_SC_PAGESIZE);
+	size_t i, j, n;
+	void *map;
+
+	r->start = offset - offset % page;
+	r->count = (offset + length - r->start + page - 1) / page;
+	r->bits = calloc((r->count + 7) / 8,1);
+	if (r->bits == NULL) return;
+
+	/* a window at a time, so the mappings stay small */
+	for (i = 0; i < r->count; i += n) {
+		n = r->count - i < RESIDENT_WINDOW ? r->count - i : RESIDENT_WINDOW;
+		map = mmap(NULL,n * page,PROT_READ,MAP_SHARED,fd,r->start + (off_t)i * page);
+		if (map == MAP_FAILED || mincore(map,n * page,vec) == -1) {
+			if (map != MAP_FAILED) munmap(map,n * page);
+			free(r->bits);
+			r->bits = NULL;
+			return;
+		}
+
+		munmap(map,n * page);
+		for (j = 0; j < n; j++)
+			if (vec[j] & 1) r->bits[(i + j) / 8] |= 1 << (i + j) % 8;
+	}
+#else
+	(void)fd;
+	(void)offset;
+	(void)length;
+	r->bits = NULL;
+#endif
+}
+
+/* Drop the pages of the range that were not in the page cache before, a run
+ * of them at a time. */
+static void drop_pages(struct resident_pages *r, int fd) {
+	long page = sysconf(_SC_PAGESIZE);
+	size_t i, j;
+
+	if (r->bits == NULL) return;
+
+	for (i = 0; i < r->count; i = j + 1) {
+		for (j = i; j < r->count && (r->bits[j / 8] & 1 << j % 8) == 0; j++)
+			;
+
+		if (j > i)
+			posix_fadvise(fd,r->start + (off_t)i * page,(off_t)(j - i) * page,
+			    POSIX_FADV_DONTNEED);
+	}
+
+	free(r->bits);
+	r->bits = NULL;
+}
+
+static int grow_buffer(struct io_buffer *buf, off_t length, size_t max) {
+	size_t size = MIN_BUFFER;
+	void *data;
+
+	while (size < max && (off_t)size < length) size *= 2;
+	if (size <= buf->size) return 0;
+
+	if (posix_memalign(&data,DIRECT_ALIGN,size) != 0) {
+		/* make do with what we have */
+		if (buf->size > 0) return 0;
+
+		perror("Cannot allocate memory");
+		return 1;
+	}
+
+	free(buf->data);
+	buf->data = data;
+	buf->size = size;
+
+	return 0;
+}
+
+/* read until len bytes are read or the end of the file is reached */
+static ssize_t read_full(int fd, unsigned char *buf, size_t len) {
+	size_t total = 0;
+	ssize_t count;
+
+	while (total < len) {
+		count = read(fd,buf + total,len - total);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		if (count == 0) break;
+		total += count;
+	}
+
+	return total;
+}
+
+/* returns 0 on success, 1 with errno set on error */
+static int read_plain(int fd, off_t offset, off_t length, struct io_buffer *buf,
+    io_sink *sink, void *arg) {
+	ssize_t count;
+
+	while (length > 0) {
+		count = pread(fd,buf->data,(off_t)buf->size < length ? buf->size : (size_t)length,offset);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+
+		if (count == 0) break;
+
+		sink(arg,buf->data,count);
+		offset += count;
+		length -= count;
+	}
+
+	return 0;
+}
+
+/* O_DIRECT requires aligned offsets and lengths, so read whole blocks and
+ * pass on the part that was asked for */
+static int read_direct(int fd, off_t offset, off_t length, struct io_buffer *buf,
+    io_sink *sink, void *arg) {
+	off_t skip = offset % DIRECT_ALIGN, pos = offset - skip;
+	size_t want;
+	ssize_t count, used;
+	int flags;
+
+	length += skip;
+	while (length > 0) {
+		want = (off_t)buf->size < length ? buf->size
+		    : (size_t)(length + (DIRECT_ALIGN - length % DIRECT_ALIGN) % DIRECT_ALIGN);
+		count = pread(fd,buf->data,want,pos);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+
+			/* The device wants a larger alignment. Unless we
+			 * already passed data on, start over without O_DIRECT. */
+			if (errno != EINVAL || pos + skip != offset) return 1;
+
+			flags = fcntl(fd,F_GETFL);
+			if (flags == -1 || fcntl(fd,F_SETFL,flags & ~O_DIRECT) == -1)
+				return 1;
+
+			return read_plain(fd,offset,length - skip,buf,sink,arg);
+		}
+
+		if (count <= skip) break;
+
+		used = count < length ? count : length;
+		sink(arg,buf->data + skip,used - skip);
+		pos += count;
+		length -= used;
+		skip = 0;
+
+		/* end of file */
+		if ((size_t)count < want) break;
+	}
+
+	return 0;
+}
+
+/* map the file a window at a time. The range is clamped to the current size
+ * of the file as touching pages past its end raises SIGBUS. */
+static int read_mapped(int fd, off_t offset, off_t length, io_sink *sink, void *arg) {
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	off_t skip;
+	size_t window;
+	unsigned char *map;
+
+	if (pagesize <= 0) pagesize = DIRECT_ALIGN;
+
+	if (fstat(fd,&st) == -1) return 1;
+	if (offset >= st.st_size) return 0;
+	if (length > st.st_size - offset) length = st.st_size - offset;
+
+	while (length > 0) {
+		skip = offset % pagesize;
+		window = length + skip > MAP_WINDOW ? MAP_WINDOW : (size_t)(length + skip);
+
+		map = mmap(NULL,window,PROT_READ,MAP_SHARED,fd,offset - skip);
+		if (map == MAP_FAILED) return 1;
+
+		posix_madvise(map,window,POSIX_MADV_SEQUENTIAL);
+		sink(arg,map + skip,window - skip);
+		munmap(map,window);
+
+		offset += window - skip;
+		length -= window - skip;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+
+/* Read the ranges through an io_uring, keeping up to depth of them in
+ * flight. Returns false if io_uring is unavailable or stops working, leaving
+ * the ranges next has not handed out yet to the caller. */
+static bool read_ring(int depth, io_next *next, io_sink *sink, io_done *done, void *state) {
+	struct ring r;
+	struct ring_slot *slots, *s;
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int i, ret, active = 0;
+	bool more = true, broken = false;
+
+	slots = malloc(depth * sizeof *slots);
+	if (slots == NULL) return false;
+
+	if (open_ring(&r,depth)) {
+		free(slots);
+		return false;
+	}
+
+	for (i = 0; i < depth; i++) {
+		memset(slots+i,0,sizeof slots[i]);
+		slots[i].fd = -1;
+	}
+
+	for (;;) {
+		for (i = 0; more && i < depth; i++) if (slots[i].fd == -1) {
+			more = start_slot(&r,slots+i,i,next,done,state);
+			if (slots[i].fd != -1) active++;
+		}
+
+		if (active == 0) break;
+
+		ret = syscall(__NR_io_uring_enter,r.fd,r.queued,1,IORING_ENTER_GETEVENTS,NULL,0);
+		if (ret == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+
+			/* give up on what is in flight */
+			perror("Cannot submit reads");
+			for (i = 0; i < depth; i++)
+				if (slots[i].fd != -1) finish_slot(slots+i,i,0,done,state);
+
+			broken = true;
+			break;
+		}
+
+		r.queued -= ret;
+
+		head = *r.cq_head;
+		while (head != __atomic_load_n(r.cq_tail,__ATOMIC_ACQUIRE)) {
+			cqe = r.cqes + (head & *r.cq_mask);
+			i = cqe->user_data;
+			s = slots + i;
+
+			if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+				queue_read(&r,s,i);
+			else if (cqe->res < 0) {
+				fprintf(stderr,"Error reading file %s: %s\n",s->path,strerror(-cqe->res));
+				finish_slot(s,i,0,done,state);
+				active--;
+			} else if (cqe->res == 0) {
+				/* the file shrank */
+				finish_slot(s,i,1,done,state);
+				active--;
+			} else {
+				sink(s->arg,s->buf.data,cqe->res);
+				s->offset += cqe->res;
+				s->length -= cqe->res;
+				if (s->length > 0) queue_read(&r,s,i);
+				else {
+					finish_slot(s,i,1,done,state);
+					active--;
+				}
+			}
+
+			head++;
+			__atomic_store_n(r.cq_head,head,__ATOMIC_RELEASE);
+		}
+	}
+
+	for (i = 0; i < depth; i++) free_io_buffer(&slots[i].buf);
+	free(slots);
+	close_ring(&r);
+
+	return !broken;
+}
+
+/* Take ranges from next until one of them is opened and queued in slot s.
+ * Ranges that need no reading are finished right away. Returns false once
+ * next has no more ranges. */
+static bool start_slot(struct ring *r, struct ring_slot *s, int slot,
+    io_next *next, io_done *done, void *state) {
+	struct io_range range;
+
+	while (next(state,slot,&range) == 0) {
+		/* we probably don't have the right permissions */
+		s->fd = open(range.path,O_RDONLY|O_NOCTTY);
+		if (s->fd == -1) {
+			done(state,slot,0);
+			continue;
+		}
+
+		s->path = strdup(range.path);
+		if (s->path == NULL || grow_buffer(&s->buf,range.length,RING_BUFFER)) {
+			if (s->path == NULL) perror("Cannot allocate memory");
+			finish_slot(s,slot,0,done,state);
+			continue;
+		}
+
+		if (range.length <= 0) {
+			finish_slot(s,slot,1,done,state);
+			continue;
+		}
+
+		s->offset = range.offset;
+		s->length = range.length;
+		s->arg = range.arg;
+		s->advise = range.length >= ADVISE_MIN;
+		if (s->advise) {
+			note_resident(&s->resident,s->fd,s->offset,s->length);
+			posix_fadvise(s->fd,s->offset,s->length,POSIX_FADV_SEQUENTIAL);
+#ifdef POSIX_FADV_NOREUSE
+			posix_fadvise(s->fd,s->offset,s->length,POSIX_FADV_NOREUSE);
+#endif
+		}
+
+		queue_read(r,s,slot);
+		return true;
+	}
+
+	return false;
+}
+
+static void finish_slot(struct ring_slot *s, int slot, int ok, io_done *done, void *state) {
+	if (s->advise) drop_pages(&s->resident,s->fd);
+
+	close(s->fd);
+	free(s->path);
+	s->fd = -1;
+	s->path = NULL;
+	s->advise = false;
+
+	done(state,slot,ok);
+}
+
+/* queue a read of the next piece of the range in slot s */
+static void queue_read(struct ring *r, struct ring_slot *s, int slot) {
+	unsigned tail = *r->sq_tail, index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = r->sqes + index;
+
+	s->iov.iov_base = s->buf.data;
+	s->iov.iov_len = (off_t)s->buf.size < s->length ? s->buf.size : (size_t)s->length;
+
+	/* IORING_OP_READV works with all kernels that have io_uring */
+	memset(sqe,0,sizeof *sqe);
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = s->fd;
+	sqe->off = s->offset;
+	sqe->addr = (uintptr_t)&s->iov;
+	sqe->len = 1;
+	sqe->user_data = slot;
+
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail,tail+1,__ATOMIC_RELEASE);
+	r->queued++;
+}
+
+/* set up a ring with room for depth entries; returns 0 on success */
+static int open_ring(struct ring *r, unsigned depth) {
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r,0,sizeof *r);
+	memset(&p,0,sizeof p);
+
+	r->fd = syscall(__NR_io_uring_setup,depth,&p);
+	if (r->fd == -1) return 1;
+
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* newer kernels map both rings in one go */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_size > r->sq_map_size) r->sq_map_size = r->cq_map_size;
+		r->cq_map_size = 0;
+	}
+
+	r->sq_map = mmap(NULL,r->sq_map_size,PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) goto fail;
+
+	if (r->cq_map_size == 0) r->cq_map = r->sq_map;
+	else {
+		r->cq_map = mmap(NULL,r->cq_map_size,PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED) goto fail;
+	}
+
+	r->sqes = mmap(NULL,r->sqes_size,PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto fail;
+
+	sq = r->sq_map;
+	cq = r->cq_map;
+	r->sq_head = (unsigned*)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)(sq + p.sq_off.array);
+	r->cq_head = (unsigned*)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return 0;
+
+	fail:
+	close_ring(r);
+	return 1;
+}
+
+static void close_ring(struct ring *r) {
+	if (r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes,r->sqes_size);
+	if (r->cq_map != NULL && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+		munmap(r->cq_map,r->cq_map_size);
+	if (r->sq_map != NULL && r->sq_map != MAP_FAILED) munmap(r->sq_map,r->sq_map_size);
+
+	close(r->fd);
+}
+
+#endif
@@ -0,0 +1,96 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef IO_H
+#define IO_H
+
+#include <sys/types.h>
+
+/* how file contents are read for hashing */
+enum io_method {
+	IO_READ, /* pread into a buffer */
+	IO_DIRECT, /* pread with O_DIRECT, bypassing the page cache */
+	IO_MMAP, /* map the file */
+	IO_URING /* keep many reads in flight with io_uring */
+};
+
+/* how many ranges read_ranges reads at once with IO_URING */
+enum { IO_DEPTH = 32 };
+
+/* a read buffer, one per thread; start with an all-zero io_buffer */
+struct io_buffer {
+	unsigned char *data;
+	size_t size;
+};
+
+/* receives the contents read piece by piece */
+typedef void io_sink(void*,const unsigned char*,size_t);
+
+/* Read length bytes of path starting at offset and pass them to the sink
+ * along with the given argument. Stops early at the end of the file. The
+ * buffer grows with the length of the reads, up to a few MiB. Large reads
+ * are announced to the kernel and the pages read are dropped afterwards.
+ * Returns 0 on success, 1 on failure. Read errors are reported on stderr,
+ * files that cannot be opened are skipped silently. */
+int read_range(const char*,off_t,off_t,enum io_method,struct io_buffer*,io_sink*,void*);
+
+void free_io_buffer(struct io_buffer*);
+
+/* the most files compare_group compares at once */
+enum { COMPARE_MAX = 3 };
+
+/* Read the first length bytes of up to COMPARE_MAX files in lockstep and
+ * sort them into classes of files with equal contents. Afterwards, classes
+ * holds a number for each file that is the same for files with equal
+ * contents, or -1 for files that could not be read. Reading stops as soon
+ * as no two files can be equal anymore. */
+void compare_group(const char*const*,int,off_t,struct io_buffer*,int*);
+
+/* Compare the contents of two files byte by byte. Returns 0 if they are
+ * equal, 1 if they differ and -1 if they could not be read. */
+int compare_files(const char*,const char*);
+
+/* one range to read, as handed out by an io_next function */
+struct io_range {
+	const char *path; /* needs to stay valid until io_next is called again */
+	off_t offset, length;
+	void *arg; /* passed to the sink */
+};
+
+/* Fill in the next range to read into the given slot, a number below the
+ * depth passed to read_ranges. Returns 0 if there is such a range, 1 if
+ * there are no more ranges to read. */
+typedef int io_next(void*,int,struct io_range*);
+/* The range in the given slot has been read completely if the last argument
+ * is nonzero or could not be read otherwise. The slot may then be reused. */
+typedef void io_done(void*,int,int);
+
+/* Read all ranges handed out by next, passing their contents to sink and
+ * calling done once each range is finished. With IO_URING, up to depth
+ * ranges are read at once, each range in order. Where io_uring is not
+ * available, the ranges are read one after another with IO_READ, as they
+ * are with the other methods. */
+void read_ranges(int,enum io_method,io_next*,io_sink*,io_done*,void*);
+
+#endif
@@ -30,51 +30,240 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <openssl/sha.h>
-
+#include "cache.h"
+#include "extent.h"
+#include "hash.h"
+#include "io.h"
 #include "match.h"
+#include "sort.h"
 
-typedef unsigned char sha_hash[SHA_DIGEST_LENGTH];
-
+/* The records in the info file only contain what the matcher needs. Which
+ * of mode, uid, gid, mtime and ctime are stored depends on the matcher flags;
+ * they follow the record at the offsets found in struct matcher. */
 struct fileinfo {
-	struct stat stat;
-	off_t path; /* pointer into filename file */
-	int hashed; /* 0: no hash; 1: short hash; 2: full hash */
-	sha_hash hash;
-	sha_hash short_hash;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	off_t name; /* pointer into filename file */
+	int dir; /* index into the directory table or NO_DIR */
+	int hash; /* index into the hash table or NO_HASH */
+};
+
+/* Paths are not stored in full. Instead, each file refers to the directory
+ * it is in, which refers to its parent directory and so on. */
+struct dirinfo {
+	off_t name; /* pointer into filename file */
+	int parent; /* index into the directory table or NO_DIR */
+};
+
+/* The longest record layout_records can lay out. Each of its two paddings to
+ * the size of a struct timespec adds less than one of them. */
+#define RECORD_MAX (sizeof(struct fileinfo) + 4 * sizeof(struct timespec) \
+    + sizeof(mode_t) + sizeof(uid_t) + sizeof(gid_t))
+
+/* a directory register_file made an entry for, found by its path */
+struct lone_dir {
+	char *path; /* NULL if the slot is free */
+	int index;
+};
+
+/* only files that cannot be told apart by their metadata get one of these */
+struct hashinfo {
+	int stage; /* number of completed hashing stages, STAGE_FAILED or STAGE_SHARED */
+	bool cached; /* hash was found in the hash cache */
+	unsigned char hash[HASH_MAX_LENGTH];
+	unsigned char short_hash[HASH_MAX_LENGTH]; /* hash over the samples taken so far */
+};
+
+enum {
+	QUEUE_SIZE = 16, /* windows resolved ahead of the actions at most */
+	WINDOW_FILES = 4096, /* candidates resolved at once when streaming */
+	NO_HASH = -1,
+	NO_DIR = -1,
+	STAGE_FAILED = -1,
+	STAGE_SHARED = -2, /* shares its extents with another file of its group */
+	SAMPLE_ALIGN = 4096,
+	MERGE_WAYS = 16, /* runs merged into one at once before grouping */
+	BATCH_MAX = 64*1024 /* longest read hashed along with others */
+};
+
+/* what the verbose output says about a hashing stage */
+struct stage_stats {
+	int candidates;
+	int eliminated;
+	int compared; /* groups compared directly */
 };
 
 struct matcher {
 	FILE *name_file;
 	FILE *info_file;
 	char *name_map;
-	struct fileinfo *info_map;
+	char *info_map;
+	struct hashinfo *hashes;
+	struct dirinfo *dirs;
+	int dir_count, dir_size;
+	struct lone_dir *lone_dirs; /* open addressing, half full at most */
+	size_t lone_dir_count, lone_dir_size;
+	char *group_path, *file_path; /* returned by next_group and next_file */
+	size_t group_path_size, file_path_size;
+	size_t info_size; /* size of one record, 0 until the first is written */
+	size_t mode_offset, uid_offset, gid_offset, mtime_offset, ctime_offset;
 	int file_count;
+	int candidate_count; /* files that share their metadata with another */
 	int file_index;
+	int thread_count;
+	int stage_count; /* number of sampling stages */
+	struct stage stages[MAX_STAGES];
+	struct stage_stats stats[MAX_STAGES + 1];
+	int cache_hits;
+	int shared; /* files left out for sharing their extents */
+	struct hash_cache *cache;
+	enum io_method io_method;
+	enum hash_algorithm hash_algorithm;
+	int hash_length;
+	pthread_mutex_t register_lock;
 	matcher_flags flags;
 	bool finalized;
+	bool verbose;
+	bool ungrouped; /* only list the files with get_file */
+	bool lost; /* next_group or next_file could not make a path */
+	size_t memory_limit; /* for the records when grouping, 0 if none */
+
+	/* When streaming, a thread resolves the candidates a window at a time
+	 * and queues the end of each window it is done with. Files below limit
+	 * are resolved and may be handed out by next_group. */
+	bool streaming;
+	bool resolving; /* the thread is running */
+	bool resolved; /* the thread has queued its last window */
+	bool stop; /* free_matcher wants the thread to end */
+	bool failed;
+	int limit;
+	int queue[QUEUE_SIZE];
+	int queue_head, queue_count;
+	pthread_t resolver;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
 };
 
-enum {
-	HAS_SHORT_HASH = 1,
-	HAS_FULL_HASH = 2,
-	SHORT_HASH_SIZE = 16*1024,
-	BUFSIZE = 16*1024
+static const struct stage default_stages[] = {
+	{ S_HEAD, 16*1024 },
+	{ S_TAIL, 16*1024 }
 };
 
-/* hack: qsort does not allow an extra parameter so we instead store the
- * paremeter in this thread-local variable. */
-static struct matcher *cmp_matcher;
-static int cmp_fileinfo(struct fileinfo*,struct fileinfo*);
-static int file_sha1(sha_hash,const char*,off_t);
+/* the i-th record, an optional attribute of a record and its hashinfo */
+#define INFO(m,i) ((struct fileinfo*)((m)->info_map + (size_t)(i) * (m)->info_size))
+#define ATTR(m,f,attr,type) (*(type*)((char*)(f) + (m)->attr##_offset))
+#define HASH(m,f) ((m)->hashes + (f)->hash)
+
+/* the files a hashing stage has to hash. The hashing threads take jobs from
+ * this structure until none are left. */
+struct hash_jobs {
+	struct matcher *m;
+	int *files; /* indices into info_map */
+	unsigned long long *places; /* where the files are, if locating */
+	bool keys; /* locate shared extent keys instead of first extents */
+	int count;
+	int next;
+	int *compares; /* start and length of groups to compare directly */
+	int compare_count;
+	int next_compare;
+	int stage; /* the stage to perform, stage_count for the full hash */
+	pthread_mutex_t lock;
+};
+
+/* the contents of a short read, kept until enough of them are there to be
+ * hashed together with hash_many */
+struct batch_entry {
+	struct hashinfo *h;
+	unsigned char *hash; /* where the result goes */
+	unsigned char *data;
+	size_t length, size;
+	bool used;
+};
+
+/* a file being hashed by a hashing thread */
+struct hash_slot {
+	struct hashinfo *h;
+	unsigned char *hash; /* where the result goes */
+	struct hasher hasher;
+	struct batch_entry *entry; /* NULL if the file is hashed as it is read */
+};
+
+/* what each hashing thread keeps between jobs */
+struct hash_worker {
+	struct hash_jobs *jobs;
+	char *path;
+	size_t path_size;
+	struct hash_slot slots[IO_DEPTH];
+	char *compare_paths[COMPARE_MAX];
+	size_t compare_path_sizes[COMPARE_MAX];
+	struct io_buffer buf; /* for comparing */
+	bool batching; /* collect short reads for hash_many */
+	struct batch_entry entries[IO_DEPTH + HASH_LANES];
+	struct batch_entry *ready[HASH_LANES]; /* read completely */
+	int ready_count;
+};
+
+/* where a file is stored, for ordering the reads */
+struct place {
+	dev_t dev;
+	unsigned long long physical; /* ULLONG_MAX if unknown */
+	ino_t ino;
+	int file;
+};
+
+static int add_dir(struct matcher*,int,const char*);
+static int alloc_hashes(struct matcher*);
+static int cache_hash(struct matcher*,int,int);
+static bool cached_hash(struct matcher*,int,int);
+static int cmp_fileinfo(const void*,const void*,void*);
+static int cmp_first(const void*,const void*,void*);
+static int cmp_metadata(const void*,const void*,void*);
+static int cmp_place(const void*,const void*);
+static struct batch_entry *batch_entry(struct hash_worker*,size_t);
+static void compare_job(struct hash_worker*,int);
+static bool distinct_files(struct matcher*,int,int);
+static void file_stat(struct matcher*,const struct fileinfo*,struct stat*);
+static char *make_path(struct matcher*,const struct fileinfo*,char**,size_t*);
+static bool covered(const struct matcher*,int,off_t);
+static int find_dir(struct matcher*,const char*,size_t);
+static void finish_hash(void*,int,int);
+static void flush_batch(struct hash_worker*);
+static int hash_stage_of(struct matcher*,const struct fileinfo*);
+static void *hash_worker(void*);
+static int group_files(struct matcher*);
+static uint64_t hash_metadata(const struct matcher*,const struct fileinfo*);
+static void hash_sink(void*,const unsigned char*,size_t);
+static int hash_stage(struct matcher*,int,int,int);
+static void layout_records(struct matcher*);
+static void locate_file(struct hash_worker*,int);
+static size_t lone_dir_slot(const struct lone_dir*,size_t,const char*,size_t);
+static int merge_files(struct matcher*);
+static FILE *merge_runs(struct matcher*,FILE**,size_t);
+static int next_hash(void*,int,struct io_range*);
+static bool next_window(struct matcher*);
+static void order_jobs(struct hash_jobs*);
+static void print_stats(const struct matcher*);
+static int resolve_range(struct matcher*,int,int);
+static void *resolve_windows(void*);
+static void run_hash_jobs(struct hash_jobs*);
+static void sample_range(const struct matcher*,int,off_t,off_t*,off_t*);
+static bool same_metadata(const struct matcher*,const struct fileinfo*,const struct fileinfo*);
+static void sift_down(struct matcher*,int*,int,int,const char*);
+static int skip_shared(struct matcher*,int,int);
+static void sort_files(struct matcher*,int,int);
 
 struct matcher *new_matcher(matcher_flags f) {
 	FILE *names, *infos;
@@ -85,6 +274,10 @@ struct matcher *new_matcher(matcher_flags f) {
 		return NULL;
 	}
 	m->flags = f;
+	m->thread_count = 1;
+	m->hash_algorithm = HASH_SHA1;
+	m->hash_length = hash_length(HASH_SHA1);
+	set_stages(m,default_stages,sizeof default_stages/sizeof *default_stages);
 
 	names = tmpfile();
 	if (names == NULL) {
@@ -96,57 +289,394 @@ struct matcher *new_matcher(matcher_flags f) {
 	infos = tmpfile();
 	if (infos == NULL) {
 		perror("Cannot open temporary file");
+		fclose(names);
 		free(m);
 		return NULL;
 	}
 
 	m->name_file = names;
 	m->info_file = infos;
+	pthread_mutex_init(&m->register_lock,NULL);
+	pthread_mutex_init(&m->queue_lock,NULL);
+	pthread_cond_init(&m->queue_cond,NULL);
 
 	return m;
 }
 
-int register_file(struct matcher *m, const char *path, const struct stat *stat) {
-	struct fileinfo info;
-	off_t offset;
-	size_t len;
+int set_thread_count(struct matcher *m, int count) {
+	if (m->finalized || count < 1) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	m->thread_count = count;
+	return 0;
+}
 
+int set_stages(struct matcher *m, const struct stage *stages, int count) {
+	int i;
+
+	if (m->finalized || count < 0 || count > MAX_STAGES) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) if (stages[i].length <= 0) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	memcpy(m->stages,stages,count * sizeof *stages);
+	m->stage_count = count;
+	return 0;
+}
+
+int set_cache(struct matcher *m, struct hash_cache *cache) {
+	/* the cache decides which time stamps are recorded */
+	if (m->file_count > 0 && cache != NULL && m->cache == NULL) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	m->cache = cache;
+	return 0;
+}
+
+int set_io_method(struct matcher *m, int method) {
+	if (m->finalized || (method != IO_READ && method != IO_DIRECT
+	    && method != IO_MMAP && method != IO_URING)) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	m->io_method = method;
+	return 0;
+}
+
+int set_hash_algorithm(struct matcher *m, int algorithm) {
+	if (m->finalized || (algorithm != HASH_SHA1 && algorithm != HASH_SHA256
+	    && algorithm != HASH_FAST)) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	m->hash_algorithm = algorithm;
+	m->hash_length = hash_length(algorithm);
+	return 0;
+}
+
+int set_streaming(struct matcher *m, int streaming) {
 	if (m->finalized) {
 		errno = EINVAL;
 		return 1;
 	}
 
-	/* avoid leaking stack contents into temporary file */
-	memset(&info,0,sizeof info);
+	m->streaming = streaming != 0;
+	return 0;
+}
 
-	offset = ftello(m->name_file);
-	info.path = offset;
-	info.hashed = false;
-	memcpy(&info.stat,stat,sizeof*stat);
+int set_memory_limit(struct matcher *m, size_t limit) {
+	if (m->finalized) {
+		errno = EINVAL;
+		return 1;
+	}
 
-	if (fwrite(&info,sizeof info,1,m->info_file) != 1) {
-		perror("Error writing to temporary file");
+	m->memory_limit = limit;
+	return 0;
+}
+
+int set_grouping(struct matcher *m, int grouping) {
+	if (m->finalized) {
+		errno = EINVAL;
 		return 1;
 	}
 
-	len = strlen(path) + 1;
-	if (fwrite(path,sizeof*path,len,m->name_file) != len) {
+	m->ungrouped = grouping == 0;
+	return 0;
+}
+
+void set_verbose(struct matcher *m, int verbose) {
+	m->verbose = verbose != 0;
+}
+
+int register_dir(struct matcher *m, int parent, const char *name) {
+	int index;
+
+	if (m->finalized || parent < NO_DIR) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&m->register_lock);
+	index = add_dir(m,parent,name);
+	pthread_mutex_unlock(&m->register_lock);
+
+	return index;
+}
+
+/* register_dir with the register lock held */
+static int add_dir(struct matcher *m, int parent, const char *name) {
+	struct dirinfo *dirs;
+	size_t len = strlen(name) + 1;
+	int size;
+
+	if (parent >= m->dir_count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (m->dir_count == m->dir_size) {
+		size = m->dir_size == 0 ? 1024 : 2 * m->dir_size;
+		dirs = realloc(m->dirs,size * sizeof *dirs);
+		if (dirs == NULL) {
+			perror("Cannot allocate memory");
+			return -1;
+		}
+
+		m->dirs = dirs;
+		m->dir_size = size;
+	}
+
+	m->dirs[m->dir_count].name = ftello(m->name_file);
+	m->dirs[m->dir_count].parent = parent;
+
+	if (fwrite(name,1,len,m->name_file) != len) {
 		perror("Error writing to temporary file");
+		return -1;
+	}
+
+	return m->dir_count++;
+}
+
+int register_file(struct matcher *m, const char *path, const struct stat *stat) {
+	const char *slash = strrchr(path,'/');
+	int dir = NO_DIR;
+
+	/* keep the slash if the file is in the root directory */
+	if (slash != NULL) {
+		dir = find_dir(m,path,slash - path + (slash == path));
+		if (dir == -1) return 1;
+
+		path = slash + 1;
+	}
+
+	return register_files(m,&dir,&path,stat,1);
+}
+
+/* The directory entry for the first len characters of path. Files given to
+ * register_file share the entry of their directory, which is made when the
+ * first of them comes along. */
+static int find_dir(struct matcher *m, const char *path, size_t len) {
+	struct lone_dir *dirs, *d;
+	size_t i, size;
+	int index = -1;
+
+	if (m->finalized) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&m->register_lock);
+
+	if (2 * (m->lone_dir_count + 1) > m->lone_dir_size) {
+		size = m->lone_dir_size == 0 ? 64 : 2 * m->lone_dir_size;
+		dirs = calloc(size,sizeof *dirs);
+		if (dirs == NULL) {
+			perror("Cannot allocate memory");
+			goto done;
+		}
+
+		for (i = 0; i < m->lone_dir_size; i++) {
+			d = m->lone_dirs + i;
+			if (d->path != NULL)
+				dirs[lone_dir_slot(dirs,size,d->path,strlen(d->path))] = *d;
+		}
+
+		free(m->lone_dirs);
+		m->lone_dirs = dirs;
+		m->lone_dir_size = size;
+	}
+
+	d = m->lone_dirs + lone_dir_slot(m->lone_dirs,m->lone_dir_size,path,len);
+	if (d->path != NULL) {
+		index = d->index;
+		goto done;
+	}
+
+	d->path = malloc(len + 1);
+	if (d->path == NULL) {
+		perror("Cannot allocate memory");
+		goto done;
+	}
+
+	memcpy(d->path,path,len);
+	d->path[len] = '\0';
+	d->index = index = add_dir(m,NO_DIR,d->path);
+	if (index == -1) {
+		free(d->path);
+		d->path = NULL;
+	} else m->lone_dir_count++;
+
+	done:
+	pthread_mutex_unlock(&m->register_lock);
+	return index;
+}
+
+/* the slot of the given path in the table, or the free slot it would go to */
+static size_t lone_dir_slot(const struct lone_dir *dirs, size_t size, const char *path,
+    size_t len) {
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+	size_t i;
+
+	for (i = 0; i < len; i++) h = (h ^ (unsigned char)path[i]) * UINT64_C(0x100000001b3);
+
+	for (i = h & (size - 1); dirs[i].path != NULL; i = (i + 1) & (size - 1))
+		if (strncmp(dirs[i].path,path,len) == 0 && dirs[i].path[len] == '\0') break;
+
+	return i;
+}
+
+/* decide which attributes are stored in the records and where */
+static void layout_records(struct matcher *m) {
+	stat_fields fields = get_stat_fields(m);
+	size_t size = sizeof(struct fileinfo);
+
+	/* struct timespec has the strictest alignment, so it goes first */
+	size += -size % sizeof(struct timespec);
+	if (fields & F_MTIME) {
+		m->mtime_offset = size;
+		size += sizeof(struct timespec);
+	}
+
+	if (fields & F_CTIME) {
+		m->ctime_offset = size;
+		size += sizeof(struct timespec);
+	}
+
+	if (fields & F_MODE) {
+		m->mode_offset = size;
+		size += sizeof(mode_t);
+	}
+
+	if (fields & F_UID) {
+		m->uid_offset = size;
+		size += sizeof(uid_t);
+	}
+
+	if (fields & F_GID) {
+		m->gid_offset = size;
+		size += sizeof(gid_t);
+	}
+
+	m->info_size = size + -size % sizeof(struct timespec);
+}
+
+int register_files(struct matcher *m, const int *dirs, const char *const *names,
+    const struct stat *stats, int count) {
+	union {
+		struct fileinfo info;
+		struct timespec align;
+		char bytes[RECORD_MAX];
+	} record;
+	struct fileinfo *info = &record.info;
+	size_t len;
+	int i, retval = 0;
+
+	if (m->finalized) {
+		errno = EINVAL;
 		return 1;
 	}
 
-	m->file_count++;
-	return 0;
+	/* avoid leaking stack contents into temporary file */
+	memset(&record,0,sizeof record);
+
+	pthread_mutex_lock(&m->register_lock);
+
+	if (m->info_size == 0) layout_records(m);
+	assert(m->info_size <= sizeof record);
+
+	for (i = 0; i < count; i++) {
+		info->size = stats[i].st_size;
+		info->dev = stats[i].st_dev;
+		info->ino = stats[i].st_ino;
+		info->name = ftello(m->name_file);
+		info->dir = dirs[i];
+		info->hash = NO_HASH;
+		if (m->mode_offset) ATTR(m,info,mode,mode_t) = stats[i].st_mode;
+		if (m->uid_offset) ATTR(m,info,uid,uid_t) = stats[i].st_uid;
+		if (m->gid_offset) ATTR(m,info,gid,gid_t) = stats[i].st_gid;
+		if (m->mtime_offset) ATTR(m,info,mtime,struct timespec) = stats[i].st_mtim;
+		if (m->ctime_offset) ATTR(m,info,ctime,struct timespec) = stats[i].st_ctim;
+
+		/* the cache keeps the entries of files that are still there */
+		if (m->cache != NULL) cache_seen(m->cache,stats + i);
+
+		if (fwrite(info,m->info_size,1,m->info_file) != 1) {
+			perror("Error writing to temporary file");
+			retval = 1;
+			break;
+		}
+
+		len = strlen(names[i]) + 1;
+		if (fwrite(names[i],sizeof*names[i],len,m->name_file) != len) {
+			perror("Error writing to temporary file");
+			retval = 1;
+			break;
+		}
+
+		m->file_count++;
+	}
+
+	pthread_mutex_unlock(&m->register_lock);
+
+	return retval;
 }
 
 int get_file_count(struct matcher *m) {
-	return m->file_count;
+	int count;
+
+	pthread_mutex_lock(&m->register_lock);
+	count = m->file_count;
+	pthread_mutex_unlock(&m->register_lock);
+
+	return count;
+}
+
+const char *get_file(struct matcher *m, int i, struct stat *st) {
+	if (!m->finalized || i < 0 || i >= m->file_count) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	file_stat(m,INFO(m,i),st);
+	return make_path(m,INFO(m,i),&m->file_path,&m->file_path_size);
+}
+
+int get_stages(struct matcher *m, struct stage *stages) {
+	memcpy(stages,m->stages,m->stage_count * sizeof *stages);
+	return m->stage_count;
+}
+
+stat_fields get_stat_fields(struct matcher *m) {
+	stat_fields fields = 0;
+
+	if (m->flags & M_MODE) fields |= F_MODE;
+	if (m->flags & M_UID) fields |= F_UID;
+	if (m->flags & M_GID) fields |= F_GID;
+	if (m->flags & M_MTIME) fields |= F_MTIME;
+	if (m->flags & M_CTIME) fields |= F_CTIME;
+
+	/* the hash cache recognizes files by their time stamps */
+	if (m->cache != NULL) fields |= F_MTIME|F_CTIME;
+
+	return fields;
 }
 
 int finalize_matcher(struct matcher *m) {
-	int name_fd, info_fd, old_errno;
+	int name_fd, info_fd, err;
 	size_t name_size, info_size;
 	void *info_mapping, *name_mapping;
+	bool merged;
 
 	if (m->finalized) {
 		errno = EINVAL;
@@ -168,6 +698,11 @@ int finalize_matcher(struct matcher *m) {
 		return 1;
 	}
 
+	/* too many records to move them about in memory */
+	merged = !m->ungrouped && m->memory_limit > 0
+	    && (size_t)m->file_count * m->info_size > m->memory_limit;
+	if (merged && merge_files(m)) return 1;
+
 	info_fd = fileno(m->info_file);
 	name_fd = fileno(m->name_file);
 	info_size = ftello(m->info_file);
@@ -188,144 +723,1324 @@ int finalize_matcher(struct matcher *m) {
 	m->name_map = name_mapping;
 	m->info_map = info_mapping;
 
+	if (m->ungrouped) {
+		m->finalized = true;
+		return 0;
+	}
 
-	old_errno = errno;
-	errno = 0;
+	/* First group the files by their metadata, then resolve the groups by
+	 * their contents, all at once or in the background */
+	if (!merged && group_files(m)) return 1;
+	if (alloc_hashes(m)) return 1;
+
+	if (m->streaming) {
+		err = pthread_create(&m->resolver,NULL,resolve_windows,m);
+		if (err == 0) {
+			m->resolving = true;
+			m->finalized = true;
+			return 0;
+		}
+
+		fprintf(stderr,"Cannot create thread, not streaming: %s\n",strerror(err));
+		m->streaming = false;
+	}
+
+	if (resolve_range(m,0,m->candidate_count)) return 1;
+	if (m->verbose) print_stats(m);
 
-	cmp_matcher = m;
-	qsort(
-		m->info_map,
-		m->file_count,
-		sizeof(struct fileinfo),
-		(int(*)(const void*,const void*))cmp_fileinfo
-	);
+	m->limit = m->candidate_count;
+	m->finalized = true;
 
-	if (errno != 0) {
-		perror("Cannot sort file information");
+	return 0;
+}
+
+/* the resolver is done once the last group has been handed out; otherwise
+ * it is told to stop */
+int wait_matcher(struct matcher *m) {
+	if (!m->resolving) return m->failed || m->lost;
+
+	pthread_mutex_lock(&m->queue_lock);
+	m->stop = true;
+	pthread_cond_broadcast(&m->queue_cond);
+	pthread_mutex_unlock(&m->queue_lock);
+
+	pthread_join(m->resolver,NULL);
+	m->resolving = false;
+
+	return m->failed || m->lost;
+}
+
+/* Run each hashing stage over the candidates from first to last, splitting
+ * their groups by the hashes. The last stage hashes the full contents. The
+ * range must not split a group of files with the same metadata. */
+static int resolve_range(struct matcher *m, int first, int last) {
+	int i;
+
+	if (m->flags & M_SHARED && skip_shared(m,first,last)) return 1;
+
+	for (i = 0; i <= m->stage_count; i++)
+		if (hash_stage(m,i,first,last)) return 1;
+
+	return 0;
+}
+
+/* the thread resolving the candidates when streaming. A window ends with
+ * the group of files with the same metadata its last file is in. */
+static void *resolve_windows(void *arg) {
+	struct matcher *m = arg;
+	int first, last;
+
+	for (first = 0; first < m->candidate_count; first = last) {
+		last = first + WINDOW_FILES;
+		if (last > m->candidate_count) last = m->candidate_count;
+		while (last < m->candidate_count && same_metadata(m,INFO(m,last-1),INFO(m,last)))
+			last++;
+
+		if (resolve_range(m,first,last)) {
+			m->failed = true;
+			break;
+		}
+
+		pthread_mutex_lock(&m->queue_lock);
+		while (m->queue_count == QUEUE_SIZE && !m->stop)
+			pthread_cond_wait(&m->queue_cond,&m->queue_lock);
+
+		if (m->stop) {
+			pthread_mutex_unlock(&m->queue_lock);
+			break;
+		}
+
+		m->queue[(m->queue_head + m->queue_count++) % QUEUE_SIZE] = last;
+		pthread_cond_broadcast(&m->queue_cond);
+		pthread_mutex_unlock(&m->queue_lock);
+	}
+
+	if (m->verbose && first == m->candidate_count) print_stats(m);
+
+	pthread_mutex_lock(&m->queue_lock);
+	m->resolved = true;
+	pthread_cond_broadcast(&m->queue_cond);
+	pthread_mutex_unlock(&m->queue_lock);
+
+	return NULL;
+}
+
+/* Wait for the resolver to queue the next window and make its files
+ * available. Returns false if there are no windows left. */
+static bool next_window(struct matcher *m) {
+	bool found;
+
+	if (!m->resolving) return false;
+
+	pthread_mutex_lock(&m->queue_lock);
+	while (m->queue_count == 0 && !m->resolved)
+		pthread_cond_wait(&m->queue_cond,&m->queue_lock);
+
+	found = m->queue_count > 0;
+	if (found) {
+		m->limit = m->queue[m->queue_head];
+		m->queue_head = (m->queue_head + 1) % QUEUE_SIZE;
+		m->queue_count--;
+		pthread_cond_broadcast(&m->queue_cond);
+	}
+
+	pthread_mutex_unlock(&m->queue_lock);
+
+	return found;
+}
+
+static void sort_files(struct matcher *m, int start, int count) {
+	sort_records(INFO(m,start),count,m->info_size,cmp_fileinfo,m);
+}
+
+/* Move the files that cannot be told apart by their metadata next to each
+ * other and in front of all other files, so the hashing stages and
+ * next_group only need to look at the first candidate_count files. Instead
+ * of sorting all files, they are put into buckets by their metadata using
+ * a hash table and then moved to the place of their bucket in one pass. Only
+ * the buckets with more than one file are sorted. Returns 0 on success. */
+static int group_files(struct matcher *m) {
+	int n = m->file_count, *slots, *buckets, *starts, *counts, *order;
+	int i, j, b, bucket_count = 0, order_count = 0, pos, single;
+	size_t size, mask, slot;
+	char *tmp;
+
+	for (size = 16; size < 2 * (size_t)n; size *= 2)
+		;
+	mask = size - 1;
+
+	slots = malloc(size * sizeof *slots);
+	buckets = malloc(n * sizeof *buckets);
+	starts = malloc(n * sizeof *starts);
+	counts = malloc(n * sizeof *counts);
+	tmp = malloc(m->info_size);
+	if (slots == NULL || buckets == NULL || starts == NULL || counts == NULL || tmp == NULL) {
+		perror("Cannot allocate memory");
+		free(slots);
+		free(buckets);
+		free(starts);
+		free(counts);
+		free(tmp);
 		return 1;
 	}
 
-	errno = old_errno;
+	/* starts holds the first file of each bucket until the buckets are
+	 * laid out */
+	memset(slots,-1,size * sizeof *slots);
+	for (i = 0; i < n; i++) {
+		slot = hash_metadata(m,INFO(m,i)) & mask;
+		while ((b = slots[slot]) != -1 && !same_metadata(m,INFO(m,starts[b]),INFO(m,i)))
+			slot = (slot + 1) & mask;
+
+		if (b == -1) {
+			b = slots[slot] = bucket_count++;
+			starts[b] = i;
+			counts[b] = 0;
+		}
+
+		buckets[i] = b;
+		counts[b]++;
+	}
 
-	m->finalized = true;
+	free(slots);
+
+	/* lay out the buckets with more than one file in the order the files
+	 * compare in and put all other files after them */
+	order = malloc(bucket_count * sizeof *order);
+	if (order == NULL) {
+		perror("Cannot allocate memory");
+		free(buckets);
+		free(starts);
+		free(counts);
+		free(tmp);
+		return 1;
+	}
+
+	for (b = 0; b < bucket_count; b++)
+		if (counts[b] > 1) order[order_count++] = starts[b];
+
+	sort_records(order,order_count,sizeof *order,cmp_first,m);
+
+	for (pos = 0, i = 0; i < order_count; i++) {
+		b = buckets[order[i]];
+		order[i] = b;
+		starts[b] = pos;
+		pos += counts[b];
+	}
+
+	m->candidate_count = single = pos;
+
+	/* buckets now holds the new place of each file */
+	for (i = 0; i < n; i++) {
+		b = buckets[i];
+		buckets[i] = counts[b] > 1 ? starts[b]++ : single++;
+	}
+
+	/* follow the cycles of this permutation, swapping each file into place */
+	for (i = 0; i < n; i++) while ((j = buckets[i]) != i) {
+		memcpy(tmp,INFO(m,j),m->info_size);
+		memcpy(INFO(m,j),INFO(m,i),m->info_size);
+		memcpy(INFO(m,i),tmp,m->info_size);
+		buckets[i] = buckets[j];
+		buckets[j] = j;
+	}
+
+	/* starts[b] now points past the end of bucket b */
+	for (i = 0; i < order_count; i++) {
+		b = order[i];
+		sort_files(m,starts[b] - counts[b],counts[b]);
+	}
+
+	if (m->verbose)
+		fprintf(stderr,"Metadata: %d files, %d candidates\n",n,m->candidate_count);
+
+	free(order);
+	free(buckets);
+	free(starts);
+	free(counts);
+	free(tmp);
+
+	return 0;
+}
+
+/* Files are grouped by sorting them in runs that fit into the memory limit,
+ * writing each run to a file of its own and merging the runs. The groups
+ * of files with the same metadata go to a new info file in the order
+ * group_files puts them in, followed by all other files. This only reads
+ * and writes the temporary files from start to end, while group_files moves
+ * records all over the info file. So as not to run out of descriptors,
+ * each MERGE_WAYS runs of the same level are merged into one of the next
+ * level as soon as they are there. Returns 0 on success. */
+static int merge_files(struct matcher *m) {
+	size_t per_run = m->memory_limit / m->info_size, size = m->info_size;
+	size_t i, n, run_count = 0, total_runs = 0, group_count = 0, group_size = 0;
+	FILE **runs = NULL, **new_runs, *out = NULL, *singles = NULL, *merged;
+	char *buf, *heads = NULL, *group = NULL, *new_group;
+	int *heap = NULL, *levels = NULL, *new_levels, level, heap_count, candidates = 0;
+	int retval = 1;
+
+	if (per_run < 2) per_run = 2;
+
+	buf = malloc(per_run * size);
+	if (buf == NULL) goto nomem;
+
+	rewind(m->info_file);
+
+	do {
+		n = fread(buf,size,per_run,m->info_file);
+		if (n == 0) break;
+
+		sort_records(buf,n,size,cmp_metadata,m);
+
+		new_runs = realloc(runs,(run_count + 1) * sizeof *runs);
+		if (new_runs == NULL) goto nomem;
+		runs = new_runs;
+
+		new_levels = realloc(levels,(run_count + 1) * sizeof *levels);
+		if (new_levels == NULL) goto nomem;
+		levels = new_levels;
+
+		runs[run_count] = tmpfile();
+		if (runs[run_count] == NULL) goto tmpfail;
+
+		levels[run_count++] = 0;
+		total_runs++;
+		if (fwrite(buf,size,n,runs[run_count-1]) != n) goto ioerr;
+
+		/* the levels never grow towards the end */
+		while (run_count >= MERGE_WAYS
+		    && levels[run_count - MERGE_WAYS] == levels[run_count - 1]) {
+			merged = merge_runs(m,runs + run_count - MERGE_WAYS,MERGE_WAYS);
+			if (merged == NULL) goto done;
+
+			level = levels[run_count - 1] + 1;
+			for (i = run_count - MERGE_WAYS; i < run_count; i++) fclose(runs[i]);
+			run_count -= MERGE_WAYS;
+			runs[run_count] = merged;
+			levels[run_count++] = level;
+		}
+	} while (n == per_run);
+
+	if (ferror(m->info_file)) goto ioerr;
+
+	free(buf);
+	buf = NULL;
+
+	out = tmpfile();
+	singles = tmpfile();
+	if (out == NULL || singles == NULL) goto tmpfail;
+
+	/* the heap holds the runs by their first record not yet merged */
+	heads = malloc(run_count * size);
+	heap = malloc(run_count * sizeof *heap);
+	if (heads == NULL || heap == NULL) goto nomem;
+
+	for (i = heap_count = 0; i < run_count; i++) {
+		rewind(runs[i]);
+		if (fread(heads + i * size,size,1,runs[i]) == 1) heap[heap_count++] = i;
+	}
+
+	for (i = heap_count / 2; i-- > 0;) sift_down(m,heap,heap_count,i,heads);
+
+	while (heap_count > 0 || group_count > 0) {
+		/* a group ends before the next record with other metadata */
+		if (group_count > 0 && (heap_count == 0
+		    || !same_metadata(m,(struct fileinfo*)group,(struct fileinfo*)(heads + heap[0] * size)))) {
+			if (group_count > 1) {
+				sort_records(group,group_count,size,cmp_fileinfo,m);
+				candidates += group_count;
+			}
+
+			if (fwrite(group,size,group_count,group_count > 1 ? out : singles) != group_count)
+				goto ioerr;
+
+			group_count = 0;
+			continue;
+		}
+
+		if (group_count == group_size) {
+			group_size = 2 * group_size + 16;
+			new_group = realloc(group,group_size * size);
+			if (new_group == NULL) goto nomem;
+			group = new_group;
+		}
+
+		memcpy(group + group_count++ * size,heads + heap[0] * size,size);
+
+		if (fread(heads + heap[0] * size,size,1,runs[heap[0]]) != 1) {
+			if (ferror(runs[heap[0]])) goto ioerr;
+			heap[0] = heap[--heap_count];
+		}
+
+		sift_down(m,heap,heap_count,0,heads);
+	}
+
+	/* the files alone in their group come last */
+	rewind(singles);
+	buf = malloc(per_run * size);
+	if (buf == NULL) goto nomem;
+
+	while ((n = fread(buf,size,per_run,singles)) > 0)
+		if (fwrite(buf,size,n,out) != n) goto ioerr;
+
+	if (ferror(singles) || fflush(out)) goto ioerr;
+
+	fclose(m->info_file);
+	m->info_file = out;
+	out = NULL;
+	m->candidate_count = candidates;
+
+	if (m->verbose) fprintf(stderr,"Metadata: %d files, %d candidates, merged from %zu runs\n",
+	    m->file_count,m->candidate_count,total_runs);
+
+	retval = 0;
+	goto done;
+
+	nomem:
+	perror("Cannot allocate memory");
+	goto done;
+
+	tmpfail:
+	perror("Cannot open temporary file");
+	goto done;
+
+	ioerr:
+	perror("Error writing to temporary file");
+
+	done:
+	for (i = 0; i < run_count; i++) fclose(runs[i]);
+	if (out != NULL) fclose(out);
+	if (singles != NULL) fclose(singles);
+	free(runs);
+	free(levels);
+	free(buf);
+	free(heads);
+	free(heap);
+	free(group);
+
+	return retval;
+}
+
+/* Merge count sorted runs into a new one. Returns NULL on error. */
+static FILE *merge_runs(struct matcher *m, FILE **runs, size_t count) {
+	size_t i, size = m->info_size;
+	char *heads = malloc(count * size);
+	int *heap = malloc(count * sizeof *heap), heap_count;
+	FILE *out;
+
+	if (heads == NULL || heap == NULL) {
+		perror("Cannot allocate memory");
+		free(heads);
+		free(heap);
+		return NULL;
+	}
+
+	out = tmpfile();
+	if (out == NULL) {
+		perror("Cannot open temporary file");
+		free(heads);
+		free(heap);
+		return NULL;
+	}
+
+	for (i = heap_count = 0; i < count; i++) {
+		rewind(runs[i]);
+		if (fread(heads + i * size,size,1,runs[i]) == 1) heap[heap_count++] = i;
+	}
+
+	for (i = heap_count / 2; i-- > 0;) sift_down(m,heap,heap_count,i,heads);
+
+	while (heap_count > 0) {
+		if (fwrite(heads + heap[0] * size,size,1,out) != 1) break;
+
+		if (fread(heads + heap[0] * size,size,1,runs[heap[0]]) != 1) {
+			if (ferror(runs[heap[0]])) break;
+			heap[0] = heap[--heap_count];
+		}
+
+		sift_down(m,heap,heap_count,0,heads);
+	}
+
+	free(heads);
+	free(heap);
+
+	if (heap_count > 0 || fflush(out) == EOF) {
+		perror("Error writing to temporary file");
+		fclose(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+/* restore the heap below its i-th element */
+static void sift_down(struct matcher *m, int *heap, int count, int i, const char *heads) {
+	int child, tmp;
+	size_t size = m->info_size;
+
+	while ((child = 2 * i + 1) < count) {
+		if (child + 1 < count && cmp_metadata(heads + heap[child+1] * size,heads + heap[child] * size,m) < 0)
+			child++;
+
+		if (cmp_metadata(heads + heap[i] * size,heads + heap[child] * size,m) <= 0) break;
+
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Order records by what same_metadata compares, in the order cmp_fileinfo
+ * compares it in, then by device, inode number and name. Unlike
+ * cmp_fileinfo, this is a total order, as merging runs needs. */
+static int cmp_metadata(const void *a_void, const void *b_void, void *m_void) {
+	const struct fileinfo *a = a_void, *b = b_void;
+	const struct matcher *m = m_void;
+	matcher_flags f = m->flags;
+
+#define CMP_BY(x,y) if ((x) != (y)) return (x) < (y) ? -1 : 1
+#define CMP_ATTR(attr,type) CMP_BY(ATTR(m,a,attr,type),ATTR(m,b,attr,type))
+	CMP_BY(a->size,b->size);
+	if (f & M_DEV) CMP_BY(a->dev,b->dev);
+	if (f & M_MODE) CMP_ATTR(mode,mode_t);
+	if (f & M_UID) CMP_ATTR(uid,uid_t);
+	if (f & M_GID) CMP_ATTR(gid,gid_t);
+	if (f & M_MTIME) CMP_BY(ATTR(m,a,mtime,struct timespec).tv_sec,ATTR(m,b,mtime,struct timespec).tv_sec);
+	if (f & M_CTIME) CMP_BY(ATTR(m,a,ctime,struct timespec).tv_sec,ATTR(m,b,ctime,struct timespec).tv_sec);
+	CMP_BY(a->dev,b->dev);
+	CMP_BY(a->ino,b->ino);
+	CMP_BY(a->name,b->name);
+#undef CMP_ATTR
+#undef CMP_BY
 
 	return 0;
 }
 
+/* a hash over what same_metadata compares */
+static uint64_t hash_metadata(const struct matcher *m, const struct fileinfo *f) {
+	matcher_flags flags = m->flags;
+	uint64_t h = 0;
+
+#define MIX(x) (h = (h ^ (uint64_t)(x)) * UINT64_C(0x9e3779b97f4a7c15), h ^= h >> 29)
+	MIX(f->size);
+	if (flags & M_DEV) MIX(f->dev);
+	if (flags & M_MODE) MIX(ATTR(m,f,mode,mode_t));
+	if (flags & M_UID) MIX(ATTR(m,f,uid,uid_t));
+	if (flags & M_GID) MIX(ATTR(m,f,gid,gid_t));
+	if (flags & M_MTIME) MIX(ATTR(m,f,mtime,struct timespec).tv_sec);
+	if (flags & M_CTIME) MIX(ATTR(m,f,ctime,struct timespec).tv_sec);
+#undef MIX
+
+	return h;
+}
+
+/* do a and b agree in all metadata cmp_fileinfo looks at? */
+static bool same_metadata(const struct matcher *m, const struct fileinfo *a,
+    const struct fileinfo *b) {
+	matcher_flags f = m->flags;
+
+	return a->size == b->size
+	    && (!(f & M_DEV) || a->dev == b->dev)
+	    && (!(f & M_MODE) || ATTR(m,a,mode,mode_t) == ATTR(m,b,mode,mode_t))
+	    && (!(f & M_UID) || ATTR(m,a,uid,uid_t) == ATTR(m,b,uid,uid_t))
+	    && (!(f & M_GID) || ATTR(m,a,gid,gid_t) == ATTR(m,b,gid,gid_t))
+	    && (!(f & M_MTIME) || ATTR(m,a,mtime,struct timespec).tv_sec == ATTR(m,b,mtime,struct timespec).tv_sec)
+	    && (!(f & M_CTIME) || ATTR(m,a,ctime,struct timespec).tv_sec == ATTR(m,b,ctime,struct timespec).tv_sec);
+}
+
+/* order indices of files like the files themselves */
+static int cmp_first(const void *a, const void *b, void *m_void) {
+	struct matcher *m = m_void;
+
+	return cmp_fileinfo(INFO(m,*(const int*)a),INFO(m,*(const int*)b),m);
+}
+
+/* Hand out a hashinfo to each file in a group of files that cannot be told
+ * apart by their metadata. Files that are alone in their group never need
+ * one. Returns 0 on success. */
+static int alloc_hashes(struct matcher *m) {
+	int i, j, k, count = 0;
+
+	for (i = 0; i < m->candidate_count; i = j) {
+		for (j = i + 1; j < m->candidate_count; j++)
+			if (cmp_fileinfo(INFO(m,i),INFO(m,j),m) != 0) break;
+
+		if (j - i < 2 || !distinct_files(m,i,j-i)) continue;
+
+		for (k = i; k < j; k++) INFO(m,k)->hash = count++;
+	}
+
+	if (count == 0) return 0;
+
+	m->hashes = calloc(count,sizeof *m->hashes);
+	if (m->hashes == NULL) {
+		perror("Cannot allocate memory");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* the struct stat a file was registered with, as far as it was recorded */
+static void file_stat(struct matcher *m, const struct fileinfo *f, struct stat *st) {
+	memset(st,0,sizeof *st);
+	st->st_size = f->size;
+	st->st_dev = f->dev;
+	st->st_ino = f->ino;
+	if (m->mode_offset) st->st_mode = ATTR(m,f,mode,mode_t);
+	if (m->uid_offset) st->st_uid = ATTR(m,f,uid,uid_t);
+	if (m->gid_offset) st->st_gid = ATTR(m,f,gid,gid_t);
+	if (m->mtime_offset) st->st_mtim = ATTR(m,f,mtime,struct timespec);
+	if (m->ctime_offset) st->st_ctim = ATTR(m,f,ctime,struct timespec);
+}
+
+/* Write the path of f to *buf, growing it as needed. Returns *buf or NULL if
+ * out of memory. */
+static char *make_path(struct matcher *m, const struct fileinfo *f, char **buf, size_t *size) {
+	const char *names = m->name_map, *name;
+	size_t len, name_len;
+	char *new_buf;
+	int dir;
+
+	/* first find out how long the path is */
+	len = strlen(names + f->name) + 1;
+	for (dir = f->dir; dir != NO_DIR; dir = m->dirs[dir].parent) {
+		name_len = strlen(names + m->dirs[dir].name);
+		len += name_len + (name_len == 0 || names[m->dirs[dir].name + name_len - 1] != '/');
+	}
+
+	if (len > *size) {
+		new_buf = realloc(*buf,len);
+		if (new_buf == NULL) {
+			perror("Cannot allocate memory");
+			return NULL;
+		}
+
+		*buf = new_buf;
+		*size = len;
+	}
+
+	/* then assemble it back to front */
+	name = names + f->name;
+	name_len = strlen(name);
+	len--;
+	memcpy(*buf + len - name_len,name,name_len + 1);
+	len -= name_len;
+
+	for (dir = f->dir; dir != NO_DIR; dir = m->dirs[dir].parent) {
+		name = names + m->dirs[dir].name;
+		name_len = strlen(name);
+		if (name_len == 0 || name[name_len-1] != '/') (*buf)[--len] = '/';
+		len -= name_len;
+		memcpy(*buf + len,name,name_len);
+	}
+
+	return *buf;
+}
+
+static int hash_stage_of(struct matcher *m, const struct fileinfo *f) {
+	return f->hash == NO_HASH ? 0 : HASH(m,f)->stage;
+}
+
 /* cmp_fileinfo orders files according to the following criteria, listed in
  * decreasing order of importance:
  *  - size
  *  - device id (only if M_DEV)
- *  - inode number (result depending on M_LINK)
+ *  - inode number (result depending on M_LINK, hardlinks are then ordered by
+ *    their position in the filename file)
  *  - permissions (except if M_MODE)
  *  - modification time (only if M_MTIME)
  *  - creation time (only if M_CTIME)
- *  - hash
- * cmp_fileinfo may fail. In this case it sets errno to a nonzero value.
+ *  - number of completed hashing stages
+ *  - short hash and hash, if already computed
+ * Files that could not be hashed and files left out for sharing their
+ * extents compare distinct to all other files. No I/O
+ * is performed by cmp_fileinfo, see hash_stage.
  */
 
-#define CMP_BY(x) if (a->stat.x != b->stat.x) return a->stat.x - b->stat.x
+#define CMP_BY(x,y) if ((x) != (y)) return (x) < (y) ? -1 : 1
+#define CMP_ATTR(attr,type) CMP_BY(ATTR(m,a,attr,type),ATTR(m,b,attr,type))
+/* each record has a name of its own, so this tells apart distinct records */
+#define CMP_NAME(a,b) ((a)->name < (b)->name ? -1 : (a)->name > (b)->name)
 
-static int cmp_fileinfo(struct fileinfo *a,struct fileinfo *b) {
-	matcher_flags f = cmp_matcher->flags;
-	const char *names = cmp_matcher->name_map;
-	int cmp;
+static int cmp_fileinfo(const void *a_void, const void *b_void, void *m_void) {
+	const struct fileinfo *a = a_void, *b = b_void;
+	struct matcher *m = m_void;
+	matcher_flags f = m->flags;
+	struct hashinfo *ha, *hb;
+	int cmp, stage;
 
 	if (a == b) return 0;
 
-	CMP_BY(st_size);
+	CMP_BY(a->size,b->size);
+
+	if (f & M_DEV) CMP_BY(a->dev,b->dev);
 
-	if (f & M_DEV) CMP_BY(st_dev);
+	if (a->dev == b->dev && a->ino == b->ino)
+		return (f & M_LINK) ? CMP_NAME(a,b) : 0;
 
-	if (a->stat.st_dev == b->stat.st_dev && a->stat.st_ino == b->stat.st_ino)
-		return (f & M_LINK) ? strcmp(names+a->path, names+b->path) : 0;
+	if (f & M_MODE) CMP_ATTR(mode,mode_t);
+	if (f & M_UID) CMP_ATTR(uid,uid_t);
+	if (f & M_GID) CMP_ATTR(gid,gid_t);
+	if (f & M_MTIME) CMP_BY(ATTR(m,a,mtime,struct timespec).tv_sec,ATTR(m,b,mtime,struct timespec).tv_sec);
+	if (f & M_CTIME) CMP_BY(ATTR(m,a,ctime,struct timespec).tv_sec,ATTR(m,b,ctime,struct timespec).tv_sec);
 
-	if (f & M_MODE) CMP_BY(st_mode);
-	if (f & M_UID) CMP_BY(st_uid);
-	if (f & M_GID) CMP_BY(st_gid);
-	if (f & M_MTIME) CMP_BY(st_mtime);
-	if (f & M_CTIME) CMP_BY(st_ctime);
+	stage = hash_stage_of(m,a);
+	if (stage < 0 && hash_stage_of(m,b) < 0)
+		return CMP_NAME(a,b);
 
-	if (~a->hashed & HAS_SHORT_HASH) {
-		file_sha1(a->short_hash,names+a->path,SHORT_HASH_SIZE);
-		a->hashed |= HAS_SHORT_HASH;
+	CMP_BY(stage,hash_stage_of(m,b));
+
+	if (stage == 0) return 0;
+
+	ha = HASH(m,a);
+	hb = HASH(m,b);
+
+	cmp = memcmp(ha->short_hash,hb->short_hash,m->hash_length);
+	if (cmp != 0) return cmp;
+
+	if (stage > m->stage_count)
+		return memcmp(ha->hash,hb->hash,m->hash_length);
+
+	return 0;
+}
+
+#undef CMP_NAME
+#undef CMP_ATTR
+#undef CMP_BY
+
+/* are there at least two files in this group that are not hardlinks to each
+ * other? */
+static bool distinct_files(struct matcher *m, int start, int count) {
+	struct fileinfo *first = INFO(m,start), *f;
+	int i;
+
+	for (i = 1; i < count; i++) {
+		f = INFO(m,start+i);
+		if (f->dev != first->dev || f->ino != first->ino) return true;
 	}
 
-	if (~b->hashed & HAS_SHORT_HASH) {
-		file_sha1(b->short_hash,names+b->path,SHORT_HASH_SIZE);
-		b->hashed |= HAS_SHORT_HASH;
+	return false;
+}
+
+/* does one of the sampling stages before stage already cover the whole of a
+ * file of the given size? For the full hash, only the first stage counts as
+ * it is the only one whose short hash is not chained to a previous one, and
+ * thus a hash of just the whole file. */
+static bool covered(const struct matcher *m, int stage, off_t size) {
+	int i;
+
+	if (stage < m->stage_count) {
+		for (i = 0; i < stage; i++)
+			if (m->stages[i].length >= size) return true;
+
+		return false;
 	}
 
-	cmp = memcmp(a->short_hash,b->short_hash,SHA_DIGEST_LENGTH);
+	return m->stage_count > 0 && m->stages[0].length >= size;
+}
 
-	if (cmp != 0) return cmp;
+/* Find each group of files from first to last that compare equal and let
+ * its members go through the given hashing stage, then sort the group
+ * again. Groups made of only one file are skipped, as are groups made of
+ * hardlinks to just one file. Stage stage_count computes the full hash. If
+ * the full hashes of all members of a group are found in the hash cache,
+ * the group skips the remaining stages. Otherwise, files whose hash after
+ * this stage is in the cache are not read, and the hashes computed are put
+ * into it. Instead of hashing them in full, the members of small groups are
+ * compared with each other, which stops at the first difference. That
+ * leaves them without a hash, so it is not done with a hash cache, which
+ * could only save the comparison if the files were hashed. Returns 0 on
+ * success. */
+static int hash_stage(struct matcher *m, int stage, int first, int last) {
+	struct hash_jobs jobs;
+	struct hashinfo *h;
+	int *groups, group_count = 0, candidates = 0, eliminated = 0, hits = 0;
+	int i, j, k, retval = 1;
+	bool all_cached;
+
+	if (first == last) return 0;
+
+	jobs.m = m;
+	jobs.places = NULL;
+	jobs.keys = false;
+	jobs.count = 0;
+	jobs.next = 0;
+	jobs.compare_count = 0;
+	jobs.next_compare = 0;
+	jobs.stage = stage;
+	jobs.files = malloc((last - first) * sizeof *jobs.files);
+	jobs.compares = malloc((last - first) * sizeof *jobs.compares);
+
+	/* start and length of each group; there are at most (last - first)/2 */
+	groups = malloc((last - first) * sizeof *groups);
+	if (jobs.files == NULL || jobs.compares == NULL || groups == NULL) {
+		perror("Cannot allocate memory");
+		free(jobs.files);
+		free(jobs.compares);
+		free(groups);
+		return 1;
+	}
 
-	if (~a->hashed & HAS_FULL_HASH) {
-		file_sha1(a->hash,names+a->path,a->stat.st_size);
-		a->hashed |= HAS_FULL_HASH;
+	for (i = first; i < last; i = j) {
+		for (j = i + 1; j < last; j++)
+			if (cmp_fileinfo(INFO(m,i),INFO(m,j),m) != 0) break;
+
+		if (j - i < 2 || !distinct_files(m,i,j-i)) continue;
+
+		groups[group_count++] = i;
+		groups[group_count++] = j - i;
+		candidates += j - i;
+
+		all_cached = true;
+		for (k = i; k < j; k++) {
+			h = HASH(m,INFO(m,k));
+			if (stage == 0 && m->cache != NULL) {
+				h->cached = cached_hash(m,k,m->stage_count);
+				hits += h->cached;
+			}
+
+			all_cached &= h->cached;
+		}
+
+		if (stage == m->stage_count && j - i <= COMPARE_MAX && m->cache == NULL
+		    && HASH(m,INFO(m,i))->stage == stage && !covered(m,stage,INFO(m,i)->size)) {
+			jobs.compares[jobs.compare_count++] = i;
+			jobs.compares[jobs.compare_count++] = j - i;
+			continue;
+		}
+
+		for (k = i; k < j; k++) {
+			h = HASH(m,INFO(m,k));
+			if (h->stage != stage) continue;
+
+			if (all_cached) h->stage = m->stage_count + 1;
+			else if (stage < m->stage_count) {
+				/* an earlier sample spanned the whole file */
+				if (covered(m,stage,INFO(m,k)->size)) h->stage++;
+				else if (cached_hash(m,k,stage)) {
+					/* a full hash hit was counted already */
+					if (stage == 0 && !h->cached) hits++;
+					h->stage++;
+				} else jobs.files[jobs.count++] = k;
+			} else if (h->cached) h->stage++;
+			else if (covered(m,stage,INFO(m,k)->size)) {
+				memcpy(h->hash,h->short_hash,m->hash_length);
+				h->stage++;
+				if (m->cache != NULL && cache_hash(m,k,stage)) goto done;
+			} else jobs.files[jobs.count++] = k;
+		}
 	}
 
-	if (~b->hashed & HAS_FULL_HASH) {
-		file_sha1(b->hash,names+b->path,b->stat.st_size);
-		b->hashed |= HAS_FULL_HASH;
+	order_jobs(&jobs);
+	run_hash_jobs(&jobs);
+
+	/* remember the new hashes for the next run */
+	if (m->cache != NULL) for (i = 0; i < jobs.count; i++)
+		if (HASH(m,INFO(m,jobs.files[i]))->stage == stage + 1
+		    && cache_hash(m,jobs.files[i],stage))
+			goto done;
+
+	for (i = 0; i < group_count; i += 2) {
+		sort_files(m,groups[i],groups[i+1]);
+
+		/* count the files that now are alone in their group */
+		for (j = groups[i]; j < groups[i] + groups[i+1]; j++)
+			if ((j == groups[i] || cmp_fileinfo(INFO(m,j-1),INFO(m,j),m) != 0)
+			    && (j + 1 == groups[i] + groups[i+1] || cmp_fileinfo(INFO(m,j),INFO(m,j+1),m) != 0))
+				eliminated++;
 	}
 
-	return memcmp(a->hash,b->hash,SHA_DIGEST_LENGTH);
+	m->stats[stage].candidates += candidates;
+	m->stats[stage].eliminated += eliminated;
+	m->stats[stage].compared += jobs.compare_count/2;
+	m->cache_hits += hits;
+	retval = 0;
+
+	done:
+	free(groups);
+	free(jobs.files);
+	free(jobs.compares);
+
+	return retval;
 }
 
-#undef CMP_BY
+/* look up the hash the given stage leaves a file with in the hash cache */
+static bool cached_hash(struct matcher *m, int file, int stage) {
+	struct hashinfo *h = HASH(m,INFO(m,file));
+	struct stat st;
+
+	if (m->cache == NULL) return false;
+
+	file_stat(m,INFO(m,file),&st);
+	return cache_lookup(m->cache,&st,stage,stage < m->stage_count ? h->short_hash : h->hash);
+}
+
+/* put the hash the given stage left a file with into the hash cache;
+ * returns 0 on success */
+static int cache_hash(struct matcher *m, int file, int stage) {
+	struct hashinfo *h = HASH(m,INFO(m,file));
+	struct stat st;
+
+	file_stat(m,INFO(m,file),&st);
+	return cache_insert(m->cache,&st,stage,stage < m->stage_count ? h->short_hash : h->hash);
+}
+
+/* Leave out the files that already share all their extents with another
+ * file of their group, e.g. from an earlier run with -B or -D. There is no
+ * point in reading them as they are the same as that file. Files the file
+ * system has no key for are left alone. Returns 0 on success. */
+static int skip_shared(struct matcher *m, int first, int last) {
+	struct hash_jobs jobs;
+	struct place *places;
+	int *groups, group_count = 0, count, i, j, k;
+
+	if (first == last) return 0;
+
+	jobs.m = m;
+	jobs.keys = true;
+	jobs.count = 0;
+	jobs.next = 0;
+	jobs.compares = NULL;
+	jobs.compare_count = 0;
+	jobs.next_compare = 0;
+	jobs.stage = 0;
+	jobs.files = malloc((last - first) * sizeof *jobs.files);
+	jobs.places = malloc((last - first) * sizeof *jobs.places);
+	places = malloc((last - first) * sizeof *places);
+	groups = malloc((last - first) * sizeof *groups);
+	if (jobs.files == NULL || jobs.places == NULL || places == NULL || groups == NULL) {
+		perror("Cannot allocate memory");
+		free(jobs.files);
+		free(jobs.places);
+		free(places);
+		free(groups);
+		return 1;
+	}
+
+	for (i = first; i < last; i = j) {
+		for (j = i + 1; j < last; j++)
+			if (cmp_fileinfo(INFO(m,i),INFO(m,j),m) != 0) break;
+
+		if (j - i < 2 || !distinct_files(m,i,j-i)) continue;
+
+		groups[group_count++] = i;
+		groups[group_count++] = j - i;
+		for (k = i; k < j; k++) jobs.files[jobs.count++] = k;
+	}
+
+	run_hash_jobs(&jobs);
+
+	/* sort the keys of each group, the first file with each key stays;
+	 * the index stands in for the inode number to keep the order stable */
+	for (i = 0, j = 0; i < group_count; i += 2) {
+		for (count = 0, k = 0; k < groups[i+1]; k++, j++) {
+			if (jobs.places[j] == 0) continue;
+
+			places[count].dev = INFO(m,jobs.files[j])->dev;
+			places[count].physical = jobs.places[j];
+			places[count].ino = jobs.files[j];
+			places[count].file = jobs.files[j];
+			count++;
+		}
+
+		qsort(places,count,sizeof *places,cmp_place);
+
+		for (k = 1; k < count; k++) {
+			if (places[k].dev != places[k-1].dev || places[k].physical != places[k-1].physical)
+				continue;
+
+			HASH(m,INFO(m,places[k].file))->stage = STAGE_SHARED;
+			m->shared++;
+		}
+
+		sort_files(m,groups[i],groups[i+1]);
+	}
+
+	free(jobs.files);
+	free(jobs.places);
+	free(places);
+	free(groups);
+
+	return 0;
+}
+
+static void print_stats(const struct matcher *m) {
+	static const char *const stage_names[] = { "head", "middle", "tail" };
+	const struct stage_stats *st;
+	int i;
+
+	if (m->candidate_count == 0) return;
+
+	if (m->flags & M_SHARED) fprintf(stderr,"Left out %d files already sharing their extents\n",
+	    m->shared);
+
+	if (m->cache != NULL) fprintf(stderr,"Found %d of %d candidates in hash cache\n",
+	    m->cache_hits,m->stats[0].candidates);
+
+	for (i = 0; i <= m->stage_count; i++) {
+		st = m->stats + i;
+		if (i < m->stage_count) fprintf(stderr,
+			"Stage %d (%s, %lld bytes): ",i+1,
+			stage_names[m->stages[i].type],
+			(long long)m->stages[i].length);
+		else fprintf(stderr,"Stage %d (full contents, %d groups compared directly): ",
+		    i+1,st->compared);
+
+		fprintf(stderr,"%d candidates, %d eliminated\n",st->candidates,st->eliminated);
+	}
+}
+
+/* Order the jobs by where the files are stored, so reads on rotating disks
+ * move in one direction as far as possible. The full hash reads all of each
+ * file, so there it pays to ask the file system where the first extent of
+ * each file is. Otherwise, inode numbers are a cheap approximation. */
+static void order_jobs(struct hash_jobs *jobs) {
+	struct matcher *m = jobs->m;
+	struct place *places;
+	struct fileinfo *f;
+	int i;
+
+	if (jobs->count < 2) return;
+
+	places = malloc(jobs->count * sizeof *places);
+	if (places == NULL) return; /* just an optimisation */
+
+	if (jobs->stage == m->stage_count) {
+		jobs->places = malloc(jobs->count * sizeof *jobs->places);
+		if (jobs->places != NULL) {
+			run_hash_jobs(jobs);
+			jobs->next = 0;
+		}
+	}
+
+	for (i = 0; i < jobs->count; i++) {
+		f = INFO(m,jobs->files[i]);
+		places[i].dev = f->dev;
+		places[i].physical = jobs->places != NULL ? jobs->places[i] : ULLONG_MAX;
+		places[i].ino = f->ino;
+		places[i].file = jobs->files[i];
+	}
+
+	qsort(places,jobs->count,sizeof *places,cmp_place);
+
+	for (i = 0; i < jobs->count; i++) jobs->files[i] = places[i].file;
+
+	free(jobs->places);
+	jobs->places = NULL;
+	free(places);
+}
+
+static int cmp_place(const void *a_void, const void *b_void) {
+	const struct place *a = a_void, *b = b_void;
 
-/* returns 1 on success, 0 on failure. Hashes first length bytes */
-static int file_sha1(sha_hash hash, const char *filepath, off_t length) {
-	unsigned char buf[BUFSIZE];
-	SHA_CTX sha;
-	ssize_t count;
-	int fd = open(filepath,O_RDONLY);
+	if (a->dev != b->dev) return a->dev < b->dev ? -1 : 1;
+	if (a->physical != b->physical) return a->physical < b->physical ? -1 : 1;
+	if (a->ino != b->ino) return a->ino < b->ino ? -1 : 1;
 
-	/* we probably don't have the right permissions */
-	if (fd < 0) return 0;
+	return 0;
+}
 
-	SHA1_Init(&sha);
+/* hash all files in jobs with up to thread_count threads, or find out where
+ * they are if jobs->places is set */
+static void run_hash_jobs(struct hash_jobs *jobs) {
+	pthread_t *threads = NULL;
+	int i = 0, err, thread_count = jobs->m->thread_count;
+	int job_count = jobs->count + (jobs->places == NULL ? jobs->compare_count / 2 : 0);
 
-	while (length > 0 && (count = read(fd,buf,BUFSIZE)) > 0) {
-		SHA1_Update(&sha,buf,count<length?count:length);
-		length -= count < length ? count : length;
+	if (thread_count > job_count) thread_count = job_count;
+
+	pthread_mutex_init(&jobs->lock,NULL);
+
+	if (thread_count > 1) threads = malloc(thread_count * sizeof *threads);
+
+	if (threads != NULL) for (i = 0; i < thread_count; i++) {
+		err = pthread_create(threads+i,NULL,hash_worker,jobs);
+		if (err != 0) {
+			fprintf(stderr,"Cannot create hashing thread: %s\n",strerror(err));
+			break;
+		}
 	}
 
-	if (count < 0) {
-		perror("Error reading file in file_sha");
-		close(fd);
+	/* if no thread could be created, do the work ourselves */
+	if (i == 0) hash_worker(jobs);
+
+	while (i-- > 0) pthread_join(threads[i],NULL);
+
+	pthread_mutex_destroy(&jobs->lock);
+	free(threads);
+}
+
+static void *hash_worker(void *arg) {
+	struct hash_worker w;
+	struct hash_jobs *jobs = arg;
+	int i;
+
+	w.jobs = jobs;
+	w.path = NULL;
+	w.path_size = 0;
+	w.buf.data = NULL;
+	w.buf.size = 0;
+	w.batching = hash_batches(jobs->m->hash_algorithm);
+	w.ready_count = 0;
+	memset(w.entries,0,sizeof w.entries);
+	for (i = 0; i < IO_DEPTH; i++) w.slots[i].hasher.evp = NULL;
+	for (i = 0; i < COMPARE_MAX; i++) {
+		w.compare_paths[i] = NULL;
+		w.compare_path_sizes[i] = 0;
+	}
+
+	if (jobs->places != NULL) for (;;) {
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+
+		if (i >= jobs->count) break;
+
+		locate_file(&w,i);
+	} else {
+		read_ranges(jobs->m->io_method == IO_URING ? IO_DEPTH : 1,
+		    jobs->m->io_method,next_hash,hash_sink,finish_hash,&w);
+		if (w.ready_count > 0) flush_batch(&w);
+
+		for (;;) {
+			pthread_mutex_lock(&jobs->lock);
+			i = jobs->next_compare;
+			jobs->next_compare += 2;
+			pthread_mutex_unlock(&jobs->lock);
+
+			if (i >= jobs->compare_count) break;
+
+			compare_job(&w,i);
+		}
+	}
+
+	for (i = 0; i < IO_DEPTH; i++) hasher_free(&w.slots[i].hasher);
+	for (i = 0; i < COMPARE_MAX; i++) free(w.compare_paths[i]);
+	for (i = 0; i < IO_DEPTH + HASH_LANES; i++) free(w.entries[i].data);
+	free_io_buffer(&w.buf);
+	free(w.path);
+
+	return NULL;
+}
+
+/* find the first extent of the file of job i or its shared extent key */
+static void locate_file(struct hash_worker *w, int i) {
+	struct hash_jobs *jobs = w->jobs;
+	const char *path = make_path(jobs->m,INFO(jobs->m,jobs->files[i]),&w->path,&w->path_size);
+
+	if (jobs->keys) {
+		if (path == NULL || shared_extents(path,jobs->places+i) == -1)
+			jobs->places[i] = 0;
+	} else if (path == NULL || first_extent(path,jobs->places+i) == -1)
+		jobs->places[i] = ULLONG_MAX;
+}
+
+/* Compare the files of the group at index i of the compare jobs with each
+ * other. The hashes of the files are set to the number of the class they
+ * end up in, which keeps them apart from each other. */
+static void compare_job(struct hash_worker *w, int i) {
+	struct matcher *m = w->jobs->m;
+	struct hashinfo *members[COMPARE_MAX];
+	const char *paths[COMPARE_MAX];
+	int start = w->jobs->compares[i], count = w->jobs->compares[i+1];
+	int classes[COMPARE_MAX], k, n = 0;
+
+	for (k = 0; k < count; k++) {
+		members[n] = HASH(m,INFO(m,start+k));
+		paths[n] = make_path(m,INFO(m,start+k),w->compare_paths+n,w->compare_path_sizes+n);
+		if (paths[n] == NULL) members[n]->stage = STAGE_FAILED;
+		else n++;
+	}
+
+	compare_group(paths,n,INFO(m,start)->size,&w->buf,classes);
+
+	for (k = 0; k < n; k++) {
+		if (classes[k] == -1) {
+			members[k]->stage = STAGE_FAILED;
+			continue;
+		}
+
+		memset(members[k]->hash,0,m->hash_length);
+		members[k]->hash[0] = classes[k];
+		members[k]->stage++;
+	}
+}
+
+/* Take the next job and set up the given slot for hashing its file. For the
+ * sampling stages, the short hash of the previous stage is hashed before the
+ * sample. Short reads are collected in a batch entry if hash_many pays off.
+ * Returns 0 on success, 1 if no jobs are left. */
+static int next_hash(void *arg, int slot, struct io_range *range) {
+	struct hash_worker *w = arg;
+	struct hash_jobs *jobs = w->jobs;
+	struct matcher *m = jobs->m;
+	struct hash_slot *s = w->slots + slot;
+	struct fileinfo *f;
+	size_t prefix;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+
+		if (i >= jobs->count) return 1;
+
+		f = INFO(m,jobs->files[i]);
+		s->h = HASH(m,f);
+		range->path = make_path(m,f,&w->path,&w->path_size);
+		if (range->path == NULL) {
+			s->h->stage = STAGE_FAILED;
+			continue;
+		}
+
+		prefix = 0;
+		if (jobs->stage == m->stage_count) {
+			s->hash = s->h->hash;
+			range->offset = 0;
+			range->length = f->size;
+		} else {
+			s->hash = s->h->short_hash;
+			if (jobs->stage > 0) prefix = m->hash_length;
+			sample_range(m,jobs->stage,f->size,&range->offset,&range->length);
+		}
+
+		s->entry = NULL;
+		if (w->batching && range->length <= BATCH_MAX)
+			s->entry = batch_entry(w,prefix + range->length);
+
+		if (s->entry != NULL) {
+			s->entry->h = s->h;
+			s->entry->hash = s->hash;
+			memcpy(s->entry->data,s->h->short_hash,prefix);
+			s->entry->length = prefix;
+		} else if (hasher_init(&s->hasher,m->hash_algorithm) != 0) {
+			s->h->stage = STAGE_FAILED;
+			continue;
+		} else hasher_update(&s->hasher,s->h->short_hash,prefix);
+
+		range->arg = s;
+
 		return 0;
 	}
+}
+
+static void finish_hash(void *arg, int slot, int ok) {
+	struct hash_worker *w = arg;
+	struct hash_slot *s = w->slots + slot;
+
+	if (!ok) {
+		if (s->entry != NULL) s->entry->used = false;
+		s->h->stage = STAGE_FAILED;
+	} else if (s->entry != NULL) {
+		w->ready[w->ready_count++] = s->entry;
+		if (w->ready_count == HASH_LANES) flush_batch(w);
+	} else {
+		hasher_final(&s->hasher,s->hash);
+		s->h->stage++;
+	}
+}
+
+/* a free batch entry with room for size bytes or NULL if there is none */
+static struct batch_entry *batch_entry(struct hash_worker *w, size_t size) {
+	struct batch_entry *e;
+	unsigned char *data;
+	int i;
 
-	SHA1_Final(hash,&sha);
-	close(fd);
+	for (i = 0; i < IO_DEPTH + HASH_LANES; i++) {
+		e = w->entries + i;
+		if (e->used) continue;
 
-	return 1;
+		if (e->size < size) {
+			data = realloc(e->data,size);
+			if (data == NULL) return NULL;
+
+			e->data = data;
+			e->size = size;
+		}
+
+		e->used = true;
+		return e;
+	}
+
+	return NULL;
+}
+
+/* hash the contents of the batch entries read so far */
+static void flush_batch(struct hash_worker *w) {
+	const unsigned char *data[HASH_LANES];
+	unsigned char *hashes[HASH_LANES];
+	size_t lengths[HASH_LANES];
+	int i;
+
+	for (i = 0; i < w->ready_count; i++) {
+		data[i] = w->ready[i]->data;
+		lengths[i] = w->ready[i]->length;
+		hashes[i] = w->ready[i]->hash;
+	}
+
+	hash_many(w->jobs->m->hash_algorithm,w->ready_count,data,lengths,hashes);
+
+	for (i = 0; i < w->ready_count; i++) {
+		w->ready[i]->h->stage++;
+		w->ready[i]->used = false;
+	}
+
+	w->ready_count = 0;
+}
+
+/* where the sample of the given sampling stage is in a file of size size */
+static void sample_range(const struct matcher *m, int stage, off_t size,
+    off_t *offset, off_t *length) {
+	*length = m->stages[stage].length < size ? m->stages[stage].length : size;
+
+	switch (m->stages[stage].type) {
+	case S_HEAD: *offset = 0; break;
+	case S_TAIL: *offset = size - *length; break;
+	case S_MIDDLE:
+	default:
+		*offset = (size - *length) / 2;
+		*offset -= *offset % SAMPLE_ALIGN;
+		break;
+	}
+}
+
+static void hash_sink(void *arg, const unsigned char *data, size_t len) {
+	struct hash_slot *s = arg;
+	struct batch_entry *e = s->entry;
+
+	if (e == NULL) {
+		hasher_update(&s->hasher,data,len);
+		return;
+	}
+
+	if (len > e->size - e->length) len = e->size - e->length;
+	memcpy(e->data + e->length,data,len);
+	e->length += len;
 }
 
 /* after a successful next_group file_index points to the first file in the
- * current duplication group. */
+ * current duplication group. Only candidates can be part of a group. */
 const char *next_group(struct matcher *m) {
-	int cmp, old_errno;
+	const char *path;
 
 	if (!m->finalized) {
 		errno = EINVAL;
 		return NULL;
 	}
 
-	while (m->file_index + 1 < m->file_count) {
-		old_errno = errno;
-		errno = 0;
-		cmp_matcher = m;
-		cmp = cmp_fileinfo(m->info_map+m->file_index,m->info_map+m->file_index+1);
-		if (errno != 0) return NULL;
-		errno = old_errno;
+	do while (m->file_index + 1 < m->limit) {
+		if (cmp_fileinfo(INFO(m,m->file_index),INFO(m,m->file_index+1),m) == 0) {
+			path = make_path(m,INFO(m,m->file_index),&m->group_path,&m->group_path_size);
+			if (path == NULL) m->lost = true;
 
-		if (cmp == 0) return m->name_map + m->info_map[m->file_index].path;
+			return path;
+		}
 
 		m->file_index++;
-	}
+	} while (next_window(m));
 
 	return NULL;
 }
@@ -333,30 +2048,93 @@ const char *next_group(struct matcher *m) {
 /* next_file yields the file immediately after the file pointed to by file_index,
  * iff it compares equal to the file pointed to by file_index */
 const char *next_file(struct matcher *m) {
-	int cmp, old_errno;
+	const char *path;
+	int cmp;
 
 	if (!m->finalized) {
 		errno = EINVAL;
 		return NULL;
 	}
 
-	if (m->file_index + 1 >= m->file_count) return NULL;
+	/* groups never span windows */
+	if (m->file_index + 1 >= m->limit) return NULL;
 
-	old_errno = errno;
-	errno = 0;
-	cmp_matcher = m;
-	cmp = cmp_fileinfo(m->info_map+m->file_index,m->info_map+m->file_index+1);
-	if (errno != 0) return NULL;
-	errno = old_errno;
+	cmp = cmp_fileinfo(INFO(m,m->file_index),INFO(m,m->file_index+1),m);
 
 	m->file_index++;
 
-	return cmp == 0 ? m->name_map + m->info_map[m->file_index].path : NULL;
+	if (cmp != 0) return NULL;
+
+	path = make_path(m,INFO(m,m->file_index),&m->file_path,&m->file_path_size);
+	if (path == NULL) m->lost = true;
+
+	return path;
+}
+
+int for_each_group(struct matcher *m, group_func *func, void *arg) {
+	const char *path, **files = NULL, **new_files;
+	char *paths = NULL, *new_paths;
+	size_t len, used, size = 0;
+	int i, count, file_size = 0, retval = 0;
+
+	if (!m->finalized) return -1;
+
+	while (retval == 0 && (path = next_group(m)) != NULL) {
+		/* the paths of a group follow each other in one buffer */
+		for (used = 0, count = 0; path != NULL; path = next_file(m), count++) {
+			len = strlen(path) + 1;
+			if (used + len > size) {
+				new_paths = realloc(paths,2 * size + len);
+				if (new_paths == NULL) goto nomem;
+
+				paths = new_paths;
+				size = 2 * size + len;
+			}
+
+			memcpy(paths + used,path,len);
+			used += len;
+		}
+
+		if (m->lost) break;
+
+		if (count > file_size) {
+			new_files = realloc(files,2 * count * sizeof *files);
+			if (new_files == NULL) goto nomem;
+
+			files = new_files;
+			file_size = 2 * count;
+		}
+
+		for (i = 0, used = 0; i < count; i++) {
+			files[i] = paths + used;
+			used += strlen(files[i]) + 1;
+		}
+
+		retval = func(arg,files,count);
+	}
+
+	/* without a callback stopping early, the search is over by now */
+	if (retval == 0 && (m->lost || m->failed)) retval = -1;
+
+	free(paths);
+	free(files);
+
+	return retval;
+
+	nomem:
+	perror("Cannot allocate memory");
+	free(paths);
+	free(files);
+
+	return -1;
 }
 
 void free_matcher(struct matcher *m) {
 	off_t name_size = ftello(m->name_file), info_size = ftello(m->info_file);
 	long pagesize;
+	size_t i;
+
+	wait_matcher(m);
 
 	if (!m->finalized) goto skip_munmap;
 
@@ -383,5 +2161,14 @@ void free_matcher(struct matcher *m) {
 	fclose(m->name_file);
 	fclose(m->info_file);
 
+	pthread_mutex_destroy(&m->register_lock);
+	pthread_mutex_destroy(&m->queue_lock);
+	pthread_cond_destroy(&m->queue_cond);
+	free(m->hashes);
+	free(m->dirs);
+	for (i = 0; i < m->lone_dir_size; i++) free(m->lone_dirs[i].path);
+	free(m->lone_dirs);
+	free(m->group_path);
+	free(m->file_path);
 	free(m);
 }
@@ -25,6 +25,12 @@
 #ifndef MATCH_H
 #define MATCH_H
 
+/* The matcher keeps no state outside of struct matcher, so distinct
+ * matchers may be used from distinct threads at once. Where not noted
+ * otherwise, only one thread at a time may call functions on one matcher.
+ * The matcher, the tree walker and what they need are built into the
+ * libraries libfdup.a and libfdup.so. */
+
 typedef enum {
 	M_LINK  = 0x01, /* Are hardlinks to the same file distinct? */
 	M_CTIME = 0x02, /* Are files with distinct creation time distinct? */
@@ -32,19 +38,97 @@ typedef enum {
 	M_DEV   = 0x08, /* Are equal files on different devices distinct? */
 	M_MODE  = 0x10, /* Are files with different access modes distint? */
 	M_UID   = 0x20, /* Are files owned by different users distinct? */
-	M_GID   = 0x40  /* Are files owned by differed groups distinct? */
+	M_GID   = 0x40, /* Are files owned by differed groups distinct? */
+	M_SHARED = 0x80 /* Are files already sharing their extents left out? */
 } matcher_flags;
 
+/* the fields of struct stat a matcher looks at besides the file type, size,
+ * device and inode number */
+typedef enum {
+	F_MODE  = 0x01,
+	F_UID   = 0x02,
+	F_GID   = 0x04,
+	F_MTIME = 0x08,
+	F_CTIME = 0x10
+} stat_fields;
+
+/* Before their full contents are hashed, files of equal size are told apart
+ * by hashing samples of them in a number of stages. Each stage only looks at
+ * the files that could not be told apart by the previous stages. */
+typedef enum {
+	S_HEAD,   /* sample the beginning of the file */
+	S_MIDDLE, /* sample the middle of the file */
+	S_TAIL    /* sample the end of the file */
+} stage_type;
+
+struct stage {
+	stage_type type;
+	off_t length; /* number of bytes to sample */
+};
+
+enum { MAX_STAGES = 8 };
+
+struct hash_cache;
+
 /* returns NULL on error with errno set appropriately */
 struct matcher *new_matcher(matcher_flags);
 /* these function return 0 on success */
+int set_thread_count(struct matcher*,int);
+int set_stages(struct matcher*,const struct stage*,int);
+/* Look up hashes in this cache and add new ones to it. The cache has to be
+ * opened with the stages of the matcher and set before the first file is
+ * registered. */
+int set_cache(struct matcher*,struct hash_cache*);
+/* read files for hashing with this enum io_method from io.h */
+int set_io_method(struct matcher*,int);
+/* compare file contents with this enum hash_algorithm from hash.h */
+int set_hash_algorithm(struct matcher*,int);
+/* Let finalize_matcher return right away and find the groups in the
+ * background; next_group waits until the next group has been found. */
+int set_streaming(struct matcher*,int);
+/* Group the files in runs on disk instead of in memory once their records
+ * take up more than the given number of bytes, 0 for no limit. */
+int set_memory_limit(struct matcher*,size_t);
+/* Let finalize_matcher leave the files as they are instead of looking for
+ * groups of equal files, so next_group finds none. */
+int set_grouping(struct matcher*,int);
+/* print statistics about the hashing stages to stderr */
+void set_verbose(struct matcher*,int);
 int register_file(struct matcher*,const char*,const struct stat*);
+/* Register a directory under its parent directory, which is -1 for a
+ * directory whose name is a path of its own. Returns the index of the new
+ * directory or -1 on error. May be called from multiple threads. */
+int register_dir(struct matcher*,int,const char*);
+/* register several files at once, each given by the index of its directory
+ * and its name; may be called from multiple threads */
+int register_files(struct matcher*,const int*,const char*const*,const struct stat*,int);
 int get_file_count(struct matcher*);
+/* The path of the file at the given index once the matcher is finalized,
+ * and its size, device and inode number in the struct stat. The path stays
+ * valid until the next call to get_file or next_file. Returns NULL on error. */
+const char *get_file(struct matcher*,int,struct stat*);
+stat_fields get_stat_fields(struct matcher*);
+/* copy the sampling stages into an array of MAX_STAGES and return their number */
+int get_stages(struct matcher*,struct stage*);
 int finalize_matcher(struct matcher*);
+/* When streaming, wait for the search in the background to end, which it
+ * does early if next_group has not yet returned NULL. Returns 0 if the
+ * search succeeded and next_group and next_file did not fail. */
+int wait_matcher(struct matcher*);
 /* return NULL if there is no next file in this group or no next group or 
- * on error. next_group returns the first file in said group. */
+ * on error. next_group returns the first file in said group. The path
+ * returned by next_group stays valid until the next call to next_group, the
+ * one returned by next_file until the next call to next_file. */
 const char *next_group(struct matcher*);
 const char *next_file(struct matcher*);
+/* Called with the paths of the files in a group and their number; the paths
+ * stay valid until the function returns. A nonzero return value ends the
+ * iteration. */
+typedef int group_func(void*,const char*const*,int);
+/* Call the function for each group not yet returned by next_group. Returns
+ * 0 once all groups were seen, the value returned by the function if it
+ * ended the iteration early and -1 on error. */
+int for_each_group(struct matcher*,group_func*,void*);
 void free_matcher(struct matcher*);
 
 #endif /* MATCH_H */
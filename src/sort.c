@@ -0,0 +1,179 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sort.h"
+
+/* runs this short are sorted by insertion */
+enum { INSERTION_RUN = 8 };
+
+static void insertion_sort(char*,size_t,size_t,sort_cmp*,void*);
+static size_t lower_bound(const char*,size_t,const char*,size_t,sort_cmp*,void*);
+static void merge_in_place(char*,size_t,size_t,size_t,sort_cmp*,void*);
+static void merge_sort(char*,char*,size_t,size_t,sort_cmp*,void*);
+static void reverse_records(char*,size_t,size_t);
+static void rotate_records(char*,size_t,size_t,size_t);
+static void swap_records(char*,char*,size_t);
+static size_t upper_bound(const char*,size_t,const char*,size_t,sort_cmp*,void*);
+
+void sort_records(void *base, size_t count, size_t size, sort_cmp *cmp, void *ctx) {
+	char *tmp;
+
+	if (count < 2 || size == 0) return;
+
+	/* the first half of the records is moved out of the way when merging,
+	 * without memory for that the halves are merged by rotating them */
+	tmp = malloc(count / 2 * size);
+	merge_sort(base,tmp,count,size,cmp,ctx);
+	free(tmp);
+}
+
+static void merge_sort(char *base, char *tmp, size_t count, size_t size,
+    sort_cmp *cmp, void *ctx) {
+	size_t half = count / 2, i = 0, j = half, k = 0;
+
+	if (count <= INSERTION_RUN) {
+		insertion_sort(base,count,size,cmp,ctx);
+		return;
+	}
+
+	merge_sort(base,tmp,half,size,cmp,ctx);
+	merge_sort(base + half * size,tmp,count - half,size,cmp,ctx);
+
+	/* nothing to do if the halves are already in order */
+	if (cmp(base + (half - 1) * size,base + half * size,ctx) <= 0) return;
+
+	if (tmp == NULL) {
+		merge_in_place(base,half,count - half,size,cmp,ctx);
+		return;
+	}
+
+	/* k never catches up with j while records are left in tmp */
+	memcpy(tmp,base,half * size);
+	while (i < half && j < count) {
+		if (cmp(base + j * size,tmp + i * size,ctx) < 0)
+			memcpy(base + k++ * size,base + j++ * size,size);
+		else
+			memcpy(base + k++ * size,tmp + i++ * size,size);
+	}
+
+	memcpy(base + k * size,tmp + i * size,(half - i) * size);
+}
+
+static void insertion_sort(char *base, size_t count, size_t size,
+    sort_cmp *cmp, void *ctx) {
+	size_t i, j;
+
+	for (i = 1; i < count; i++)
+		for (j = i; j > 0 && cmp(base + (j - 1) * size,base + j * size,ctx) > 0; j--)
+			swap_records(base + (j - 1) * size,base + j * size,size);
+}
+
+/* Merge the sorted runs of n1 and n2 records at base without extra memory.
+ * The longer run is cut in half, the other one where the middle record of
+ * the first would go, and the parts in between are swapped by a rotation.
+ * Equal records stay in order as those of the first run never pass them. */
+static void merge_in_place(char *base, size_t n1, size_t n2, size_t size,
+    sort_cmp *cmp, void *ctx) {
+	size_t cut1, cut2;
+
+	if (n1 == 0 || n2 == 0) return;
+
+	if (n1 + n2 == 2) {
+		if (cmp(base + size,base,ctx) < 0) swap_records(base,base + size,size);
+		return;
+	}
+
+	if (n1 > n2) {
+		cut1 = n1 / 2;
+		cut2 = lower_bound(base + n1 * size,n2,base + cut1 * size,size,cmp,ctx);
+	} else {
+		cut2 = n2 / 2;
+		cut1 = upper_bound(base,n1,base + (n1 + cut2) * size,size,cmp,ctx);
+	}
+
+	rotate_records(base + cut1 * size,n1 - cut1,cut2,size);
+
+	merge_in_place(base,cut1,cut2,size,cmp,ctx);
+	merge_in_place(base + (cut1 + cut2) * size,n1 - cut1,n2 - cut2,size,cmp,ctx);
+}
+
+/* the number of records in the sorted run that come before key */
+static size_t lower_bound(const char *base, size_t count, const char *key, size_t size,
+    sort_cmp *cmp, void *ctx) {
+	size_t low = 0, high = count, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (cmp(base + mid * size,key,ctx) < 0) low = mid + 1;
+		else high = mid;
+	}
+
+	return low;
+}
+
+/* the number of records in the sorted run that come before key or equal it */
+static size_t upper_bound(const char *base, size_t count, const char *key, size_t size,
+    sort_cmp *cmp, void *ctx) {
+	size_t low = 0, high = count, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (cmp(key,base + mid * size,ctx) < 0) high = mid;
+		else low = mid + 1;
+	}
+
+	return low;
+}
+
+/* turn the n1 records at base followed by n2 records into the n2 followed by
+ * the n1 records */
+static void rotate_records(char *base, size_t n1, size_t n2, size_t size) {
+	reverse_records(base,n1,size);
+	reverse_records(base + n1 * size,n2,size);
+	reverse_records(base,n1 + n2,size);
+}
+
+static void reverse_records(char *base, size_t count, size_t size) {
+	size_t i;
+
+	for (i = 0; i < count / 2; i++)
+		swap_records(base + i * size,base + (count - 1 - i) * size,size);
+}
+
+static void swap_records(char *a, char *b, size_t size) {
+	char tmp;
+
+	while (size-- > 0) {
+		tmp = *a;
+		*a++ = *b;
+		*b++ = tmp;
+	}
+}
@@ -0,0 +1,703 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+/* for d_type and statx */
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sys/sysmacros.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "match.h"
+#include "walk.h"
+
+enum { BATCH_SIZE = 256 };
+
+/* A directory being scanned, kept open until its subdirectories have been
+ * opened relative to it. Each of them holds a reference. */
+struct dir_handle {
+	DIR *dp;
+	int refs; /* protected by the lock of the walk */
+};
+
+struct dir_entry {
+	char *path;
+	struct dir_handle *parent; /* NULL for the roots */
+	dev_t dev; /* device of the root this directory was found under */
+	int index; /* index of the directory in the matcher */
+};
+
+/* Each thread pushes the directories it finds onto its own stack and takes
+ * directories from its top. Idle threads steal from the bottom of the other
+ * stacks, where the directories closest to the roots are. */
+struct dir_stack {
+	pthread_mutex_t lock;
+	struct dir_entry *dirs;
+	size_t bottom, top, size;
+};
+
+struct walk {
+	struct matcher *m;
+	const struct walk_options *opts;
+	struct dir_stack *stacks;
+	int thread_count;
+	stat_fields fields; /* fields the matcher needs */
+	pthread_mutex_t lock; /* protects the fields below */
+	pthread_cond_t wakeup;
+	size_t pending; /* directories queued or being scanned */
+	size_t pushes; /* number of directories queued so far */
+	int idle;
+	bool failed;
+};
+
+/* files found by one thread, registered with the matcher in one go */
+struct batch {
+	char *names;
+	size_t names_len, names_size;
+	size_t offsets[BATCH_SIZE];
+	int dirs[BATCH_SIZE];
+	struct stat stats[BATCH_SIZE];
+	int count;
+};
+
+struct worker {
+	struct walk *w;
+	int id;
+};
+
+static int add_file(struct walk*,struct batch*,int,const char*,const struct stat*);
+static char *join_path(const char*,const char*);
+static void finish_dir(struct walk*);
+static int flush_batch(struct walk*,struct batch*);
+static int parse_record(char*,struct stat*,char**);
+static int push_dir(struct walk*,int,char*,struct dir_handle*,dev_t,int);
+static void release_dir(struct walk*,struct dir_handle*);
+static void scan_dir(struct walk*,int,const struct dir_entry*,struct batch*);
+static int stat_entry(int,const char*,stat_fields,struct stat*);
+static bool take_dir(struct walk*,int,struct dir_entry*);
+static void *walk_worker(void*);
+
+int walk_trees(struct matcher *m, char *const *roots, int root_count,
+    const struct walk_options *opts) {
+	struct walk w;
+	struct worker *workers;
+	pthread_t *threads;
+	struct stat st;
+	char *path;
+	int i, err, started, index, retval = 0;
+
+	memset(&w,0,sizeof w);
+	w.m = m;
+	w.opts = opts;
+	w.thread_count = opts->threads < 1 ? 1 : opts->threads;
+	w.fields = get_stat_fields(m);
+
+	w.stacks = calloc(w.thread_count,sizeof *w.stacks);
+	workers = calloc(w.thread_count,sizeof *workers);
+	threads = calloc(w.thread_count,sizeof *threads);
+	if (w.stacks == NULL || workers == NULL || threads == NULL) {
+		perror("Cannot allocate memory");
+		free(w.stacks);
+		free(workers);
+		free(threads);
+		return 1;
+	}
+
+	pthread_mutex_init(&w.lock,NULL);
+	pthread_cond_init(&w.wakeup,NULL);
+	for (i = 0; i < w.thread_count; i++) {
+		pthread_mutex_init(&w.stacks[i].lock,NULL);
+		workers[i].w = &w;
+		workers[i].id = i;
+	}
+
+	for (i = 0; i < root_count; i++) {
+		if (lstat(roots[i],&st) == -1) {
+			fprintf(stderr,"\nError processing argument %s: ",roots[i]);
+			perror(NULL);
+			continue;
+		}
+
+		if (S_ISREG(st.st_mode)) {
+			if (opts->filter != NULL && !opts->filter(&st,opts->filter_arg))
+				continue;
+
+			if (register_file(m,roots[i],&st)) {
+				retval = 1;
+				break;
+			}
+		} else if (S_ISDIR(st.st_mode)) {
+			index = register_dir(m,-1,roots[i]);
+			if (index == -1) {
+				retval = 1;
+				break;
+			}
+
+			path = strdup(roots[i]);
+			if (path == NULL || push_dir(&w,0,path,NULL,st.st_dev,index)) {
+				perror("Cannot allocate memory");
+				retval = 1;
+				break;
+			}
+		}
+	}
+
+	/* the calling thread is the first worker */
+	for (started = 1; started < w.thread_count; started++) {
+		err = pthread_create(threads+started,NULL,walk_worker,workers+started);
+		if (err != 0) {
+			fprintf(stderr,"Cannot create scanning thread: %s\n",strerror(err));
+			break;
+		}
+	}
+
+	walk_worker(workers);
+
+	for (i = 1; i < started; i++) pthread_join(threads[i],NULL);
+
+	if (w.failed) retval = 1;
+
+	/* directories left over after a failure */
+	for (i = 0; i < w.thread_count; i++) {
+		while (w.stacks[i].bottom < w.stacks[i].top) {
+			release_dir(&w,w.stacks[i].dirs[w.stacks[i].bottom].parent);
+			free(w.stacks[i].dirs[w.stacks[i].bottom++].path);
+		}
+
+		free(w.stacks[i].dirs);
+		pthread_mutex_destroy(&w.stacks[i].lock);
+	}
+
+	pthread_cond_destroy(&w.wakeup);
+	pthread_mutex_destroy(&w.lock);
+	free(w.stacks);
+	free(workers);
+	free(threads);
+
+	return retval;
+}
+
+static void *walk_worker(void *arg) {
+	struct worker *self = arg;
+	struct walk *w = self->w;
+	struct dir_entry dir;
+	struct batch batch;
+
+	memset(&batch,0,sizeof batch);
+
+	while (take_dir(w,self->id,&dir)) {
+		scan_dir(w,self->id,&dir,&batch);
+		free(dir.path);
+		finish_dir(w);
+	}
+
+	if (flush_batch(w,&batch)) {
+		pthread_mutex_lock(&w->lock);
+		w->failed = true;
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	free(batch.names);
+
+	return NULL;
+}
+
+/* Queue a directory found in parent on the stack of thread id. Takes
+ * ownership of path. Returns 0 on success. */
+static int push_dir(struct walk *w, int id, char *path, struct dir_handle *parent,
+    dev_t dev, int index) {
+	struct dir_stack *s = w->stacks + id;
+	struct dir_entry *dirs;
+	size_t size;
+
+	/* before another thread can take the directory and let go of parent */
+	if (parent != NULL) {
+		pthread_mutex_lock(&w->lock);
+		parent->refs++;
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->bottom == s->top) s->bottom = s->top = 0;
+
+	if (s->top == s->size) {
+		size = s->size == 0 ? 64 : 2 * s->size;
+		dirs = realloc(s->dirs,size * sizeof *dirs);
+		if (dirs == NULL) {
+			pthread_mutex_unlock(&s->lock);
+			release_dir(w,parent);
+			free(path);
+			return 1;
+		}
+
+		s->dirs = dirs;
+		s->size = size;
+	}
+
+	s->dirs[s->top].path = path;
+	s->dirs[s->top].parent = parent;
+	s->dirs[s->top].dev = dev;
+	s->dirs[s->top].index = index;
+	s->top++;
+
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&w->lock);
+	w->pending++;
+	w->pushes++;
+	if (w->idle > 0) pthread_cond_signal(&w->wakeup);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+/* take a directory from our own stack or steal one from another thread.
+ * Returns false once all directories have been scanned. */
+static bool take_dir(struct walk *w, int id, struct dir_entry *dir) {
+	struct dir_stack *s;
+	size_t pushes;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		if (w->pending == 0 || w->failed) {
+			pthread_mutex_unlock(&w->lock);
+			return false;
+		}
+		pushes = w->pushes;
+		pthread_mutex_unlock(&w->lock);
+
+		for (i = 0; i < w->thread_count; i++) {
+			s = w->stacks + (id + i) % w->thread_count;
+
+			pthread_mutex_lock(&s->lock);
+			if (s->bottom < s->top) {
+				*dir = i == 0 ? s->dirs[--s->top] : s->dirs[s->bottom++];
+				pthread_mutex_unlock(&s->lock);
+				return true;
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+
+		/* nothing to do; wait unless a directory was queued meanwhile */
+		pthread_mutex_lock(&w->lock);
+		if (w->pushes == pushes && w->pending > 0 && !w->failed) {
+			w->idle++;
+			pthread_cond_wait(&w->wakeup,&w->lock);
+			w->idle--;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+static void release_dir(struct walk *w, struct dir_handle *h) {
+	bool last;
+
+	if (h == NULL) return;
+
+	pthread_mutex_lock(&w->lock);
+	last = --h->refs == 0;
+	pthread_mutex_unlock(&w->lock);
+
+	if (last) {
+		closedir(h->dp);
+		free(h);
+	}
+}
+
+static void finish_dir(struct walk *w) {
+	pthread_mutex_lock(&w->lock);
+	if (--w->pending == 0) pthread_cond_broadcast(&w->wakeup);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void scan_dir(struct walk *w, int id, const struct dir_entry *dir, struct batch *b) {
+	const struct walk_options *opts = w->opts;
+	struct dir_handle *h;
+	struct dirent *de;
+	struct stat st;
+	char *path;
+	DIR *dp;
+	int fd, index;
+
+	/* the parent is open already, so only the last component is looked up */
+	if (dir->parent != NULL)
+		fd = openat(dirfd(dir->parent->dp),strrchr(dir->path,'/') + 1,
+		    O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+	else fd = open(dir->path,O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+
+	release_dir(w,dir->parent);
+
+	if (fd == -1 || (dp = fdopendir(fd)) == NULL) {
+		fprintf(stderr,"\nCannot open directory %s: ",dir->path);
+		perror(NULL);
+		if (fd != -1) close(fd);
+		return;
+	}
+
+	h = malloc(sizeof *h);
+	if (h == NULL) {
+		perror("Cannot allocate memory");
+		closedir(dp);
+		goto fail;
+	}
+
+	h->dp = dp;
+	h->refs = 1;
+
+	for (;;) {
+		errno = 0;
+		de = readdir(dp);
+		if (de == NULL) break;
+
+		if (strcmp(de->d_name,".") == 0 || strcmp(de->d_name,"..") == 0)
+			continue;
+
+#ifdef DT_UNKNOWN
+		/* The file type is often known without calling stat. Other
+		 * directories only need to be looked at with -x. */
+		switch (de->d_type) {
+		case DT_UNKNOWN:
+		case DT_REG:
+			break;
+
+		case DT_DIR:
+			if (opts->xdev) break;
+
+			index = register_dir(w->m,dir->index,de->d_name);
+			if (index == -1) goto fail;
+
+			path = join_path(dir->path,de->d_name);
+			if (path == NULL || push_dir(w,id,path,h,dir->dev,index)) goto fail;
+			continue;
+
+		default:
+			continue;
+		}
+#endif
+
+		if (stat_entry(fd,de->d_name,w->fields,&st) == -1) {
+			fprintf(stderr,"\nCannot call stat on %s/%s: ",dir->path,de->d_name);
+			perror(NULL);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (opts->xdev && st.st_dev != dir->dev) continue;
+
+			index = register_dir(w->m,dir->index,de->d_name);
+			if (index == -1) goto fail;
+
+			path = join_path(dir->path,de->d_name);
+			if (path == NULL || push_dir(w,id,path,h,dir->dev,index)) goto fail;
+		} else if (S_ISREG(st.st_mode)) {
+			if (opts->filter != NULL && !opts->filter(&st,opts->filter_arg))
+				continue;
+
+			if (add_file(w,b,dir->index,de->d_name,&st)) goto fail;
+		}
+	}
+
+	if (errno != 0) {
+		fprintf(stderr,"\nCannot read directory %s: ",dir->path);
+		perror(NULL);
+	}
+
+	release_dir(w,h);
+	return;
+
+	fail:
+	release_dir(w,h);
+	pthread_mutex_lock(&w->lock);
+	w->failed = true;
+	pthread_cond_broadcast(&w->wakeup);
+	pthread_mutex_unlock(&w->lock);
+}
+
+int read_list(struct matcher *m, FILE *list, const char *list_name, int records,
+    const struct walk_options *opts) {
+	struct walk w;
+	struct batch b;
+	struct stat st;
+	char *line = NULL, *path, *name, *dir = NULL, *new_dir;
+	size_t line_size = 0, dir_len = 0;
+	ssize_t len;
+	int index = -1, retval = 0;
+	bool known;
+
+	memset(&w,0,sizeof w);
+	memset(&b,0,sizeof b);
+	w.m = m;
+	w.opts = opts;
+	w.fields = get_stat_fields(m);
+	pthread_mutex_init(&w.lock,NULL);
+
+	/* records are only trusted if they hold all the matcher needs */
+	known = records && (w.fields & ~F_MTIME) == 0;
+
+	while ((len = getdelim(&line,&line_size,'\0',list)) > 0) {
+		if (line[len-1] == '\0') len--;
+		if (len == 0) continue;
+
+		path = line;
+		if (records && parse_record(line,&st,&path)) {
+			fprintf(stderr,"\nMalformed record in %s: %s\n",list_name,line);
+			continue;
+		}
+
+		if (!known && stat_entry(AT_FDCWD,path,w.fields,&st) == -1) {
+			fprintf(stderr,"\nError processing %s: ",path);
+			perror(NULL);
+			continue;
+		}
+
+		if (!S_ISREG(st.st_mode)) continue;
+		if (opts->filter != NULL && !opts->filter(&st,opts->filter_arg)) continue;
+
+		/* lists are mostly sorted by directory, so the directory of the
+		 * file before is likely the one of this file */
+		name = strrchr(path,'/');
+		if (name == NULL) {
+			name = path;
+			index = -1;
+			free(dir);
+			dir = NULL;
+		} else if (dir == NULL || (size_t)(name - path) != dir_len || memcmp(dir,path,dir_len) != 0) {
+			dir_len = name - path;
+			new_dir = realloc(dir,dir_len + 2);
+			if (new_dir == NULL) {
+				perror("Cannot allocate memory");
+				retval = 1;
+				break;
+			}
+
+			dir = new_dir;
+			memcpy(dir,path,dir_len);
+
+			/* keep the slash if the file is in the root directory */
+			dir[dir_len + (dir_len == 0)] = '\0';
+			if (dir_len == 0) dir[0] = '/';
+
+			index = register_dir(m,-1,dir);
+			if (index == -1) {
+				retval = 1;
+				break;
+			}
+
+			name++;
+		} else name++;
+
+		if (add_file(&w,&b,index,name,&st)) {
+			retval = 1;
+			break;
+		}
+	}
+
+	if (retval == 0 && ferror(list)) {
+		fprintf(stderr,"\nError reading %s: ",list_name);
+		perror(NULL);
+		retval = 1;
+	}
+
+	if (retval == 0 && flush_batch(&w,&b)) retval = 1;
+
+	pthread_mutex_destroy(&w.lock);
+	free(line);
+	free(dir);
+	free(b.names);
+
+	return retval;
+}
+
+/* Parse a record of the form size device inode mtime path, with the mtime in
+ * seconds and an optional fraction, into st and let path point to the path.
+ * Returns 0 on success. */
+static int parse_record(char *record, struct stat *st, char **path) {
+	unsigned long long size, dev, ino;
+	long long sec;
+	long nsec = 0, scale = 100000000;
+	char *rest;
+
+	if (*record < '0' || *record > '9') return 1;
+	size = strtoull(record,&rest,10);
+	if (*rest != ' ' || rest[1] < '0' || rest[1] > '9') return 1;
+	dev = strtoull(rest + 1,&rest,10);
+	if (*rest != ' ' || rest[1] < '0' || rest[1] > '9') return 1;
+	ino = strtoull(rest + 1,&rest,10);
+	if (*rest != ' ' || rest[1] < '0' || rest[1] > '9') return 1;
+	sec = strtoll(rest + 1,&rest,10);
+
+	if (*rest == '.') for (rest++; *rest >= '0' && *rest <= '9'; rest++) {
+		nsec += (*rest - '0') * scale;
+		scale /= 10;
+	}
+
+	if (*rest != ' ' || rest[1] == '\0') return 1;
+
+	memset(st,0,sizeof *st);
+	st->st_mode = S_IFREG;
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_dev = dev;
+	st->st_ino = ino;
+	st->st_mtim.tv_sec = sec;
+	st->st_mtim.tv_nsec = nsec;
+	*path = rest + 1;
+
+	return 0;
+}
+
+/* Call stat on name in the directory fd without following symbolic links.
+ * Where statx is available, only the type, size, device and inode number
+ * as well as the fields requested are queried, saving a round trip to the
+ * server on some network file systems. Fields that are not requested are
+ * zero. Returns 0 on success, -1 on error with errno set. */
+static int stat_entry(int fd, const char *name, stat_fields fields, struct stat *st) {
+#ifdef STATX_TYPE
+	static volatile int no_statx = 0;
+	unsigned mask = STATX_TYPE|STATX_INO|STATX_SIZE;
+	struct statx stx;
+
+	if (no_statx) return fstatat(fd,name,st,AT_SYMLINK_NOFOLLOW);
+
+	if (fields & F_MODE) mask |= STATX_MODE;
+	if (fields & F_UID) mask |= STATX_UID;
+	if (fields & F_GID) mask |= STATX_GID;
+	if (fields & F_MTIME) mask |= STATX_MTIME;
+	if (fields & F_CTIME) mask |= STATX_CTIME;
+
+	if (statx(fd,name,AT_SYMLINK_NOFOLLOW|AT_NO_AUTOMOUNT,mask,&stx) == -1) {
+		if (errno != ENOSYS) return -1;
+
+		no_statx = 1;
+		return fstatat(fd,name,st,AT_SYMLINK_NOFOLLOW);
+	}
+
+	memset(st,0,sizeof *st);
+	st->st_dev = makedev(stx.stx_dev_major,stx.stx_dev_minor);
+	st->st_ino = stx.stx_ino;
+	st->st_mode = stx.stx_mode;
+	st->st_nlink = stx.stx_nlink;
+	st->st_uid = stx.stx_uid;
+	st->st_gid = stx.stx_gid;
+	st->st_size = stx.stx_size;
+	st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+
+	return 0;
+#else
+	(void)fields;
+	return fstatat(fd,name,st,AT_SYMLINK_NOFOLLOW);
+#endif
+}
+
+/* returns a newly allocated string dir/name or NULL if out of memory */
+static char *join_path(const char *dir, const char *name) {
+	size_t dir_len = strlen(dir), name_len = strlen(name);
+	char *path = malloc(dir_len + name_len + 2);
+
+	if (path == NULL) return NULL;
+
+	memcpy(path,dir,dir_len);
+	if (dir_len == 0 || dir[dir_len-1] != '/') path[dir_len++] = '/';
+	memcpy(path+dir_len,name,name_len+1);
+
+	return path;
+}
+
+/* queue name in the directory with index dir; returns 0 on success */
+static int add_file(struct walk *w, struct batch *b, int dir,
+    const char *name, const struct stat *st) {
+	size_t name_len = strlen(name), size;
+	char *names;
+
+	if (b->count == BATCH_SIZE && flush_batch(w,b)) return 1;
+
+	size = b->names_size == 0 ? 4096 : b->names_size;
+	while (b->names_len + name_len + 1 > size) size *= 2;
+
+	if (size != b->names_size) {
+		names = realloc(b->names,size);
+		if (names == NULL) {
+			perror("Cannot allocate memory");
+			return 1;
+		}
+
+		b->names = names;
+		b->names_size = size;
+	}
+
+	b->offsets[b->count] = b->names_len;
+	memcpy(b->names+b->names_len,name,name_len+1);
+	b->names_len += name_len + 1;
+
+	b->dirs[b->count] = dir;
+	b->stats[b->count++] = *st;
+
+	return 0;
+}
+
+/* returns 0 on success */
+static int flush_batch(struct walk *w, struct batch *b) {
+	const char *names[BATCH_SIZE];
+	int i;
+
+	if (b->count == 0) return 0;
+
+	for (i = 0; i < b->count; i++) names[i] = b->names + b->offsets[i];
+
+	if (register_files(w->m,b->dirs,names,b->stats,b->count)) return 1;
+
+	b->count = 0;
+	b->names_len = 0;
+
+	if (w->opts->verbose) {
+		pthread_mutex_lock(&w->lock);
+		fprintf(stderr,"\r%9d files",get_file_count(w->m));
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef WALK_H
+#define WALK_H
+
+/* returns nonzero if the file should be registered with the matcher */
+typedef int walk_filter(const struct stat*,void*);
+
+struct walk_options {
+	int threads;        /* number of threads scanning directories */
+	int xdev;           /* stay on the file system of each root */
+	int verbose;        /* print the number of files found so far */
+	walk_filter *filter;
+	void *filter_arg;
+};
+
+/* Traverse the supplied directories in parallel and register every regular
+ * file that passes the filter with the matcher. Symbolic links are not
+ * followed. Roots and directories that cannot be read are reported and
+ * skipped. Returns 0 on success, 1 if a file could not be registered. */
+int walk_trees(struct matcher*,char *const*,int,const struct walk_options*);
+/* Register the regular files that pass the filter from a list of paths,
+ * each terminated by a NUL byte, read from the given file whose name is used
+ * in error messages. If records is set, each path is preceded by the size,
+ * device, inode number and modification time of the file, as printed by
+ * find -printf '%s %D %i %T@ %p\0'. The file is then only looked at if the
+ * matcher needs other fields. Files that cannot be found are reported and
+ * skipped. Returns 0 on success, 1 if a file could not be registered or the
+ * list could not be read. Of the options, only the filter and verbose are
+ * used. */
+int read_list(struct matcher*,FILE*,const char*,int,const struct walk_options*);
+
+#endif /* WALK_H */
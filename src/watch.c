@@ -0,0 +1,716 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
+/* for d_type */
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+
+#include "match.h"
+#include "walk.h"
+#include "watch.h"
+
+#ifdef __linux__
+
+# include <sys/inotify.h>
+# include <dirent.h>
+# include <errno.h>
+# include <limits.h>
+# include <poll.h>
+# include <stdbool.h>
+# include <stdint.h>
+# include <stdlib.h>
+# include <string.h>
+# include <time.h>
+# include <unistd.h>
+
+enum {
+	WATCH_QUIET = 1000, /* milliseconds without changes before a round */
+	WATCH_MAX = 10, /* seconds a change waits for its round at most */
+	MIN_BUCKETS = 1024
+};
+
+# define WATCH_EVENTS (IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)
+
+/* a regular file known to be in the watched trees */
+struct known_file {
+	char *path;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	int next_path; /* next file in the same bucket of by_path or -1 */
+	int next_size; /* next file in the same bucket of by_size or -1 */
+	unsigned round; /* the last round the file was registered in */
+	bool gone;
+};
+
+struct watch {
+	int fd; /* the inotify instance */
+	const struct walk_options *opts;
+	char **dirs; /* the directory of each watch descriptor or NULL */
+	int dir_count;
+	struct known_file *files; /* files that are gone are dropped lazily */
+	int file_count, file_size, gone_count;
+	int *by_path, *by_size; /* the first file in each bucket or -1 */
+	size_t bucket_count;
+	char **changed; /* paths changed since the last round */
+	int changed_count, changed_size;
+	unsigned round;
+};
+
+static int add_change(struct watch*,char*);
+static int add_file(struct watch*,const char*,const struct stat*);
+static int add_tree(struct watch*,const char*,bool);
+static int cmp_path(const void*,const void*);
+static int find_file(const struct watch*,const char*);
+static void forget_tree(struct watch*,const char*);
+static int handle_event(struct watch*,const struct inotify_event*);
+static size_t hash_path(const struct watch*,const char*);
+static size_t hash_size(const struct watch*,off_t);
+static char *join_path(const char*,const char*);
+static bool known_inode(const struct watch*,const struct stat*);
+static int rebuild_tables(struct watch*);
+static int run_round(struct watch*,watch_setup*,watch_action*,void*);
+static int wait_changes(struct watch*);
+static int watch_dir(struct watch*,const char*);
+
+struct watch *new_watch(char *const *roots, int count, const struct walk_options *opts) {
+	struct watch *w = calloc(1,sizeof *w);
+	struct stat st;
+	int i;
+
+	if (w == NULL) {
+		perror("Cannot allocate memory");
+		return NULL;
+	}
+
+	w->opts = opts;
+	w->fd = inotify_init1(IN_CLOEXEC);
+	if (w->fd == -1) {
+		perror("Cannot watch for changes");
+		free(w);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (lstat(roots[i],&st) == -1 || !S_ISDIR(st.st_mode)) continue;
+
+		if (add_tree(w,roots[i],false)) {
+			free_watch(w);
+			return NULL;
+		}
+	}
+
+	return w;
+}
+
+void free_watch(struct watch *w) {
+	int i;
+
+	close(w->fd);
+
+	for (i = 0; i < w->dir_count; i++) free(w->dirs[i]);
+	for (i = 0; i < w->file_count; i++) free(w->files[i].path);
+	for (i = 0; i < w->changed_count; i++) free(w->changed[i]);
+
+	free(w->dirs);
+	free(w->files);
+	free(w->by_path);
+	free(w->by_size);
+	free(w->changed);
+	free(w);
+}
+
+int watch_trees(struct watch *w, struct matcher *m, watch_setup *setup,
+    watch_action *act, void *arg) {
+	struct stat st;
+	const char *path;
+	int i, count = get_file_count(m);
+
+	/* the first search may have turned files into links */
+	for (i = 0; i < count; i++) {
+		path = get_file(m,i,&st);
+		if (path == NULL) return 1;
+
+		if (lstat(path,&st) == 0 && S_ISREG(st.st_mode) && add_file(w,path,&st))
+			return 1;
+	}
+
+	if (w->opts->verbose) fprintf(stderr,"Watching %d files for changes...\n",
+	    w->file_count - w->gone_count);
+
+	for (;;) {
+		if (wait_changes(w)) return 1;
+		if (run_round(w,setup,act,arg)) return 1;
+	}
+}
+
+/* Watch a directory and the directories below it. If changed is set, the
+ * regular files found are taken as changed. Directories that can't be
+ * read are reported and skipped. Returns 0 on success. */
+static int add_tree(struct watch *w, const char *root, bool changed) {
+	char **stack = NULL, **new_stack, *dir, *path;
+	size_t count = 0, size = 0;
+	struct dirent *de;
+	struct stat st, dir_st;
+	DIR *d;
+	int retval = 0;
+
+	dir = strdup(root);
+	if (dir == NULL) goto nomem;
+
+	for (;;) {
+		if (lstat(dir,&dir_st) == -1 || watch_dir(w,dir) == -1 || (d = opendir(dir)) == NULL) {
+			if (errno == ENOSPC || errno == ENOMEM) {
+				if (errno == ENOSPC)
+					fprintf(stderr,"\nCannot watch %s: too many directories to watch\n",dir);
+				else
+					perror("Cannot allocate memory");
+
+				free(dir);
+				retval = 1;
+				break;
+			}
+
+			fprintf(stderr,"\nCannot watch %s: ",dir);
+			perror(NULL);
+			d = NULL;
+		}
+
+		while (d != NULL && (de = readdir(d)) != NULL) {
+			if (strcmp(de->d_name,".") == 0 || strcmp(de->d_name,"..") == 0) continue;
+			if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN
+			    && (!changed || de->d_type != DT_REG))
+				continue;
+
+			path = join_path(dir,de->d_name);
+			if (path == NULL) {
+				closedir(d);
+				free(dir);
+				goto nomem;
+			}
+
+			if (lstat(path,&st) == -1) {
+				free(path);
+				continue;
+			}
+
+			if (S_ISREG(st.st_mode) && changed) {
+				if (add_change(w,path)) {
+					closedir(d);
+					free(dir);
+					goto nomem;
+				}
+
+				continue;
+			}
+
+			if (!S_ISDIR(st.st_mode) || (w->opts->xdev && st.st_dev != dir_st.st_dev)) {
+				free(path);
+				continue;
+			}
+
+			if (count == size) {
+				size = 2 * size + 16;
+				new_stack = realloc(stack,size * sizeof *stack);
+				if (new_stack == NULL) {
+					free(path);
+					closedir(d);
+					free(dir);
+					goto nomem;
+				}
+
+				stack = new_stack;
+			}
+
+			stack[count++] = path;
+		}
+
+		if (d != NULL) closedir(d);
+		free(dir);
+
+		if (count == 0) break;
+		dir = stack[--count];
+	}
+
+	while (count > 0) free(stack[--count]);
+	free(stack);
+
+	return retval;
+
+	nomem:
+	perror("Cannot allocate memory");
+	while (count > 0) free(stack[--count]);
+	free(stack);
+
+	return 1;
+}
+
+/* Add a watch for a directory and remember its path. Returns the watch
+ * descriptor or -1 on error with errno set. */
+static int watch_dir(struct watch *w, const char *dir) {
+	char **dirs, *path;
+	int wd, n;
+
+	wd = inotify_add_watch(w->fd,dir,WATCH_EVENTS|IN_ONLYDIR|IN_DONT_FOLLOW);
+	if (wd == -1) return -1;
+
+	if (wd >= w->dir_count) {
+		n = 2 * wd + 16;
+		dirs = realloc(w->dirs,n * sizeof *dirs);
+		if (dirs == NULL) goto nomem;
+
+		memset(dirs + w->dir_count,0,(n - w->dir_count) * sizeof *dirs);
+		w->dirs = dirs;
+		w->dir_count = n;
+	}
+
+	path = strdup(dir);
+	if (path == NULL) goto nomem;
+
+	/* a directory watched before keeps its watch descriptor */
+	free(w->dirs[wd]);
+	w->dirs[wd] = path;
+
+	return wd;
+
+	nomem:
+	inotify_rm_watch(w->fd,wd);
+	errno = ENOMEM;
+	return -1;
+}
+
+/* Wait for changes until none arrived for WATCH_QUIET milliseconds or the
+ * first change waited for WATCH_MAX seconds. Returns 0 on success. */
+static int wait_changes(struct watch *w) {
+	union {
+		struct inotify_event event;
+		char bytes[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	} buf;
+	const struct inotify_event *ev;
+	struct pollfd pfd;
+	time_t first = 0;
+	ssize_t len;
+	char *p;
+	int n;
+
+	pfd.fd = w->fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		if (w->changed_count > 0 && time(NULL) - first >= WATCH_MAX) return 0;
+
+		n = poll(&pfd,1,w->changed_count > 0 ? WATCH_QUIET : -1);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1) {
+			perror("Cannot wait for changes");
+			return 1;
+		}
+
+		if (n == 0) return 0;
+
+		len = read(w->fd,buf.bytes,sizeof buf.bytes);
+		if (len == -1 && errno == EINTR) continue;
+		if (len <= 0) {
+			perror("Cannot read changes");
+			return 1;
+		}
+
+		for (p = buf.bytes; p < buf.bytes + len; p += sizeof *ev + ev->len) {
+			ev = (const struct inotify_event*)p;
+			if (w->changed_count == 0) first = time(NULL);
+			if (handle_event(w,ev)) return 1;
+		}
+	}
+}
+
+/* returns 0 on success */
+static int handle_event(struct watch *w, const struct inotify_event *ev) {
+	char *path;
+	int i, retval = 0;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		fputs("\nToo many changes at once, some of them went unnoticed\n",stderr);
+		return 0;
+	}
+
+	if (ev->wd < 0 || ev->wd >= w->dir_count || w->dirs[ev->wd] == NULL) return 0;
+
+	if (ev->mask & IN_IGNORED) {
+		free(w->dirs[ev->wd]);
+		w->dirs[ev->wd] = NULL;
+		return 0;
+	}
+
+	if (ev->len == 0) return 0;
+
+	path = join_path(w->dirs[ev->wd],ev->name);
+	if (path == NULL) {
+		perror("Cannot allocate memory");
+		return 1;
+	}
+
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE|IN_MOVED_TO)) retval = add_tree(w,path,true);
+		else if (ev->mask & (IN_DELETE|IN_MOVED_FROM)) forget_tree(w,path);
+		free(path);
+	} else if (ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) {
+		if (add_change(w,path)) {
+			perror("Cannot allocate memory");
+			retval = 1;
+		}
+	} else {
+		if (ev->mask & (IN_DELETE|IN_MOVED_FROM)) {
+			i = find_file(w,path);
+			if (i != -1) {
+				w->files[i].gone = true;
+				w->gone_count++;
+			}
+		}
+
+		free(path);
+	}
+
+	return retval;
+}
+
+/* Forget the files below a directory that went away and stop watching the
+ * directories below it. */
+static void forget_tree(struct watch *w, const char *dir) {
+	size_t len = strlen(dir);
+	int i;
+
+	for (i = 0; i < w->file_count; i++)
+		if (!w->files[i].gone && strncmp(w->files[i].path,dir,len) == 0
+		    && w->files[i].path[len] == '/') {
+			w->files[i].gone = true;
+			w->gone_count++;
+		}
+
+	for (i = 0; i < w->dir_count; i++)
+		if (w->dirs[i] != NULL && strncmp(w->dirs[i],dir,len) == 0
+		    && (w->dirs[i][len] == '/' || w->dirs[i][len] == '\0')) {
+			inotify_rm_watch(w->fd,i);
+			free(w->dirs[i]);
+			w->dirs[i] = NULL;
+		}
+}
+
+/* take over a changed path; returns 0 on success */
+static int add_change(struct watch *w, char *path) {
+	char **changed;
+	int size;
+
+	if (w->changed_count == w->changed_size) {
+		size = 2 * w->changed_size + 64;
+		changed = realloc(w->changed,size * sizeof *changed);
+		if (changed == NULL) {
+			free(path);
+			return 1;
+		}
+
+		w->changed = changed;
+		w->changed_size = size;
+	}
+
+	w->changed[w->changed_count++] = path;
+
+	return 0;
+}
+
+/* Check the changed files against the known files of the same size. Files
+ * that turned into links to other known files, like those fdup just made,
+ * are only noted. A file written in place keeps its inode, so it is checked
+ * even if it has other links. A round that fails to act is reported, but
+ * does not end the watch, as files may change under it at any time.
+ * Returns 0 unless watching can't go on. */
+static int run_round(struct watch *w, watch_setup *setup, watch_action *act, void *arg) {
+	const struct walk_options *opts = w->opts;
+	struct matcher *m = NULL;
+	struct stat st;
+	const char **fresh = NULL;
+	off_t size;
+	int i, j, k, fresh_count = 0, others = 0, retval = 1;
+	bool in_place;
+
+	qsort(w->changed,w->changed_count,sizeof *w->changed,cmp_path);
+
+	fresh = malloc((w->changed_count + 1) * sizeof *fresh);
+	m = setup(arg);
+	if (fresh == NULL || m == NULL) {
+		if (fresh == NULL) perror("Cannot allocate memory");
+		goto done;
+	}
+
+	w->round++;
+
+	for (i = 0; i < w->changed_count; i++) {
+		if (i > 0 && strcmp(w->changed[i],w->changed[i-1]) == 0) continue;
+
+		j = find_file(w,w->changed[i]);
+		if (j != -1) {
+			w->files[j].gone = true;
+			w->gone_count++;
+		}
+
+		if (lstat(w->changed[i],&st) == -1 || !S_ISREG(st.st_mode)) continue;
+		if (opts->filter != NULL && !opts->filter(&st,opts->filter_arg)) continue;
+
+		in_place = j != -1 && w->files[j].dev == st.st_dev && w->files[j].ino == st.st_ino;
+		if (!in_place && known_inode(w,&st)) {
+			if (add_file(w,w->changed[i],&st)) goto done;
+			continue;
+		}
+
+		if (add_file(w,w->changed[i],&st)) goto done;
+
+		j = w->file_count - 1;
+		w->files[j].round = w->round;
+		fresh[fresh_count++] = w->changed[i];
+
+		/* the known files this one could be equal to */
+		size = st.st_size;
+		for (k = w->by_size[hash_size(w,size)]; k != -1; k = w->files[k].next_size) {
+			if (w->files[k].gone || w->files[k].size != size
+			    || w->files[k].round == w->round)
+				continue;
+
+			w->files[k].round = w->round;
+			if (lstat(w->files[k].path,&st) == -1 || !S_ISREG(st.st_mode)
+			    || st.st_size != w->files[k].size)
+				continue;
+
+			if (register_file(m,w->files[k].path,&st)) goto done;
+			others++;
+		}
+	}
+
+	/* the known files come first, so they are the ones linked to */
+	for (i = 0; i < fresh_count; i++)
+		if (lstat(fresh[i],&st) == 0 && register_file(m,fresh[i],&st)) goto done;
+
+	retval = 0;
+	if (fresh_count == 0 || fresh_count + others < 2) goto done;
+
+	if (opts->verbose) fprintf(stderr,"Checking %d changed files against %d others...\n",
+	    fresh_count,others);
+
+	if (finalize_matcher(m) || act(m,fresh,fresh_count,arg))
+		fprintf(stderr,"Could not act on all %d changed files, watching on\n",fresh_count);
+
+	done:
+	if (m != NULL) free_matcher(m);
+	free(fresh);
+
+	for (i = 0; i < w->changed_count; i++) free(w->changed[i]);
+	w->changed_count = 0;
+
+	return retval;
+}
+
+/* is the file a link to a known file? */
+static bool known_inode(const struct watch *w, const struct stat *st) {
+	int i;
+
+	if (w->bucket_count == 0) return false;
+
+	for (i = w->by_size[hash_size(w,st->st_size)]; i != -1; i = w->files[i].next_size)
+		if (!w->files[i].gone && w->files[i].dev == st->st_dev && w->files[i].ino == st->st_ino)
+			return true;
+
+	return false;
+}
+
+/* the index of the known file with that path or -1 */
+static int find_file(const struct watch *w, const char *path) {
+	int i;
+
+	if (w->bucket_count == 0) return -1;
+
+	for (i = w->by_path[hash_path(w,path)]; i != -1; i = w->files[i].next_path)
+		if (!w->files[i].gone && strcmp(w->files[i].path,path) == 0)
+			return i;
+
+	return -1;
+}
+
+/* add a file to the known files as the last one; returns 0 on success */
+static int add_file(struct watch *w, const char *path, const struct stat *st) {
+	struct known_file *files, *f;
+	size_t b;
+	int size;
+
+	if (w->file_count == w->file_size) {
+		size = 2 * w->file_size + 1024;
+		files = realloc(w->files,size * sizeof *files);
+		if (files == NULL) {
+			perror("Cannot allocate memory");
+			return 1;
+		}
+
+		w->files = files;
+		w->file_size = size;
+	}
+
+	f = w->files + w->file_count;
+	f->path = strdup(path);
+	if (f->path == NULL) {
+		perror("Cannot allocate memory");
+		return 1;
+	}
+
+	f->size = st->st_size;
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	f->round = 0;
+	f->gone = false;
+	w->file_count++;
+
+	/* drop the files that are gone once they make up half of all */
+	if ((size_t)w->file_count > w->bucket_count || w->gone_count > w->file_count / 2)
+		return rebuild_tables(w);
+
+	b = hash_path(w,f->path);
+	f->next_path = w->by_path[b];
+	w->by_path[b] = w->file_count - 1;
+
+	b = hash_size(w,f->size);
+	f->next_size = w->by_size[b];
+	w->by_size[b] = w->file_count - 1;
+
+	return 0;
+}
+
+/* Drop the files that are gone and rehash the others, keeping their order.
+ * Returns 0 on success. */
+static int rebuild_tables(struct watch *w) {
+	size_t buckets = MIN_BUCKETS, b;
+	int *by_path, *by_size, i, n;
+
+	for (i = n = 0; i < w->file_count; i++) {
+		if (w->files[i].gone) free(w->files[i].path);
+		else w->files[n++] = w->files[i];
+	}
+
+	w->file_count = n;
+	w->gone_count = 0;
+
+	while (buckets < 2 * (size_t)n) buckets *= 2;
+
+	if (buckets != w->bucket_count) {
+		by_path = realloc(w->by_path,buckets * sizeof *by_path);
+		if (by_path != NULL) w->by_path = by_path;
+		by_size = realloc(w->by_size,buckets * sizeof *by_size);
+		if (by_size != NULL) w->by_size = by_size;
+
+		if (by_path == NULL || by_size == NULL) {
+			perror("Cannot allocate memory");
+			return 1;
+		}
+
+		w->bucket_count = buckets;
+	}
+
+	for (b = 0; b < buckets; b++) w->by_path[b] = w->by_size[b] = -1;
+
+	for (i = 0; i < n; i++) {
+		b = hash_path(w,w->files[i].path);
+		w->files[i].next_path = w->by_path[b];
+		w->by_path[b] = i;
+
+		b = hash_size(w,w->files[i].size);
+		w->files[i].next_size = w->by_size[b];
+		w->by_size[b] = i;
+	}
+
+	return 0;
+}
+
+static int cmp_path(const void *a, const void *b) {
+	return strcmp(*(char *const*)a,*(char *const*)b);
+}
+
+/* FNV-1a */
+static size_t hash_path(const struct watch *w, const char *path) {
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+	while (*path != '\0') h = (h ^ (unsigned char)*path++) * UINT64_C(0x100000001b3);
+
+	return h & (w->bucket_count - 1);
+}
+
+static size_t hash_size(const struct watch *w, off_t size) {
+	uint64_t h = (uint64_t)size * UINT64_C(0x9e3779b97f4a7c15);
+
+	return (h >> 32) & (w->bucket_count - 1);
+}
+
+/* returns a newly allocated string dir/name or NULL if out of memory */
+static char *join_path(const char *dir, const char *name) {
+	size_t dir_len = strlen(dir), name_len = strlen(name);
+	char *path = malloc(dir_len + name_len + 2);
+
+	if (path == NULL) return NULL;
+
+	memcpy(path,dir,dir_len);
+	if (dir_len == 0 || dir[dir_len-1] != '/') path[dir_len++] = '/';
+	memcpy(path+dir_len,name,name_len+1);
+
+	return path;
+}
+
+#else
+
+struct watch *new_watch(char *const *roots, int count, const struct walk_options *opts) {
+	(void)roots;
+	(void)count;
+	(void)opts;
+	fputs("Watching for changes is only supported on Linux\n",stderr);
+	return NULL;
+}
+
+int watch_trees(struct watch *w, struct matcher *m, watch_setup *setup,
+    watch_action *act, void *arg) {
+	(void)w;
+	(void)m;
+	(void)setup;
+	(void)act;
+	(void)arg;
+	return 1;
+}
+
+void free_watch(struct watch *w) {
+	(void)w;
+}
+
+#endif
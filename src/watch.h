@@ -0,0 +1,50 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+/* After the first search, fdup can keep watching the supplied directories
+ * for files that are written, created or moved there. The changed files are
+ * collected until no further changes arrive for a moment. Each round then
+ * checks only the changed files against the known files of the same size,
+ * with a matcher of their own. This only works on Linux. */
+
+/* returns a new matcher set up like the first one or NULL on error */
+typedef struct matcher *watch_setup(void*);
+/* Act on the groups of a finalized matcher. The paths of the changed files
+ * it was given are passed in sorted order. Returns 0 on success. */
+typedef int watch_action(struct matcher*,const char*const*,int,void*);
+
+/* Start watching the directories among the supplied paths and all
+ * directories below them. Of the options, xdev, verbose and the filter are
+ * used. Call before the first search, so no change made during it is lost.
+ * Returns NULL on error. */
+struct watch *new_watch(char *const*,int,const struct walk_options*);
+/* Learn the files of the finalized matcher of the first search and act on
+ * each round of changes for as long as fdup runs. Only returns on error. */
+int watch_trees(struct watch*,struct matcher*,watch_setup*,watch_action*,void*);
+void free_watch(struct watch*);
+
+#endif /* WATCH_H */
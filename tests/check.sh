@@ -0,0 +1,170 @@
+#!/bin/sh
+# Copyright (c) 2013, Robert Clausecker
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#    list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# usage: check.sh fdup
+#
+# Build a tree of files that are equal, or differ only at the beginning, in
+# the middle or at the end, and check that each way to find the duplicates
+# finds the same groups as a plain run. The order of the groups and of the
+# files in each group is not fixed, so both are sorted before comparing.
+
+FDUP=${1:-../src/fdup}
+case $FDUP in
+/*) ;;
+*) FDUP=`pwd`/$FDUP ;;
+esac
+
+TMP=`mktemp -d "${TMPDIR:-/tmp}/fdup-check.XXXXXX"` || exit 1
+trap 'rm -rf "$TMP"' EXIT
+trap 'exit 1' HUP INT TERM
+cd "$TMP" || exit 1
+
+failed=0
+
+fail() {
+	echo "FAIL: $*"
+	failed=1
+}
+
+# print each group as one line of sorted paths, the lines sorted
+normalize() {
+	awk 'BEGIN { g = 0 } NF == 0 { g++; next } { print g "\t" $0 }' |
+	sort -k1,1n -k2 |
+	awk -F '\t' '$1 != g { if (NR > 1) print l; l = ""; g = $1 }
+	    { l = l " " $2 } END { if (NR > 0) print l }' |
+	sort
+}
+
+# copy count bytes of random data to a file
+random() {
+	dd if=/dev/urandom of="$1" bs="$2" count=1 2>/dev/null
+}
+
+# overwrite one byte of a file at the given offset
+poke() {
+	printf x | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# the tree: a few groups of each kind
+mkdir -p tree/a tree/b/c tree/d
+random tree/a/big 100000
+cp tree/a/big tree/b/big
+cp tree/a/big tree/b/c/big
+for where in 0 50000 99999; do
+	cp tree/a/big tree/d/big.$where
+	poke tree/d/big.$where $where
+done
+cp tree/d/big.50000 tree/b/big.50000
+random tree/a/huge 5000000
+cp tree/a/huge tree/d/huge
+cp tree/a/huge tree/d/huge.2
+poke tree/d/huge.2 2500000
+for n in 1 2 3 4 5 6; do
+	echo five > tree/b/five.$n
+done
+echo two > tree/a/two
+echo two > tree/d/two
+echo one > tree/d/one
+: > tree/a/empty
+: > tree/d/empty
+ln tree/a/two tree/b/two.link
+ln -s ../a/big tree/d/big.symlink
+for n in 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19; do
+	mkdir -p tree/many/$n
+	for m in 0 1 2 3 4 5 6 7 8 9; do
+		echo $m$n > tree/many/$n/$m
+		echo $m > tree/many/$n/x$m
+	done
+done
+
+# check an option against the plain run
+same() {
+	"$FDUP" "$@" >out 2>err || { fail "$*: exit status $?"; cat err; return; }
+	normalize <out >got
+	cmp -s want got || { fail "$*"; diff want got | head; }
+}
+
+"$FDUP" -j1 tree >out || { fail "plain run: exit status $?"; exit 1; }
+normalize <out >want
+grep -q 'tree/a/big tree/b/big tree/b/c/big' want || fail "plain run misses a group"
+grep -q 'tree/a/huge tree/d/huge$' want || fail "plain run misses the large group"
+grep -q 'big.50000' want || fail "plain run misses a group differing in the middle"
+
+same -j4 tree
+same -j4 -i tree
+same -i tree
+same -c '' tree
+same -c h1K tree
+same -c h4K,m4K,t4K tree
+same -c t1 tree
+same -M 4K tree
+same -M 4K -j4 tree
+same -r read tree
+same -r direct tree
+same -r mmap tree
+same -r uring tree
+same -r uring -j4 tree
+same -a sha1 tree
+same -a sha256 tree
+same -a fast tree
+same -a fast -c h1K,t1K tree
+same -x tree
+same -C cache tree
+same -C cache tree
+same -C cache -j4 tree
+same -C cache -i tree
+same -C cache -c h1K tree
+same -C cache -c '' tree
+
+# the lists of -f and -F instead of the walk
+find tree -type f -print0 >list0
+find tree -type f -printf '%s %D %i %T@ %p\0' >records
+same -f list0
+same -f list0 -j4
+same -F records
+same -F records -C cache
+same -F - <records
+
+# an index of part of the tree, checked against the rest
+"$FDUP" -W index tree/a || fail "-W: exit status $?"
+"$FDUP" -R index tree/a >out || fail "-R: exit status $?"
+test -s out && fail "-R reports indexed files"
+"$FDUP" -R index tree/b >out || fail "-R: exit status $?"
+grep -q '^tree/b/c/big$' out || fail "-R misses a duplicate"
+grep -q "^`pwd -P`/tree/a/big\$" out || fail "-R misses an indexed file"
+
+# links leave the contents alone and leave no duplicates but hardlinks
+for mode in H S; do
+	rm -rf linked
+	cp -R tree linked
+	(cd linked && find . \( -type f -o -type l \) -exec cksum {} + | sort) >before
+	"$FDUP" -$mode linked >out 2>err || { fail "-$mode: exit status $?"; cat err; }
+	(cd linked && find . \( -type f -o -type l \) -exec cksum {} + | sort) >after
+	cmp -s before after || fail "-$mode changes contents"
+	"$FDUP" -b l linked >out
+	test -s out && fail "-$mode leaves duplicates"
+done
+
+test $failed = 0 && echo "All checks passed."
+exit $failed
@@ -0,0 +1,180 @@
+/* Copyright (c) 2013, Robert Clausecker
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+/* Check the hashes of hash.c against OpenSSL and against each other: the
+ * SHA-1 lanes on mixed batches of messages, hash_many and the fast hash fed
+ * in pieces. hash.c is included to get at the lanes on any processor that
+ * has them, not only where hash_batches picks them. */
+
+#include "../src/hash.c"
+
+#include <stdlib.h>
+
+enum {
+	BATCHES = 3000,
+	MAX_MESSAGE = 3 * 4096 + 100 /* a few messages cross many blocks */
+};
+
+static unsigned char pool[MAX_MESSAGE + HASH_LANES];
+static int failures = 0;
+
+static void check(const char*,int,const unsigned char*,const unsigned char*,int);
+static size_t random_length(void);
+static void test_fast(void);
+static void test_many(enum hash_algorithm);
+#ifdef HAVE_SHA1_LANES
+static void test_lanes(const char*,void (*)(uint32_t[5][HASH_LANES],lanes*,uint32_t));
+#endif
+
+int main(void) {
+	size_t i;
+
+	srand(1);
+	for (i = 0; i < sizeof pool; i++) pool[i] = rand();
+
+#ifdef HAVE_SHA1_LANES
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) test_lanes("avx2",sha1_blocks_avx2);
+	if (__builtin_cpu_supports("avx512f")) test_lanes("avx512",sha1_blocks_avx512);
+#endif
+
+	test_many(HASH_SHA1);
+	test_many(HASH_SHA256);
+	test_many(HASH_FAST);
+	test_fast();
+
+	return failures != 0;
+}
+
+static void check(const char *what, int batch, const unsigned char *got,
+    const unsigned char *want, int len) {
+	if (memcmp(got,want,len) == 0) return;
+
+	if (failures++ < 10) fprintf(stderr,"%s: wrong hash in batch %d\n",what,batch);
+}
+
+/* mostly short messages around the block size, some long ones */
+static size_t random_length(void) {
+	switch (rand() % 4) {
+	case 0: return rand() % 4;
+	case 1: return 55 + rand() % 10; /* where the padding takes a second block */
+	case 2: return rand() % 512;
+	default: return rand() % MAX_MESSAGE;
+	}
+}
+
+#ifdef HAVE_SHA1_LANES
+/* each batch of the lanes against OpenSSL */
+static void test_lanes(const char *name,
+    void (*blocks)(uint32_t[5][HASH_LANES],lanes*,uint32_t)) {
+	unsigned char out[HASH_LANES][HASH_MAX_LENGTH], want[EVP_MAX_MD_SIZE];
+	unsigned char *hashes[HASH_LANES];
+	const unsigned char *data[HASH_LANES];
+	size_t lengths[HASH_LANES];
+	int batch, count, i;
+
+	for (i = 0; i < HASH_LANES; i++) hashes[i] = out[i];
+
+	for (batch = 0; batch < BATCHES; batch++) {
+		count = 1 + rand() % HASH_LANES;
+		for (i = 0; i < count; i++) {
+			lengths[i] = random_length();
+			data[i] = pool + rand() % HASH_LANES;
+		}
+
+		sha1_many(count,data,lengths,hashes,blocks);
+
+		for (i = 0; i < count; i++) {
+			EVP_Digest(data[i],lengths[i],want,NULL,EVP_sha1(),NULL);
+			check(name,batch,out[i],want,20);
+		}
+	}
+}
+#endif
+
+/* hash_many against hashing one message after another */
+static void test_many(enum hash_algorithm algorithm) {
+	unsigned char out[HASH_LANES][HASH_MAX_LENGTH], want[HASH_MAX_LENGTH];
+	unsigned char *hashes[HASH_LANES];
+	const unsigned char *data[HASH_LANES];
+	size_t lengths[HASH_LANES];
+	struct hasher h;
+	int batch, count, i;
+
+	h.evp = NULL;
+	for (i = 0; i < HASH_LANES; i++) hashes[i] = out[i];
+
+	for (batch = 0; batch < BATCHES / 10; batch++) {
+		count = 1 + rand() % HASH_LANES;
+		for (i = 0; i < count; i++) {
+			lengths[i] = random_length();
+			data[i] = pool + rand() % HASH_LANES;
+		}
+
+		hash_many(algorithm,count,data,lengths,hashes);
+
+		for (i = 0; i < count; i++) {
+			if (hasher_init(&h,algorithm) != 0) {
+				fprintf(stderr,"Cannot set up %s\n",algorithms[algorithm].name);
+				exit(1);
+			}
+
+			hasher_update(&h,data[i],lengths[i]);
+			hasher_final(&h,want);
+			check("hash_many",batch,out[i],want,hash_length(algorithm));
+		}
+	}
+
+	hasher_free(&h);
+}
+
+/* the fast hash must not depend on how the message is cut into pieces */
+static void test_fast(void) {
+	unsigned char got[HASH_MAX_LENGTH], want[HASH_MAX_LENGTH];
+	struct hasher h;
+	size_t len, off, piece;
+	int batch;
+
+	h.evp = NULL;
+
+	for (batch = 0; batch < BATCHES / 10; batch++) {
+		len = random_length();
+
+		hasher_init(&h,HASH_FAST);
+		hasher_update(&h,pool,len);
+		hasher_final(&h,want);
+
+		hasher_init(&h,HASH_FAST);
+		for (off = 0; off < len; off += piece) {
+			piece = 1 + rand() % 200;
+			if (piece > len - off) piece = len - off;
+			hasher_update(&h,pool + off,piece);
+		}
+		hasher_final(&h,got);
+
+		check("fast",batch,got,want,hash_length(HASH_FAST));
+	}
+
+	hasher_free(&h);
+}